@@ -13,6 +13,16 @@ static int ValueSize = 48;
 static int SecondsRuntime = 0;
 static int BatchSize = 1;
 static const char *Hostname = "localhost:8091";
+static const char *StatsSegment = NULL;
+static int UseMtSched = 0;
+static int SharedKey = 0;
+static int CacheBytes = 0;
+static int BatchWindow = 0;
+static int CoalesceStores = 0;
+static int LeaderFollower = 0;
+static int InlineCallbacks = 0;
+static int ExecutorThreads = 0;
+static int CopyPoolBytes = 0;
 
 static cliopts_entry entries[] = {
     { 't', "threads", CLIOPTS_ARGT_INT, &ThreadCount },
@@ -20,6 +30,16 @@ static cliopts_entry entries[] = {
     { 'T', "time", CLIOPTS_ARGT_INT, &SecondsRuntime },
     { 's', "schedsize", CLIOPTS_ARGT_INT, &BatchSize },
     { 'H', "host", CLIOPTS_ARGT_STRING, &Hostname },
+    { 0, "stats-shm", CLIOPTS_ARGT_STRING, &StatsSegment },
+    { 0, "mt-sched", CLIOPTS_ARGT_NONE, &UseMtSched },
+    { 0, "shared-key", CLIOPTS_ARGT_NONE, &SharedKey },
+    { 0, "cache", CLIOPTS_ARGT_INT, &CacheBytes },
+    { 0, "batch-window", CLIOPTS_ARGT_INT, &BatchWindow },
+    { 0, "coalesce-stores", CLIOPTS_ARGT_NONE, &CoalesceStores },
+    { 0, "leader-follower", CLIOPTS_ARGT_NONE, &LeaderFollower },
+    { 0, "inline-callbacks", CLIOPTS_ARGT_NONE, &InlineCallbacks },
+    { 0, "executor", CLIOPTS_ARGT_INT, &ExecutorThreads },
+    { 0, "copy-pool", CLIOPTS_ARGT_INT, &CopyPoolBytes },
     { 0, NULL }
 };
 
@@ -47,12 +67,17 @@ static void *stats_dumper(void *arg)
                 (float)global_opcount / (float)(now - global_begin_time);
 
         printf("Ops/Sec: %0.2f, ", ops_per_sec);
-        printf("Total: %lu, Invoked: %lu, Notified: %lu, Fast: %lu; QMax: %lu\n",
+        printf("Total: %lu, Invoked: %lu, Notified: %lu, Fast: %lu; QMax: %lu; "
+               "Joined: %lu; Cached: %lu; Batches: %lu; Copied: %lu\n",
                global_opcount,
-               info->mt->enter_count,
+               info->mt->loop->enter_count,
                info->mt->notify_count,
                info->mt->fast_count,
-               info->mt->max_queue);
+               info->mt->loop->max_queue,
+               info->mt->flight_joins,
+               info->mt->cache_hits,
+               info->mt->batch_flushes,
+               info->mt->responses_copied);
 
         if (SecondsRuntime &&
                 now - global_begin_time > SecondsRuntime) {
@@ -96,20 +121,36 @@ static void run_single_op(void *arg)
     lcb_mt_token_set_cookie(info->token, info);
     lcb_mt_token_set_count(info->token, BatchSize);
 
-    /** Lock for scheduling */
-    lcb_mt_lock(info->mt);
-    for (ii = 0; ii < BatchSize; ii++) {
-        err = lcb_store(info->instance, info->token, 1, &info->store_p);
-        assert(err == LCB_SUCCESS);
+    if (UseMtSched) {
+        for (ii = 0; ii < BatchSize; ii++) {
+            err = lcb_mt_store(info->token, 1, &info->store_p);
+            assert(err == LCB_SUCCESS);
+        }
+    } else {
+        /** Lock for scheduling */
+        lcb_mt_lock(info->mt);
+        for (ii = 0; ii < BatchSize; ii++) {
+            err = lcb_store(info->instance, info->token, 1, &info->store_p);
+            assert(err == LCB_SUCCESS);
+        }
+        /** Scheduling done. Unlock */
+        lcb_mt_unlock(info->mt);
     }
-    /** Scheduling done. Unlock */
-    lcb_mt_unlock(info->mt);
     /** Equivalent of 'lcb_wait */
     lcb_mt_token_wait(info->token);
 
     /* Now get a key */
-    lcb_mt_lock(info->mt);
     lcb_mt_token_set_count(info->token, BatchSize);
+    if (UseMtSched) {
+        for (ii = 0; ii < BatchSize; ii++) {
+            err = lcb_mt_get(info->token, 1, &info->get_p);
+            assert(err == LCB_SUCCESS);
+        }
+        lcb_mt_token_wait(info->token);
+        return;
+    }
+
+    lcb_mt_lock(info->mt);
     for (ii = 0; ii < BatchSize; ii++) {
         err = lcb_get(info->instance, info->token, 1, &info->get_p);
         assert(err == LCB_SUCCESS);
@@ -174,7 +215,9 @@ int main(int argc, char **argv)
 
     instance = setup_instance(io);
 
-    err = lcb_mt_init(&ctx, instance, io);
+    err = lcb_mt_init_ex(&ctx, instance, io,
+                         (LeaderFollower ? LCBMT_INIT_LEADER_FOLLOWER : 0) |
+                         (InlineCallbacks ? LCBMT_INIT_INLINE_CALLBACKS : 0));
     assert(err == LCB_SUCCESS);
 
     cbtable.v.v0.store = storage_callback;
@@ -182,6 +225,37 @@ int main(int argc, char **argv)
 
     lcb_mt_set_callbacks(ctx, &cbtable);
 
+    if (CacheBytes) {
+        err = lcb_mt_enable_cache(ctx, CacheBytes, 1000);
+        assert(err == LCB_SUCCESS);
+    }
+
+    if (CopyPoolBytes) {
+        err = lcb_mt_enable_response_copy(ctx, CopyPoolBytes);
+        assert(err == LCB_SUCCESS);
+    }
+
+    if (CoalesceStores) {
+        err = lcb_mt_enable_store_coalescing(ctx);
+        assert(err == LCB_SUCCESS);
+    }
+
+    if (ExecutorThreads) {
+        lcbmt_executor_t executor = lcb_mt_executor_create(ExecutorThreads);
+        assert(executor);
+        lcb_mt_set_executor(ctx, lcb_mt_executor_submit, executor);
+    }
+
+    if (BatchWindow) {
+        err = lcb_mt_enable_batching(ctx, BatchWindow, ThreadCount);
+        assert(err == LCB_SUCCESS);
+    }
+
+    if (StatsSegment) {
+        err = lcb_mt_stats_publish(ctx, StatsSegment);
+        assert(err == LCB_SUCCESS);
+    }
+
     /** Set up the per-thread information */
     for (ii = 0; ii < ThreadCount; ii++) {
         my_info *info = info_list + ii;
@@ -191,7 +265,7 @@ int main(int argc, char **argv)
         info->store_p = &info->scmd;
         info->get_p = &info->gcmd;
 
-        sprintf(info->kbuf, "ThrKey:%d\n", ii);
+        sprintf(info->kbuf, "ThrKey:%d\n", SharedKey ? 0 : ii);
         info->gcmd.v.v0.key = info->kbuf;
         info->gcmd.v.v0.nkey = strlen(info->kbuf);
         info->scmd.v.v0.key = info->gcmd.v.v0.key;
@@ -213,8 +287,8 @@ int main(int argc, char **argv)
         lcb_mt_token_destroy(info->token);
     }
 
-    lcb_destroy(instance);
     lcb_mt_destroy(ctx);
+    lcb_destroy(instance);
     lcb_destroy_io_ops(io);
     return 0;
 }
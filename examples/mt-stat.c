@@ -0,0 +1,146 @@
+#include <libcouchbase/lcbmt_stats.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "cliopts.h"
+
+/**
+ * Attaches to the statistics page published via lcb_mt_stats_publish()
+ * and prints live rates, in the same format as the stats dumper in mt89.
+ */
+
+static const char *SegmentName = "/lcbmt-stats";
+static int Interval = 1;
+
+static cliopts_entry entries[] = {
+    { 'n', "name", CLIOPTS_ARGT_STRING, &SegmentName },
+    { 'i', "interval", CLIOPTS_ARGT_INT, &Interval },
+    { 0, NULL }
+};
+
+/** Per-second rate of a counter between the two snapshots */
+#define RATE(field) ((float)(cur.field - prev.field) / secs)
+
+static void read_page(const volatile struct lcb_mt_stats_page *page,
+                      struct lcb_mt_stats_page *out)
+{
+    lcb_uint32_t seq;
+    do {
+        seq = page->seq;
+        __sync_synchronize();
+        memcpy(out, (const void *)page, sizeof(*out));
+        __sync_synchronize();
+    } while ((seq & 1) || seq != page->seq);
+}
+
+/**
+ * Returns the upper bound (in microseconds) of the bucket containing the
+ * given percentile of the samples added between the two snapshots.
+ */
+static unsigned long percentile(const struct lcb_mt_stats_histogram *cur,
+                                const struct lcb_mt_stats_histogram *prev,
+                                float pct)
+{
+    lcb_uint64_t total = cur->total - prev->total;
+    lcb_uint64_t seen = 0;
+    int ii;
+
+    if (!total) {
+        return 0;
+    }
+
+    for (ii = 0; ii < LCBMT_STATS_NBUCKETS; ii++) {
+        seen += cur->buckets[ii] - prev->buckets[ii];
+        if (seen >= total * pct) {
+            return 1UL << ii;
+        }
+    }
+    return 1UL << (LCBMT_STATS_NBUCKETS - 1);
+}
+
+int main(int argc, char **argv)
+{
+    int fd, argpos;
+    const volatile struct lcb_mt_stats_page *page;
+    struct lcb_mt_stats_page cur, prev;
+
+    if (cliopts_parse_options(entries, argc, argv, &argpos, NULL) == -1) {
+        exit(1);
+    }
+
+    fd = shm_open(SegmentName, O_RDONLY, 0);
+    if (fd == -1) {
+        perror(SegmentName);
+        exit(1);
+    }
+
+    page = mmap(NULL, sizeof(*page), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+
+    read_page(page, &prev);
+    if (prev.magic != LCBMT_STATS_MAGIC ||
+            prev.version != LCBMT_STATS_VERSION) {
+        fprintf(stderr, "%s: not a statistics page (or unknown version)\n",
+                SegmentName);
+        exit(1);
+    }
+
+    printf("Attached to %s (pid %u)\n", SegmentName, prev.pid);
+
+    while (1) {
+        float secs;
+        sleep(Interval);
+        read_page(page, &cur);
+
+        secs = (float)(cur.timestamp - prev.timestamp) / 1000000;
+        if (secs <= 0) {
+            printf("No updates\n");
+            continue;
+        }
+
+        printf("Invoked/Sec: %0.2f, Notified/Sec: %0.2f, Fast/Sec: %0.2f; ",
+               (cur.enter_count - prev.enter_count) / secs,
+               (cur.notify_count - prev.notify_count) / secs,
+               (cur.fast_count - prev.fast_count) / secs);
+
+        printf("Queue: %lu, QMax: %lu; ",
+               (unsigned long)cur.queue_depth,
+               (unsigned long)cur.max_queue);
+
+        printf("Lock wait p50/p99: %lu/%luus, Handoff p50/p99: %lu/%luus\n",
+               percentile(&cur.lock_wait, &prev.lock_wait, 0.50),
+               percentile(&cur.lock_wait, &prev.lock_wait, 0.99),
+               percentile(&cur.handoff, &prev.handoff, 0.50),
+               percentile(&cur.handoff, &prev.handoff, 0.99));
+
+        printf("  Joined/Sec: %0.2f, Copied/Sec: %0.2f; "
+               "Cache hits/misses per Sec: %0.2f/%0.2f, "
+               "Negative hits/Sec: %0.2f\n",
+               RATE(flight_joins),
+               RATE(responses_copied),
+               RATE(cache_hits), RATE(cache_misses),
+               RATE(negative_hits));
+        printf("  Batches/Sec: %0.2f, Batched/Sec: %0.2f; "
+               "Combined/Sec: %0.2f, Coalesced/Sec: %0.2f\n",
+               RATE(batch_flushes), RATE(batch_ops),
+               RATE(arithmetic_combined), RATE(stores_coalesced));
+        printf("  Retries/Sec: %0.2f, Timeouts/Sec: %0.2f; "
+               "Held/Sec: %0.2f, Shed/Sec: %0.2f; "
+               "Hedges/wins per Sec: %0.2f/%0.2f\n",
+               RATE(retries), RATE(timeouts),
+               RATE(lane_holds), RATE(ops_shed),
+               RATE(hedges), RATE(hedge_wins));
+        fflush(stdout);
+
+        prev = cur;
+    }
+
+    return 0;
+}
@@ -34,6 +34,50 @@ extern "C" {
 
 typedef struct lcbmt_ctx_st lcbmt_ctx_t, *lcbmt_t;
 typedef struct lcbmt_token_st *lcbmt_token_t;
+typedef struct lcbmt_loop_st *lcbmt_loop_t;
+
+/**
+ * Type of a response returned by lcb_mt_token_next()
+ */
+typedef enum {
+    LCBMT_RESP_STORE = 0,
+    LCBMT_RESP_GET,
+    LCBMT_RESP_REMOVE,
+    LCBMT_RESP_ARITHMETIC,
+    LCBMT_RESP_TOUCH,
+    LCBMT_RESP_UNLOCK,
+
+    /** Stats, HTTP, durability etc. These are never returned */
+    LCBMT_RESP_OTHER
+} lcbmt_resptype_t;
+
+/**
+ * A self-contained response. All pointers remain valid until the response
+ * is passed to lcb_mt_response_release(). Fields which don't apply to the
+ * response type are zero.
+ */
+struct lcb_mt_response {
+    lcbmt_resptype_t type;
+    lcb_error_t err;
+    const void *cookie;
+    const void *key;
+    lcb_size_t nkey;
+    lcb_cas_t cas;
+
+    /** LCBMT_RESP_GET */
+    const void *bytes;
+    lcb_size_t nbytes;
+    lcb_uint32_t flags;
+
+    /** LCBMT_RESP_ARITHMETIC */
+    lcb_uint64_t value;
+
+    /** LCBMT_RESP_STORE */
+    lcb_storage_t storop;
+
+    /** Private */
+    void *record;
+};
 
 struct lcb_mt_callback_table {
     int version;
@@ -66,6 +110,68 @@ struct lcb_mt_callback_table {
 LIBCOUCHBASE_API
 lcb_error_t lcb_mt_init(lcbmt_t *mt, lcb_t instance, lcb_io_opt_t io);
 
+/**
+ * Don't start an IO thread. Instead, one of the threads waiting in
+ * lcb_mt_token_wait() runs the event loop (becoming the 'leader'), and
+ * responses for its own token are delivered without any handoff. When its
+ * token is done, another waiting thread takes over.
+ *
+ * Note that in this mode operations only make progress while at least one
+ * thread is waiting in lcb_mt_token_wait().
+ */
+#define LCBMT_INIT_LEADER_FOLLOWER 0x01
+
+/**
+ * Apply LCBMT_TOKEN_INLINE_CALLBACKS to every token of the context
+ */
+#define LCBMT_INIT_INLINE_CALLBACKS 0x02
+
+/**
+ * Like lcb_mt_init(), with additional flags (LCBMT_INIT_*)
+ */
+LIBCOUCHBASE_API
+lcb_error_t lcb_mt_init_ex(lcbmt_t *mt,
+                           lcb_t instance,
+                           lcb_io_opt_t io,
+                           int flags);
+
+/**
+ * Create an event loop which several contexts may share (see
+ * lcb_mt_init_shared()), e.g. one per bucket. A single IO thread runs the
+ * instances of all of them, and they share one event lock.
+ * @param loop set to the new loop
+ * @param io the IO options used by the instances of all the contexts
+ *
+ * Instances are only run by the loop's thread, so to spread them over a
+ * few threads, create as many loops (each with IO options of its own).
+ */
+LIBCOUCHBASE_API
+lcb_error_t lcb_mt_loop_create(lcbmt_loop_t *loop, lcb_io_opt_t io);
+
+/**
+ * Like lcb_mt_init_ex(), but run the instance through a shared loop rather
+ * than an IO thread of its own. The instance must have been created with
+ * the loop's IO options. The loop's thread is started when the first
+ * context is attached; all instances using the IO options must have been
+ * connected by then. Contexts may be attached from several threads at once.
+ *
+ * LCBMT_INIT_LEADER_FOLLOWER may not be given. Destroying the context
+ * detaches it from the loop; it must be destroyed (with no operations
+ * outstanding) before the instance is, see lcb_mt_destroy().
+ */
+LIBCOUCHBASE_API
+lcb_error_t lcb_mt_init_shared(lcbmt_t *mt,
+                               lcb_t instance,
+                               lcbmt_loop_t loop,
+                               int flags);
+
+/**
+ * Stop the loop's thread and free the loop. All contexts attached to it
+ * must have been destroyed. The IO options may be destroyed afterwards.
+ */
+LIBCOUCHBASE_API
+void lcb_mt_loop_destroy(lcbmt_loop_t loop);
+
 
 /**
  * Lock the context. Once locked, the associated instance (passed to
@@ -78,6 +184,12 @@ lcb_error_t lcb_mt_init(lcbmt_t *mt, lcb_t instance, lcb_io_opt_t io);
  * Each call to lcb_mt_lock must be followed by an equivalent call to
  * lcb_mt_unlock. Failure to adhere to this will cause undefined behavior
  * and application hangs due to deadlocks.
+ *
+ * The lock is recursive: a thread already holding it (including a callback
+ * invoked by the thread running the event loop, see
+ * LCBMT_TOKEN_INLINE_CALLBACKS) may lock it again. Operations scheduled
+ * this way are sent by the event loop without waking it up. Callbacks may
+ * thus always schedule further operations, without lcb_mt_enter().
  */
 LIBCOUCHBASE_API
 lcb_error_t lcb_mt_lock(lcbmt_t mt);
@@ -94,9 +206,9 @@ void lcb_mt_unlock(lcbmt_t mt);
  * performance may be seen if this is called during handling of a libcouchbase
  * callback.
  *
- * Note that use of this function is required if you wish to perform an
- * operation within the response handler (assuming this is being invoked from
- * within a non-defined thread)
+ * This must only be called by the thread holding the lock. It is not needed
+ * to schedule operations from callbacks invoked by the context, as the lock
+ * is recursive (see lcb_mt_lock()).
  *
  * Each call to lcb_mt_enter() should be matched with a subsequent call to
  * lcb_mt_leave()
@@ -111,9 +223,76 @@ void lcb_mt_enter(lcbmt_t mt);
 LIBCOUCHBASE_API
 void lcb_mt_leave(lcbmt_t mt);
 
+/**
+ * Destroy the context, stopping its IO thread (or detaching it from its
+ * shared loop). No operations scheduled on the context may still be
+ * outstanding, and all its tokens must have been destroyed.
+ *
+ * The context uses its instance until it is destroyed, so this must be
+ * called before lcb_destroy() on the instance; the IO options may only be
+ * destroyed after both.
+ */
 LIBCOUCHBASE_API
 void lcb_mt_destroy(lcbmt_t mt);
 
+/**
+ * Returns the instance associated with the context
+ */
+LIBCOUCHBASE_API
+lcb_t lcb_mt_get_instance(lcbmt_t mt);
+
+typedef struct lcbmt_pool_st *lcbmt_pool_t;
+
+/**
+ * Create a pool of 'ninstances' contexts, so that the threads of a service
+ * are spread over several instances (and event locks) rather than all
+ * contending for one.
+ * @param pool set to the new pool
+ * @param options used to create each instance. Each instance gets IO
+ * options of its own, so any IO options given here are ignored.
+ * @param ninstances number of instances (and contexts)
+ * @param flags passed to lcb_mt_init_ex() for each context
+ *
+ * Each instance is connected before this returns. The contexts may be
+ * set up (callbacks, caching etc.) via lcb_mt_pool_context() before they
+ * are leased.
+ */
+LIBCOUCHBASE_API
+lcb_error_t lcb_mt_pool_create(lcbmt_pool_t *pool,
+                               const struct lcb_create_st *options,
+                               unsigned int ninstances,
+                               int flags);
+
+/**
+ * Returns the context at 'index' (from 0), or NULL beyond the last one
+ */
+LIBCOUCHBASE_API
+lcbmt_t lcb_mt_pool_context(lcbmt_pool_t pool, unsigned int index);
+
+/**
+ * Lease a context from the pool. Its tokens may be used by the calling
+ * thread until the lease is given back with lcb_mt_pool_release(). Leases
+ * are not exclusive: a context is shared by all threads leasing it, and
+ * the least leased one is handed out. A thread gets the context it leased
+ * last again, unless that has a quarter more leases than the least leased
+ * one.
+ */
+LIBCOUCHBASE_API
+lcbmt_t lcb_mt_pool_acquire(lcbmt_pool_t pool);
+
+/**
+ * Give back a lease obtained with lcb_mt_pool_acquire()
+ */
+LIBCOUCHBASE_API
+void lcb_mt_pool_release(lcbmt_pool_t pool, lcbmt_t mt);
+
+/**
+ * Destroy the pool, along with its contexts and instances. No leases may
+ * be held.
+ */
+LIBCOUCHBASE_API
+void lcb_mt_pool_destroy(lcbmt_pool_t pool);
+
 /**
  * Token API
  * These functions replace the functionality provided by lcb_wait.
@@ -135,6 +314,12 @@ lcbmt_token_t lcb_mt_token_create(lcbmt_t mt);
  * Sets the cookie for the callback.
  * @param token an initialized token created via token_create()
  * @param cookie a cookie passed as the callback
+ *
+ * Operations scheduled through the scheduling API (lcb_mt_get() et al.)
+ * keep the cookie the token had when they were scheduled, so a different
+ * cookie may be set before each call while still waiting once on the
+ * token. Operations scheduled directly with libcouchbase are passed the
+ * token's cookie at the time of the callback.
  */
 LIBCOUCHBASE_API
 void lcb_mt_token_set_cookie(lcbmt_token_t token, const void *cookie);
@@ -148,19 +333,74 @@ void lcb_mt_token_set_cookie(lcbmt_token_t token, const void *cookie);
  *
  * Note that operations where the count of callbacks is known only later on
  * (e.g. observe, stats), the wrapper will handle it appropriately.
+ *
+ * The count must be set before the operations are scheduled. Responses may
+ * be counted as soon as they are scheduled, and some are counted before
+ * the scheduling function even returns (e.g. cache hits in lcb_mt_get()).
  */
 LIBCOUCHBASE_API
 void lcb_mt_token_set_count(lcbmt_token_t token, unsigned int count);
 
+/**
+ * Lower the count by 'count', for operations which were counted but could
+ * not be scheduled after all. Unlike lcb_mt_token_set_count(), this may be
+ * called while other operations of the token are outstanding.
+ */
+LIBCOUCHBASE_API
+void lcb_mt_token_decr_count(lcbmt_token_t token, unsigned int count);
+
+/**
+ * Invoke the token's callbacks directly from the thread running the event
+ * loop (normally the IO thread) rather than handing each response over to
+ * the thread in lcb_mt_token_wait(), which then merely waits for the count
+ * to drop to zero.
+ *
+ * This saves two context switches per response, but the callbacks must be
+ * thread safe, and should be short as no other responses are processed in
+ * the meantime. They may still schedule further operations. Responses which
+ * never reach the network (e.g. cache hits) are still delivered from
+ * lcb_mt_token_wait().
+ */
+#define LCBMT_TOKEN_INLINE_CALLBACKS 0x01
+
+/**
+ * Retrieve the token's responses with lcb_mt_token_next() rather than
+ * through the callbacks. This takes precedence over the other flags and
+ * over any executor set on the context.
+ */
+#define LCBMT_TOKEN_PULL 0x02
+
+/**
+ * Set the token's flags (LCBMT_TOKEN_*). This should not be done while
+ * operations are outstanding on the token.
+ */
+LIBCOUCHBASE_API
+void lcb_mt_token_set_flags(lcbmt_token_t token, int flags);
+
 /**
  * Set the callbacks for the context. See the structure definition for more
  * details.
  *
- * Note that these callbacks must be set once right after init and before
- * any operations have been scheduled.
+ * The table is copied, and may be replaced at any time, including while
+ * operations are in progress. Each response is delivered to the callback
+ * of the table current when it arrived. Replaced tables are only freed
+ * with the context, so this is meant for occasional reconfiguration rather
+ * than for every operation.
+ *
+ * Responses for which the table has no callback are discarded.
+ */
+LIBCOUCHBASE_API
+lcb_error_t lcb_mt_set_callbacks(lcbmt_t mt,
+                                 const struct lcb_mt_callback_table *tbl);
+
+/**
+ * Override the context's callbacks for a single token. The table is copied;
+ * pass NULL to use the context's callbacks again. This should not be done
+ * while operations are outstanding on the token.
  */
 LIBCOUCHBASE_API
-void lcb_mt_set_callbacks(lcbmt_t mt, const struct lcb_mt_callback_table *tbl);
+lcb_error_t lcb_mt_token_set_callbacks(lcbmt_token_t token,
+                                       const struct lcb_mt_callback_table *tbl);
 
 /**
  * Waits for the callbacks to complete. In this function, the callbacks are
@@ -172,6 +412,486 @@ void lcb_mt_token_wait(lcbmt_token_t token);
 LIBCOUCHBASE_API
 void lcb_mt_token_destroy(lcbmt_token_t token);
 
+/**
+ * Returns nonzero if lcb_mt_token_wait() would return immediately, i.e. the
+ * token's count has dropped to zero and all its callbacks have been invoked.
+ * For tokens in pull mode, this is also the case once a response is ready
+ * for lcb_mt_token_next().
+ */
+LIBCOUCHBASE_API
+int lcb_mt_token_ready(lcbmt_token_t token);
+
+/**
+ * Wait for any of several tokens to become ready (see lcb_mt_token_ready()).
+ * Responses for all the tokens are delivered while waiting, as with
+ * lcb_mt_token_wait().
+ *
+ * @param tokens the tokens, all belonging to the same context
+ * @param ntokens the number of tokens
+ * @param timeout the maximum time to wait, in microseconds, or 0 to wait
+ * indefinitely
+ * @param ready if not NULL, an array of 'ntokens' elements which is set to
+ * whether each token is ready
+ *
+ * @return LCB_SUCCESS, or LCB_ETIMEDOUT if no token became ready in time.
+ * This is not supported in leader/follower mode (LCB_NOT_SUPPORTED).
+ */
+LIBCOUCHBASE_API
+lcb_error_t lcb_mt_token_wait_any(lcbmt_token_t *tokens,
+                                  unsigned int ntokens,
+                                  lcb_uint32_t timeout,
+                                  int *ready);
+
+/**
+ * Like lcb_mt_token_wait_any(), but waits for all the tokens to become ready
+ */
+LIBCOUCHBASE_API
+lcb_error_t lcb_mt_token_wait_all(lcbmt_token_t *tokens,
+                                  unsigned int ntokens,
+                                  lcb_uint32_t timeout,
+                                  int *ready);
+
+/**
+ * Return the next response for a token created with LCBMT_TOKEN_PULL,
+ * blocking until one arrives. Responses are returned in the order they
+ * arrive, as soon as they arrive.
+ *
+ * Returns 0 once the token's count has dropped to zero and all responses
+ * have been returned. Responses which can't be copied (see
+ * lcbmt_resptype_t) are passed to the callbacks from within this function
+ * instead.
+ *
+ * Each response returned must be released with lcb_mt_response_release()
+ */
+LIBCOUCHBASE_API
+int lcb_mt_token_next(lcbmt_token_t token, struct lcb_mt_response *resp);
+
+LIBCOUCHBASE_API
+void lcb_mt_response_release(struct lcb_mt_response *resp);
+
+/**
+ * Scheduling API
+ * These functions are equivalents of the libcouchbase scheduling functions
+ * which take a token rather than a cookie. Unlike the libcouchbase functions
+ * they must *not* be called with the context locked; they lock it
+ * themselves. The commands are copied, and may be reused once the function
+ * returns.
+ *
+ * Because the context knows about each operation scheduled this way, it may
+ * combine them with other operations scheduled from other threads. Each
+ * operation still counts as one towards lcb_mt_token_set_count(), and the
+ * callbacks are invoked exactly as if the operation had been scheduled with
+ * lcb_get() et al.
+ *
+ * If an error is returned, the commands before the failing one remain
+ * scheduled. Errors which occur once the function has returned (e.g. when
+ * batching is enabled) are delivered to the callback like any other
+ * response.
+ */
+
+/**
+ * Schedule one or more GET operations.
+ *
+ * If a GET for the same key is already in progress, the token is attached to
+ * that operation rather than a new one being sent; the response is then
+ * delivered to each token waiting on it. This only applies to plain GETs
+ * (i.e. without a lock, expiry or hashkey). A GET is never attached to one
+ * sent before a store or arithmetic operation for the key was scheduled via
+ * the scheduling API. Modifications scheduled with lcb_store() et al. are
+ * only taken into account once their response arrives.
+ *
+ * A GET for a key with an arithmetic operation (or, with store coalescing
+ * enabled, a store) in progress is held back until that operation and any
+ * held back before the GET have completed, so that it sees their effect.
+ */
+LIBCOUCHBASE_API
+lcb_error_t lcb_mt_get(lcbmt_token_t token,
+                       lcb_size_t num,
+                       const lcb_get_cmd_t *const *commands);
+
+/**
+ * Schedule one or more arithmetic operations.
+ *
+ * Increments of the same key are combined: while one is in progress, any
+ * further increments for that key are summed up and sent as a single
+ * operation once it completes. Each callback still receives the value the
+ * item had right after its own delta was applied. The CAS is that of the
+ * combined operation, so it only matches the item for the last of the
+ * combined callers.
+ *
+ * Only increments without 'create', an expiry or a hashkey are combined;
+ * other arithmetic operations are still held back and sent in order, one
+ * at a time. An increment is not combined into one whose sum of deltas
+ * would then no longer fit in a signed 64-bit integer.
+ */
+LIBCOUCHBASE_API
+lcb_error_t lcb_mt_arithmetic(lcbmt_token_t token,
+                              lcb_size_t num,
+                              const lcb_arithmetic_cmd_t *const *commands);
+
+/**
+ * Schedule one or more store operations. See
+ * lcb_mt_enable_store_coalescing().
+ */
+LIBCOUCHBASE_API
+lcb_error_t lcb_mt_store(lcbmt_token_t token,
+                         lcb_size_t num,
+                         const lcb_store_cmd_t *const *commands);
+
+/**
+ * Enable coalescing of stores scheduled via lcb_mt_store(). While a store
+ * for a key is in progress, later stores for the same key are held back;
+ * each one replaces the value of the store held back before it (last
+ * writer wins). Once the first store completes, only the latest value is
+ * sent.
+ *
+ * The callbacks for the replaced stores are invoked along with the one for
+ * the store which was sent, with the same error and CAS. Only plain
+ * LCB_SET operations without a CAS or hashkey are coalesced. Other stores,
+ * arithmetic operations and GETs for the key are held back as well, and
+ * sent in the order they were scheduled; a SET is only ever replaced by
+ * one scheduled right after it.
+ *
+ * This must be called once, before any operations have been scheduled.
+ */
+LIBCOUCHBASE_API
+lcb_error_t lcb_mt_enable_store_coalescing(lcbmt_t mt);
+
+/**
+ * Retry policy for operations scheduled through the scheduling API. An
+ * operation failing with a temporary error (LCB_ETMPFAIL, LCB_EBUSY,
+ * LCB_ENOMEM or LCB_NOT_MY_VBUCKET) is sent again by the IO thread after a
+ * delay, and only its final result is delivered to the token.
+ *
+ * The delay starts at 'initial_backoff' and doubles with each retry, up to
+ * 'max_backoff'; a random amount of up to half of it is taken off, so that
+ * operations failing together are not retried together.
+ */
+struct lcb_mt_retry_policy {
+    /** Maximum number of times an operation is sent. 0 or 1 disables it */
+    unsigned int max_attempts;
+
+    /** Delay before the first retry, in microseconds */
+    lcb_uint32_t initial_backoff;
+
+    /** Maximum delay before a retry, in microseconds */
+    lcb_uint32_t max_backoff;
+
+    /**
+     * Time after scheduling (in microseconds) beyond which an operation is
+     * not retried any more, or 0 for no limit
+     */
+    lcb_uint32_t deadline;
+};
+
+/**
+ * Set the retry policy for operations scheduled on the context. Each
+ * operation follows the policy in effect when it was scheduled. Operations
+ * scheduled directly with libcouchbase are never retried.
+ */
+LIBCOUCHBASE_API
+lcb_error_t lcb_mt_set_retry_policy(lcbmt_t mt,
+                                    const struct lcb_mt_retry_policy *policy);
+
+/**
+ * Override the context's retry policy for operations scheduled on a single
+ * token. Pass NULL to use the context's policy again. This should not be
+ * done while operations are being scheduled on the token.
+ */
+LIBCOUCHBASE_API
+lcb_error_t lcb_mt_token_set_retry_policy(lcbmt_token_t token,
+                                          const struct lcb_mt_retry_policy *policy);
+
+/**
+ * Set a timeout (in microseconds) for operations scheduled on the context
+ * through the scheduling API, or 0 (the default) to only rely on the
+ * instance's own operation timeout. Each operation follows the timeout in
+ * effect when it was scheduled, counted from then; retries do not extend
+ * it. The resolution is a millisecond.
+ *
+ * Once an operation times out, its callback is invoked with
+ * LCB_ETIMEDOUT, and the response (if it still arrives) is ignored. The
+ * operation may still take effect on the server.
+ *
+ * Operations sharing a single network operation (joined GETs, combined
+ * increments and coalesced stores) each time out on their own; the
+ * response is still delivered to those which have not timed out yet.
+ */
+LIBCOUCHBASE_API
+void lcb_mt_set_op_timeout(lcbmt_t mt, lcb_uint32_t usec);
+
+/**
+ * Override the context's operation timeout for operations scheduled on a
+ * single token. Pass 0 to use the context's timeout again.
+ */
+LIBCOUCHBASE_API
+void lcb_mt_token_set_op_timeout(lcbmt_token_t token, lcb_uint32_t usec);
+
+/**
+ * Priority classes ("lanes") for operations scheduled through the
+ * scheduling API
+ */
+typedef enum {
+    /** Latency sensitive operations. This is the default */
+    LCB_MT_PRIORITY_INTERACTIVE = 0,
+
+    /** Background and bulk operations */
+    LCB_MT_PRIORITY_BULK,
+
+    LCB_MT_PRIORITY_MAX
+} lcb_mt_priority_t;
+
+/**
+ * Enable priority lanes for the context. At most 'max_inflight' operations
+ * scheduled through the scheduling API are passed on to libcouchbase at any
+ * time; further operations are queued in the lane of their token's
+ * priority. As operations complete, the queued ones are issued from the
+ * lanes in turn, taking up to 'interactive_weight' operations from the
+ * interactive lane for every 'bulk_weight' operations from the bulk lane,
+ * so that the bulk lane is never starved.
+ *
+ * Operation timeouts (see lcb_mt_set_op_timeout()) include the time spent
+ * in a lane. Operations scheduled directly with libcouchbase are not
+ * limited.
+ *
+ * This must be called once, before any operations have been scheduled.
+ */
+LIBCOUCHBASE_API
+lcb_error_t lcb_mt_enable_lanes(lcbmt_t mt,
+                                unsigned int max_inflight,
+                                unsigned int interactive_weight,
+                                unsigned int bulk_weight);
+
+/**
+ * Set the priority of operations subsequently scheduled on the token.
+ * Returns LCB_EINVAL (leaving the priority as is) if it is not one of the
+ * LCB_MT_PRIORITY_* classes.
+ */
+LIBCOUCHBASE_API
+lcb_error_t lcb_mt_token_set_priority(lcbmt_token_t token,
+                                      lcb_mt_priority_t priority);
+
+/**
+ * Returned by the scheduling functions when an operation is rejected
+ * because the context is overloaded (see lcb_mt_enable_load_shedding()).
+ * This is outside the range of libcouchbase's own error codes.
+ */
+#define LCB_MT_EOVERLOAD ((lcb_error_t)(LCB_MAX_ERROR + 1))
+
+/**
+ * Enable load shedding for the context. The time each operation scheduled
+ * through the scheduling API spends between being scheduled and being
+ * passed on to libcouchbase (waiting for the context lock, a batching
+ * window or a priority lane) is measured. Once this has stayed above
+ * 'target' for at least 'interval' (both in microseconds), the scheduling
+ * functions fail at once with LCB_MT_EOVERLOAD for tokens of bulk
+ * priority, until an operation is again passed on within 'target'.
+ *
+ * Interactive operations are never rejected. Shedding also stops once no
+ * operation has been passed on for 'interval'.
+ *
+ * This must be called once, before any operations have been scheduled.
+ */
+LIBCOUCHBASE_API
+lcb_error_t lcb_mt_enable_load_shedding(lcbmt_t mt,
+                                        lcb_uint32_t target,
+                                        lcb_uint32_t interval);
+
+/**
+ * Enable hedged GETs for the context. A plain GET scheduled via lcb_mt_get()
+ * which has not been answered within a delay is also sent to a replica
+ * (with lcb_get_replica()), and the token is given whichever response
+ * arrives first; the other is discarded. A failed response is only
+ * delivered if the other read fails as well, except for LCB_KEY_ENOENT
+ * from the active node. Values read from a replica may be stale, and are
+ * not kept in the near cache.
+ *
+ * The delay is the given percentile (e.g. 99.0) of the latencies of recent
+ * GETs answered by the active node, bounded by 'min_delay' and 'max_delay'
+ * (in microseconds). It starts out as 'max_delay', and has a resolution of
+ * a millisecond.
+ *
+ * This must be called once, before any operations have been scheduled.
+ */
+LIBCOUCHBASE_API
+lcb_error_t lcb_mt_enable_hedging(lcbmt_t mt,
+                                  double percentile,
+                                  lcb_uint32_t min_delay,
+                                  lcb_uint32_t max_delay);
+
+/**
+ * Enable the near cache for the context. GET responses for operations
+ * scheduled via lcb_mt_get() are kept in memory, and subsequent plain GETs
+ * for the same key are answered from there without taking the context lock
+ * or touching the network.
+ *
+ * A store or arithmetic operation scheduled via the scheduling API removes
+ * the key from the cache before the scheduling function returns. Any other
+ * store, remove or arithmetic response for a key seen by the context
+ * removes it as well. Modifications made by other clients are not seen, so
+ * entries may be stale for up to 'ttl'.
+ *
+ * @param mt the context
+ * @param max_bytes the memory budget for the cache, including overhead.
+ * Least recently used entries are evicted to stay within the budget.
+ * @param ttl the maximum time (in milliseconds) an entry is served from the
+ * cache. GETs which also set the item's expiry use the shorter of the two.
+ *
+ * This must be called once, before any operations have been scheduled.
+ */
+LIBCOUCHBASE_API
+lcb_error_t lcb_mt_enable_cache(lcbmt_t mt,
+                                lcb_size_t max_bytes,
+                                lcb_uint32_t ttl);
+
+/**
+ * Enable the negative lookup filter for the context. Keys for which a GET
+ * scheduled via lcb_mt_get() returned LCB_KEY_ENOENT are remembered, and
+ * subsequent plain GETs for them fail with LCB_KEY_ENOENT without taking
+ * the context lock or touching the network.
+ *
+ * A key is forgotten once a store or arithmetic operation for it is
+ * scheduled via the scheduling API, or a store, remove or arithmetic
+ * response for it is seen by the context. Items created by other clients
+ * are not seen, so a key may be reported missing for up to 'window'.
+ *
+ * The filter is probabilistic: with too few counters for the number of
+ * missing keys, GETs for keys which do exist may also be reported missing.
+ * Allow around ten counters per key expected to be missing within a window;
+ * the filter uses two bytes per counter.
+ *
+ * @param mt the context
+ * @param ncounters the size of the filter, in counters
+ * @param window the maximum time (in microseconds) a key is remembered
+ *
+ * This must be called once, before any operations have been scheduled.
+ */
+LIBCOUCHBASE_API
+lcb_error_t lcb_mt_enable_negative_filter(lcbmt_t mt,
+                                          lcb_size_t ncounters,
+                                          lcb_uint32_t window);
+
+/**
+ * Copy responses instead of handing them over. Normally the IO thread waits
+ * until the thread consuming a response has returned from its callback, as
+ * the response points into libcouchbase's buffers. With this enabled, GET,
+ * store, remove, arithmetic, touch and unlock responses are copied into
+ * buffers owned by the token and the IO thread moves on at once; the
+ * buffers are released once the callback has returned (or, in pull mode,
+ * by lcb_mt_response_release()).
+ *
+ * Buffers are taken from a per-context pool of size classes rather than
+ * allocated for each response. Responses which can't be copied are handed
+ * over as usual.
+ *
+ * @param mt the context
+ * @param max_pooled the maximum number of bytes kept in the pool for reuse
+ *
+ * This must be called once, before any operations have been scheduled.
+ */
+LIBCOUCHBASE_API
+lcb_error_t lcb_mt_enable_response_copy(lcbmt_t mt, lcb_size_t max_pooled);
+
+/**
+ * Enable batching of operations scheduled via the scheduling API. Instead
+ * of locking the context for each call, operations from all threads are
+ * collected for up to 'window' microseconds and then scheduled together,
+ * so that the IO thread is woken up once for the whole batch and the
+ * requests can be written to the network together.
+ *
+ * This adds up to 'window' to the latency of each operation. Scheduling
+ * calls never wait for the window: the batch is scheduled by a timer in the
+ * thread running the event loop (which, in leader/follower mode, only runs
+ * while some thread waits for a token).
+ *
+ * @param mt the context
+ * @param window the maximum time (in microseconds) an operation is held
+ * @param max_ops the batch is scheduled immediately once this many
+ * operations are pending
+ *
+ * This must be called once, before any operations have been scheduled.
+ * Operations scheduled directly with libcouchbase are not affected.
+ */
+LIBCOUCHBASE_API
+lcb_error_t lcb_mt_enable_batching(lcbmt_t mt,
+                                   lcb_uint32_t window,
+                                   unsigned int max_ops);
+
+/**
+ * A task run by an executor
+ */
+typedef void (*lcb_mt_task_fn)(void *arg);
+
+/**
+ * Run 'task' with 'arg' at some point, in some thread.
+ * @param executor the executor passed to lcb_mt_set_executor()
+ */
+typedef void (*lcb_mt_submit_fn)(void *executor,
+                                 lcb_mt_task_fn task,
+                                 void *arg);
+
+typedef struct lcbmt_executor_st *lcbmt_executor_t;
+
+/**
+ * Create a work stealing thread pool with 'nthreads' threads, suitable for
+ * lcb_mt_set_executor() (with lcb_mt_executor_submit as the submit function).
+ * Returns NULL on failure.
+ */
+LIBCOUCHBASE_API
+lcbmt_executor_t lcb_mt_executor_create(unsigned int nthreads);
+
+/**
+ * Submit a task to a pool created by lcb_mt_executor_create(). This may be
+ * called from any thread, including the pool's own.
+ */
+LIBCOUCHBASE_API
+void lcb_mt_executor_submit(void *executor, lcb_mt_task_fn task, void *arg);
+
+/**
+ * Run all tasks still queued, then stop the pool's threads and free it.
+ * No tasks may be submitted once this has been called.
+ */
+LIBCOUCHBASE_API
+void lcb_mt_executor_destroy(lcbmt_executor_t executor);
+
+/**
+ * Invoke callbacks through an executor. Each response is copied and handed
+ * to 'submit', and the callback is invoked from whichever thread runs the
+ * task. No thread needs to wait in lcb_mt_token_wait(); if one does, it
+ * merely waits for the token's count to drop to zero, which happens once
+ * the callbacks have returned.
+ *
+ * Callbacks for the same token may run concurrently. Responses which can't
+ * be copied (stats, HTTP and durability responses) are delivered as usual.
+ *
+ * @param mt the context
+ * @param submit the submit function, or NULL to stop using an executor
+ * @param executor passed to 'submit'
+ *
+ * This must be called before any operations have been scheduled.
+ */
+LIBCOUCHBASE_API
+void lcb_mt_set_executor(lcbmt_t mt,
+                         lcb_mt_submit_fn submit,
+                         void *executor);
+
+/**
+ * Publish the statistics of the context into a named shared memory segment.
+ * @param mt the context
+ * @param name the name of the segment (e.g. "/myapp-lcbmt"). The segment is
+ * created (or truncated if it exists) and is removed when the context is
+ * destroyed.
+ *
+ * The layout of the segment is described in <libcouchbase/lcbmt_stats.h>.
+ * The page is refreshed by whichever thread holds the context lock, so no
+ * additional locking takes place, at most once per millisecond. While the
+ * context is idle, its IO thread refreshes the page every 100ms (except in
+ * leader/follower mode, which has no such thread). Latency histograms are
+ * only collected once this function has been called.
+ */
+LIBCOUCHBASE_API
+lcb_error_t lcb_mt_stats_publish(lcbmt_t mt, const char *name);
+
 #ifdef __cplusplus
 }
 #endif
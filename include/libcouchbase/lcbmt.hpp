@@ -0,0 +1,563 @@
+#ifndef LIBCOUCHBASE_MT_HPP
+#define LIBCOUCHBASE_MT_HPP
+
+/**
+ * Header-only C++17 layer over lcbmt.h.
+ *
+ * lcbmt::Context owns an MT context together with a small executor (see
+ * lcb_mt_set_executor()), and offers asynchronous get/set/multi_get calls
+ * which either return a std::future or invoke a handler. No thread has to
+ * wait for the results; handlers are invoked from the executor's threads.
+ *
+ * lcbmt::Token wraps a token for use with the C API (e.g. lcb_mt_get() with
+ * a pull mode token), and lcbmt::Response a response obtained from it.
+ *
+ * All results are move-only and own their buffers, so they may be passed on
+ * without copying the key or value again.
+ */
+
+#include <libcouchbase/lcbmt.h>
+#include <atomic>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace lcbmt {
+
+/**
+ * Thrown when a context or token can't be created, or when an operation
+ * can't be scheduled at all. Errors for individual operations are reported
+ * through their results instead.
+ */
+class Error : public std::runtime_error {
+public:
+    explicit Error(lcb_error_t code)
+        : std::runtime_error(lcb_strerror(NULL, code)), code_(code) {}
+
+    lcb_error_t code() const noexcept { return code_; }
+
+private:
+    lcb_error_t code_;
+};
+
+namespace detail {
+
+/** A key and (optionally) a value, copied into a single allocation */
+class Buffer {
+public:
+    Buffer() = default;
+
+    Buffer(const void *key, std::size_t nkey,
+           const void *value = nullptr, std::size_t nvalue = 0)
+        : data_(new char[nkey + nvalue + 1]), nkey_(nkey), nvalue_(nvalue)
+    {
+        if (nkey) {
+            std::memcpy(data_.get(), key, nkey);
+        }
+        if (nvalue) {
+            std::memcpy(data_.get() + nkey, value, nvalue);
+        }
+    }
+
+    std::string_view key() const noexcept
+    {
+        return std::string_view(data_.get(), nkey_);
+    }
+
+    std::string_view value() const noexcept
+    {
+        return std::string_view(data_.get() + nkey_, nvalue_);
+    }
+
+private:
+    std::unique_ptr<char[]> data_;
+    std::size_t nkey_ = 0;
+    std::size_t nvalue_ = 0;
+};
+
+} // namespace detail
+
+class GetResult {
+public:
+    GetResult() = default;
+    GetResult(GetResult &&) noexcept = default;
+    GetResult &operator=(GetResult &&) noexcept = default;
+
+    GetResult(lcb_error_t err, const lcb_get_resp_t *resp)
+        : buf_(resp->v.v0.key, resp->v.v0.nkey,
+               resp->v.v0.bytes, err == LCB_SUCCESS ? resp->v.v0.nbytes : 0),
+          error_(err), flags_(resp->v.v0.flags), cas_(resp->v.v0.cas) {}
+
+    GetResult(lcb_error_t err, std::string_view key)
+        : buf_(key.data(), key.size()), error_(err) {}
+
+    lcb_error_t error() const noexcept { return error_; }
+    bool ok() const noexcept { return error_ == LCB_SUCCESS; }
+    std::string_view key() const noexcept { return buf_.key(); }
+    std::string_view value() const noexcept { return buf_.value(); }
+    lcb_uint32_t flags() const noexcept { return flags_; }
+    lcb_cas_t cas() const noexcept { return cas_; }
+
+private:
+    detail::Buffer buf_;
+    lcb_error_t error_ = LCB_SUCCESS;
+    lcb_uint32_t flags_ = 0;
+    lcb_cas_t cas_ = 0;
+};
+
+class StoreResult {
+public:
+    StoreResult() = default;
+    StoreResult(StoreResult &&) noexcept = default;
+    StoreResult &operator=(StoreResult &&) noexcept = default;
+
+    StoreResult(lcb_error_t err, lcb_storage_t op, const lcb_store_resp_t *resp)
+        : buf_(resp->v.v0.key, resp->v.v0.nkey),
+          error_(err), operation_(op), cas_(resp->v.v0.cas) {}
+
+    StoreResult(lcb_error_t err, lcb_storage_t op, std::string_view key)
+        : buf_(key.data(), key.size()), error_(err), operation_(op) {}
+
+    lcb_error_t error() const noexcept { return error_; }
+    bool ok() const noexcept { return error_ == LCB_SUCCESS; }
+    std::string_view key() const noexcept { return buf_.key(); }
+    lcb_storage_t operation() const noexcept { return operation_; }
+    lcb_cas_t cas() const noexcept { return cas_; }
+
+private:
+    detail::Buffer buf_;
+    lcb_error_t error_ = LCB_SUCCESS;
+    lcb_storage_t operation_ = LCB_SET;
+    lcb_cas_t cas_ = 0;
+};
+
+struct StoreOptions {
+    lcb_storage_t operation = LCB_SET;
+    lcb_uint32_t flags = 0;
+    lcb_time_t exptime = 0;
+    lcb_cas_t cas = 0;
+};
+
+/**
+ * A response returned by lcb_mt_token_next(). The response's buffers are
+ * released along with it.
+ */
+class Response {
+public:
+    explicit Response(const lcb_mt_response &resp) noexcept : resp_(resp) {}
+
+    Response(Response &&other) noexcept : resp_(other.resp_)
+    {
+        other.resp_.record = nullptr;
+    }
+
+    Response &operator=(Response &&other) noexcept
+    {
+        if (this != &other) {
+            reset();
+            resp_ = other.resp_;
+            other.resp_.record = nullptr;
+        }
+        return *this;
+    }
+
+    ~Response() { reset(); }
+
+    lcbmt_resptype_t type() const noexcept { return resp_.type; }
+    lcb_error_t error() const noexcept { return resp_.err; }
+    bool ok() const noexcept { return resp_.err == LCB_SUCCESS; }
+    const void *cookie() const noexcept { return resp_.cookie; }
+    lcb_cas_t cas() const noexcept { return resp_.cas; }
+    lcb_uint32_t flags() const noexcept { return resp_.flags; }
+    lcb_uint64_t counter() const noexcept { return resp_.value; }
+    lcb_storage_t operation() const noexcept { return resp_.storop; }
+
+    std::string_view key() const noexcept
+    {
+        return std::string_view(static_cast<const char *>(resp_.key),
+                                resp_.nkey);
+    }
+
+    std::string_view value() const noexcept
+    {
+        return std::string_view(static_cast<const char *>(resp_.bytes),
+                                resp_.nbytes);
+    }
+
+private:
+    void reset() noexcept
+    {
+        if (resp_.record) {
+            lcb_mt_response_release(&resp_);
+        }
+    }
+
+    lcb_mt_response resp_;
+};
+
+class Token {
+public:
+    /**
+     * @param flags LCBMT_TOKEN_* flags
+     */
+    explicit Token(lcbmt_t mt, int flags = 0) : token_(lcb_mt_token_create(mt))
+    {
+        if (!token_) {
+            throw Error(LCB_CLIENT_ENOMEM);
+        }
+        if (flags) {
+            lcb_mt_token_set_flags(token_, flags);
+        }
+    }
+
+    Token(Token &&other) noexcept
+        : token_(std::exchange(other.token_, nullptr)) {}
+
+    Token &operator=(Token &&other) noexcept
+    {
+        if (this != &other) {
+            if (token_) {
+                lcb_mt_token_destroy(token_);
+            }
+            token_ = std::exchange(other.token_, nullptr);
+        }
+        return *this;
+    }
+
+    ~Token()
+    {
+        if (token_) {
+            lcb_mt_token_destroy(token_);
+        }
+    }
+
+    lcbmt_token_t get() const noexcept { return token_; }
+    operator lcbmt_token_t() const noexcept { return token_; }
+
+    void set_cookie(const void *cookie) { lcb_mt_token_set_cookie(token_, cookie); }
+    void set_count(unsigned int count) { lcb_mt_token_set_count(token_, count); }
+    void wait() { lcb_mt_token_wait(token_); }
+    bool ready() const { return lcb_mt_token_ready(token_) != 0; }
+
+    /**
+     * Next response for a token in pull mode (LCBMT_TOKEN_PULL), or nothing
+     * once all have been returned.
+     */
+    std::optional<Response> next()
+    {
+        lcb_mt_response resp;
+        if (!lcb_mt_token_next(token_, &resp)) {
+            return std::nullopt;
+        }
+        return Response(resp);
+    }
+
+private:
+    lcbmt_token_t token_;
+};
+
+class Context {
+public:
+    using GetHandler = std::function<void(GetResult)>;
+    using MultiGetHandler = std::function<void(std::vector<GetResult>)>;
+    using StoreHandler = std::function<void(StoreResult)>;
+
+    /**
+     * Wrap a connected instance (see lcb_mt_init_ex()). Results are
+     * delivered from a pool of 'nthreads' threads. Leader/follower mode is
+     * not supported, as it needs a thread waiting on each token.
+     *
+     * The context installs its own callback table, so the instance should
+     * only be used through this object (or through Token objects in pull
+     * mode).
+     */
+    Context(lcb_t instance, lcb_io_opt_t io,
+            unsigned int nthreads = 1, int flags = 0)
+    {
+        lcb_error_t err;
+
+        if (flags & LCBMT_INIT_LEADER_FOLLOWER) {
+            throw Error(LCB_NOT_SUPPORTED);
+        }
+
+        err = lcb_mt_init_ex(&mt_, instance, io, flags);
+        if (err != LCB_SUCCESS) {
+            throw Error(err);
+        }
+
+        executor_ = lcb_mt_executor_create(nthreads);
+        if (!executor_) {
+            lcb_mt_destroy(mt_);
+            throw Error(LCB_CLIENT_ENOMEM);
+        }
+
+        struct lcb_mt_callback_table callbacks;
+        std::memset(&callbacks, 0, sizeof(callbacks));
+        callbacks.v.v0.get = get_callback;
+        callbacks.v.v0.store = store_callback;
+        err = lcb_mt_set_callbacks(mt_, &callbacks);
+        if (err != LCB_SUCCESS) {
+            lcb_mt_executor_destroy(executor_);
+            lcb_mt_destroy(mt_);
+            throw Error(err);
+        }
+        lcb_mt_set_executor(mt_, lcb_mt_executor_submit, executor_);
+    }
+
+    Context(const Context &) = delete;
+    Context &operator=(const Context &) = delete;
+
+    /**
+     * All operations must have completed by now
+     */
+    ~Context()
+    {
+        lcb_mt_executor_destroy(executor_);
+        for (lcbmt_token_t token : tokens_) {
+            lcb_mt_token_destroy(token);
+        }
+        lcb_mt_destroy(mt_);
+    }
+
+    lcbmt_t handle() const noexcept { return mt_; }
+
+    void get(std::string_view key, GetHandler handler)
+    {
+        multi_get(std::vector<std::string_view>(1, key),
+                  [handler = std::move(handler)](std::vector<GetResult> res) {
+                      handler(std::move(res[0]));
+                  });
+    }
+
+    std::future<GetResult> get(std::string_view key)
+    {
+        auto promise = std::make_shared<std::promise<GetResult>>();
+        auto future = promise->get_future();
+        get(key, [promise](GetResult res) {
+            promise->set_value(std::move(res));
+        });
+        return future;
+    }
+
+    /**
+     * Get several keys at once. The results are in the order of the keys.
+     * Throws Error(LCB_EINVAL) if there are no keys.
+     */
+    void multi_get(const std::vector<std::string_view> &keys,
+                   MultiGetHandler handler)
+    {
+        if (keys.empty()) {
+            throw Error(LCB_EINVAL);
+        }
+        check_keys(keys);
+        Call *call = new Call(*this, keys.size());
+        call->on_gets = std::move(handler);
+        call->gets.resize(keys.size());
+
+        lcb_error_t err = LCB_SUCCESS;
+        for (std::size_t ii = 0; ii < keys.size(); ii++) {
+            if (err == LCB_SUCCESS) {
+                lcb_get_cmd_t cmd;
+                const lcb_get_cmd_t *cmdp = &cmd;
+                std::memset(&cmd, 0, sizeof(cmd));
+                cmd.v.v0.key = keys[ii].data();
+                cmd.v.v0.nkey = keys[ii].size();
+
+                lcb_mt_token_set_cookie(call->token, &call->slots[ii]);
+                err = lcb_mt_get(call->token, 1, &cmdp);
+                if (err == LCB_SUCCESS) {
+                    continue;
+                }
+            }
+            call->gets[ii] = GetResult(err, keys[ii]);
+            call->unscheduled();
+        }
+    }
+
+    std::future<std::vector<GetResult>>
+    multi_get(const std::vector<std::string_view> &keys)
+    {
+        auto promise = std::make_shared<std::promise<std::vector<GetResult>>>();
+        auto future = promise->get_future();
+        multi_get(keys, [promise](std::vector<GetResult> res) {
+            promise->set_value(std::move(res));
+        });
+        return future;
+    }
+
+    void set(std::string_view key, std::string_view value,
+             const StoreOptions &options, StoreHandler handler)
+    {
+        check_keys(std::vector<std::string_view>(1, key));
+        Call *call = new Call(*this, 1);
+        call->on_store = std::move(handler);
+
+        lcb_store_cmd_t cmd;
+        const lcb_store_cmd_t *cmdp = &cmd;
+        std::memset(&cmd, 0, sizeof(cmd));
+        cmd.v.v0.key = key.data();
+        cmd.v.v0.nkey = key.size();
+        cmd.v.v0.bytes = value.data();
+        cmd.v.v0.nbytes = value.size();
+        cmd.v.v0.operation = options.operation;
+        cmd.v.v0.flags = options.flags;
+        cmd.v.v0.exptime = options.exptime;
+        cmd.v.v0.cas = options.cas;
+
+        lcb_mt_token_set_cookie(call->token, &call->slots[0]);
+        lcb_error_t err = lcb_mt_store(call->token, 1, &cmdp);
+        if (err != LCB_SUCCESS) {
+            call->store = StoreResult(err, options.operation, key);
+            call->unscheduled();
+        }
+    }
+
+    void set(std::string_view key, std::string_view value,
+             StoreHandler handler)
+    {
+        set(key, value, StoreOptions(), std::move(handler));
+    }
+
+    std::future<StoreResult> set(std::string_view key, std::string_view value,
+                                 const StoreOptions &options = StoreOptions())
+    {
+        auto promise = std::make_shared<std::promise<StoreResult>>();
+        auto future = promise->get_future();
+        set(key, value, options, [promise](StoreResult res) {
+            promise->set_value(std::move(res));
+        });
+        return future;
+    }
+
+private:
+    struct Call;
+
+    /** Passed as the per-operation cookie */
+    struct Slot {
+        Call *call;
+        std::size_t index;
+    };
+
+    /**
+     * State of a single get/multi_get/set call. It owns a token for as long
+     * as any of its operations are outstanding, and deletes itself once the
+     * last result has arrived.
+     */
+    struct Call {
+        Call(Context &ctx, std::size_t nops)
+            : parent(ctx), token(ctx.acquire_token()),
+              slots(nops), remaining(nops)
+        {
+            for (std::size_t ii = 0; ii < nops; ii++) {
+                slots[ii].call = this;
+                slots[ii].index = ii;
+            }
+            lcb_mt_token_set_count(token, static_cast<unsigned int>(nops));
+        }
+
+        void arrived()
+        {
+            if (--remaining) {
+                return;
+            }
+            if (on_gets) {
+                on_gets(std::move(gets));
+            } else if (on_store) {
+                on_store(std::move(store));
+            }
+            parent.release_token(token);
+            delete this;
+        }
+
+        /** An operation could not be scheduled, and won't be counted */
+        void unscheduled()
+        {
+            lcb_mt_token_decr_count(token, 1);
+            arrived();
+        }
+
+        Context &parent;
+        lcbmt_token_t token;
+        std::vector<Slot> slots;
+        std::atomic<std::size_t> remaining;
+
+        std::vector<GetResult> gets;
+        MultiGetHandler on_gets;
+        StoreResult store;
+        StoreHandler on_store;
+    };
+
+    static void check_keys(const std::vector<std::string_view> &keys)
+    {
+        for (const auto &key : keys) {
+            if (key.empty()) {
+                throw Error(LCB_EINVAL);
+            }
+        }
+    }
+
+    static void get_callback(lcb_t, const void *cookie, lcb_error_t err,
+                             const lcb_get_resp_t *resp) noexcept
+    {
+        const Slot *slot = static_cast<const Slot *>(cookie);
+        slot->call->gets[slot->index] = GetResult(err, resp);
+        slot->call->arrived();
+    }
+
+    static void store_callback(lcb_t, const void *cookie, lcb_storage_t op,
+                               lcb_error_t err,
+                               const lcb_store_resp_t *resp) noexcept
+    {
+        const Slot *slot = static_cast<const Slot *>(cookie);
+        slot->call->store = StoreResult(err, op, resp);
+        slot->call->arrived();
+    }
+
+    /**
+     * A released token is only reused once lcb_mt_token_ready() says so,
+     * i.e. once the executor has finished with its last response.
+     */
+    lcbmt_token_t acquire_token()
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        for (std::size_t ii = 0; ii < free_.size(); ii++) {
+            lcbmt_token_t token = free_[ii];
+            if (lcb_mt_token_ready(token)) {
+                free_[ii] = free_.back();
+                free_.pop_back();
+                return token;
+            }
+        }
+
+        lcbmt_token_t token = lcb_mt_token_create(mt_);
+        if (!token) {
+            throw Error(LCB_CLIENT_ENOMEM);
+        }
+        tokens_.push_back(token);
+        return token;
+    }
+
+    void release_token(lcbmt_token_t token)
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        free_.push_back(token);
+    }
+
+    lcbmt_t mt_ = nullptr;
+    lcbmt_executor_t executor_ = nullptr;
+
+    std::mutex lock_;
+    std::vector<lcbmt_token_t> tokens_;
+    std::vector<lcbmt_token_t> free_;
+};
+
+} // namespace lcbmt
+
+#endif
@@ -0,0 +1,171 @@
+#ifndef LIBCOUCHBASE_MT_CORO_HPP
+#define LIBCOUCHBASE_MT_CORO_HPP
+
+/**
+ * C++20 coroutine support on top of lcbmt.hpp. Operations started through
+ * an lcbmt::AsyncContext may be co_await'ed from any coroutine type:
+ *
+ *     lcbmt::GetResult res = co_await actx.get("key");
+ *
+ * The coroutine is suspended (no thread is blocked) until the result has
+ * been delivered, and is then resumed by the context's resumer. Without a
+ * resumer it is resumed directly in the thread delivering the result (one
+ * of the context's executor threads); a resumer may instead post the handle
+ * to the application's own scheduler or event loop.
+ */
+
+#include <libcouchbase/lcbmt.hpp>
+#include <coroutine>
+#include <functional>
+#include <optional>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace lcbmt {
+
+/**
+ * Resumes a coroutine whose operation has completed. It is invoked from
+ * the thread delivering the result and must not block.
+ */
+using Resumer = std::function<void(std::coroutine_handle<>)>;
+
+class AsyncContext;
+
+namespace detail {
+
+/**
+ * Common part of the awaitables. The derived class starts the operation in
+ * start(), with complete() as its handler. The awaitable lives in the
+ * coroutine frame, so it stays valid until the coroutine is resumed.
+ */
+template <typename Derived, typename Result>
+class Awaitable {
+public:
+    bool await_ready() const noexcept { return false; }
+
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+        handle_ = handle;
+        /** The coroutine may be resumed before this returns */
+        static_cast<Derived *>(this)->start();
+    }
+
+    Result await_resume() { return std::move(*result_); }
+
+protected:
+    explicit Awaitable(const Resumer &resumer) : resumer_(resumer) {}
+
+    void complete(Result result)
+    {
+        result_.emplace(std::move(result));
+        if (resumer_) {
+            resumer_(handle_);
+        } else {
+            handle_.resume();
+        }
+    }
+
+private:
+    const Resumer &resumer_;
+    std::coroutine_handle<> handle_;
+    std::optional<Result> result_;
+};
+
+} // namespace detail
+
+class GetAwaitable : public detail::Awaitable<GetAwaitable, GetResult> {
+public:
+    GetAwaitable(Context &ctx, const Resumer &resumer, std::string_view key)
+        : Awaitable(resumer), ctx_(ctx), key_(key) {}
+
+    void start()
+    {
+        ctx_.get(key_, [this](GetResult res) { complete(std::move(res)); });
+    }
+
+private:
+    Context &ctx_;
+    std::string_view key_;
+};
+
+class MultiGetAwaitable
+    : public detail::Awaitable<MultiGetAwaitable, std::vector<GetResult>> {
+public:
+    MultiGetAwaitable(Context &ctx, const Resumer &resumer,
+                      std::vector<std::string_view> keys)
+        : Awaitable(resumer), ctx_(ctx), keys_(std::move(keys)) {}
+
+    void start()
+    {
+        ctx_.multi_get(keys_, [this](std::vector<GetResult> res) {
+            complete(std::move(res));
+        });
+    }
+
+private:
+    Context &ctx_;
+    std::vector<std::string_view> keys_;
+};
+
+class StoreAwaitable : public detail::Awaitable<StoreAwaitable, StoreResult> {
+public:
+    StoreAwaitable(Context &ctx, const Resumer &resumer,
+                   std::string_view key, std::string_view value,
+                   const StoreOptions &options)
+        : Awaitable(resumer), ctx_(ctx),
+          key_(key), value_(value), options_(options) {}
+
+    void start()
+    {
+        ctx_.set(key_, value_, options_, [this](StoreResult res) {
+            complete(std::move(res));
+        });
+    }
+
+private:
+    Context &ctx_;
+    std::string_view key_;
+    std::string_view value_;
+    StoreOptions options_;
+};
+
+/**
+ * Coroutine front end for a Context. Keys and values are only referenced
+ * until the operation has been started, i.e. until the co_await expression
+ * suspends. The context (and this object) must outlive all operations.
+ */
+class AsyncContext {
+public:
+    explicit AsyncContext(Context &ctx, Resumer resumer = Resumer())
+        : ctx_(ctx), resumer_(std::move(resumer)) {}
+
+    AsyncContext(const AsyncContext &) = delete;
+    AsyncContext &operator=(const AsyncContext &) = delete;
+
+    Context &context() const noexcept { return ctx_; }
+
+    GetAwaitable get(std::string_view key)
+    {
+        return GetAwaitable(ctx_, resumer_, key);
+    }
+
+    MultiGetAwaitable multi_get(std::vector<std::string_view> keys)
+    {
+        return MultiGetAwaitable(ctx_, resumer_, std::move(keys));
+    }
+
+    StoreAwaitable set(std::string_view key, std::string_view value,
+                       const StoreOptions &options = StoreOptions())
+    {
+        return StoreAwaitable(ctx_, resumer_, key, value, options);
+    }
+
+private:
+    Context &ctx_;
+    Resumer resumer_;
+};
+
+} // namespace lcbmt
+
+#endif
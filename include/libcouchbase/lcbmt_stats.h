@@ -0,0 +1,126 @@
+#ifndef LIBCOUCHBASE_MT_STATS_H
+#define LIBCOUCHBASE_MT_STATS_H
+#include <libcouchbase/couchbase.h>
+
+/**
+ * Layout of the statistics page a context publishes into shared memory
+ * (see lcb_mt_stats_publish()). External monitoring tools may attach to
+ * the segment (read-only) and read it without linking against this
+ * library or taking any lock shared with the application.
+ *
+ * The page is protected by a sequence lock. The writer increments 'seq'
+ * before and after each update, so a reader must:
+ *
+ * 1) Read 'seq'. If it is odd, an update is in progress; retry.
+ * 2) Copy the page.
+ * 3) Read 'seq' again. If it differs from the first read, retry.
+ *
+ * With a memory barrier between each of the steps.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LCBMT_STATS_MAGIC 0x544d424c /* 'LBMT' */
+#define LCBMT_STATS_VERSION 2
+
+/**
+ * Number of buckets in each latency histogram. Bucket 0 counts samples
+ * below one microsecond; bucket N counts samples in [2^(N-1), 2^N)
+ * microseconds. The last bucket also absorbs everything larger.
+ */
+#define LCBMT_STATS_NBUCKETS 24
+
+struct lcb_mt_stats_histogram {
+    lcb_uint64_t total;
+    lcb_uint64_t buckets[LCBMT_STATS_NBUCKETS];
+};
+
+struct lcb_mt_stats_page {
+    lcb_uint32_t magic;
+    lcb_uint32_t version;
+
+    /** Sequence lock. Odd while the writer is modifying the page */
+    volatile lcb_uint32_t seq;
+
+    /** PID of the publishing process */
+    lcb_uint32_t pid;
+
+    /** Wall clock time (in microseconds) of the last update */
+    lcb_uint64_t timestamp;
+
+    /** Number of updates made to this page */
+    lcb_uint64_t updates;
+
+    /** Times a scheduler had to wake the IO thread via the socket */
+    lcb_uint64_t notify_count;
+
+    /** Times the IO thread was woken up by a notification */
+    lcb_uint64_t enter_count;
+
+    /** Times a scheduler acquired the lock without contention */
+    lcb_uint64_t fast_count;
+
+    /** Largest number of schedulers seen queued for the lock */
+    lcb_uint64_t max_queue;
+
+    /** Number of schedulers currently queued for the lock */
+    lcb_uint64_t queue_depth;
+
+    /** Time schedulers spent waiting for the lock in lcb_mt_lock() */
+    struct lcb_mt_stats_histogram lock_wait;
+
+    /** Time the IO thread spent handing a response to its consumer */
+    struct lcb_mt_stats_histogram handoff;
+
+    /**
+     * Counters of the optional features (version 2). Those of features
+     * which are not enabled stay at zero.
+     */
+
+    /** GETs attached to an equivalent GET already in flight */
+    lcb_uint64_t flight_joins;
+
+    /** Responses copied instead of handed over to their consumer */
+    lcb_uint64_t responses_copied;
+
+    /** GETs answered from the near cache, and lookups which missed */
+    lcb_uint64_t cache_hits;
+    lcb_uint64_t cache_misses;
+
+    /** GETs answered by the negative lookup filter */
+    lcb_uint64_t negative_hits;
+
+    /** Batches scheduled, and the operations they contained */
+    lcb_uint64_t batch_flushes;
+    lcb_uint64_t batch_ops;
+
+    /** Arithmetic operations held back behind one for the same key */
+    lcb_uint64_t arithmetic_combined;
+
+    /** Stores held back behind one for the same key (with coalescing) */
+    lcb_uint64_t stores_coalesced;
+
+    /** Attempts rescheduled by the retry policy */
+    lcb_uint64_t retries;
+
+    /** Waiters given LCB_ETIMEDOUT by their operation timeout */
+    lcb_uint64_t timeouts;
+
+    /** Operations queued in a priority lane rather than sent at once */
+    lcb_uint64_t lane_holds;
+
+    /** Operations rejected with LCB_MT_EOVERLOAD by load shedding */
+    lcb_uint64_t ops_shed;
+
+    /** Replica reads sent for slow GETs, and those which answered first */
+    lcb_uint64_t hedges;
+    lcb_uint64_t hedge_wins;
+};
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
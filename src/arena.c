@@ -0,0 +1,147 @@
+#include "mt_internal.h"
+
+/**
+ * Response arena. Records are allocated from power-of-two size classes, each
+ * keeping a free list of released buffers for reuse. Buffers are allocated
+ * by the IO thread and released by whichever thread consumed the response,
+ * so each class has its own lock; these are only held to push or pop a list
+ * entry.
+ *
+ * The number of bytes kept on the free lists is bounded; buffers released
+ * beyond that (and any larger than the largest class) go back to malloc.
+ */
+
+#define ARENA_MIN_SHIFT 6
+#define ARENA_NCLASSES 11
+
+typedef struct arena_block {
+    struct arena_block *next;
+} arena_block;
+
+typedef struct {
+    pthread_mutex_t lock;
+    arena_block *free;
+    lcb_size_t nfree;
+    lcb_size_t max_free;
+} arena_class;
+
+struct lcbmt_arena_st {
+    arena_class classes[ARENA_NCLASSES];
+};
+
+/**
+ * Returns the class for a buffer of the given size, or -1 if it is too
+ * large for any of them
+ */
+static int size_class(lcb_size_t size)
+{
+    lcb_size_t cap = (lcb_size_t)1 << ARENA_MIN_SHIFT;
+    int ix = 0;
+
+    while (cap < size) {
+        cap <<= 1;
+        ix++;
+    }
+    return ix < ARENA_NCLASSES ? ix : -1;
+}
+
+LCBMT_INTERNAL
+lcbmt_arena_t *lcbmt_arena_create(lcb_size_t max_bytes)
+{
+    lcbmt_arena_t *arena = calloc(1, sizeof(*arena));
+    int ii;
+
+    if (!arena) {
+        return NULL;
+    }
+
+    /** Split the allowance evenly over the classes */
+    for (ii = 0; ii < ARENA_NCLASSES; ii++) {
+        arena_class *cls = &arena->classes[ii];
+        pthread_mutex_init(&cls->lock, NULL);
+        cls->max_free = (max_bytes / ARENA_NCLASSES) >> (ARENA_MIN_SHIFT + ii);
+    }
+    return arena;
+}
+
+LCBMT_INTERNAL
+void lcbmt_arena_destroy(lcbmt_arena_t *arena)
+{
+    int ii;
+
+    for (ii = 0; ii < ARENA_NCLASSES; ii++) {
+        arena_class *cls = &arena->classes[ii];
+        while (cls->free) {
+            arena_block *next = cls->free->next;
+            free(cls->free);
+            cls->free = next;
+        }
+        pthread_mutex_destroy(&cls->lock);
+    }
+    free(arena);
+}
+
+LCBMT_INTERNAL
+void *lcbmt_arena_alloc(lcbmt_arena_t *arena, lcb_size_t size)
+{
+    int ix = size_class(size);
+    arena_class *cls;
+    arena_block *block;
+
+    if (ix < 0) {
+        return malloc(size);
+    }
+
+    cls = &arena->classes[ix];
+    pthread_mutex_lock(&cls->lock);
+    block = cls->free;
+    if (block) {
+        cls->free = block->next;
+        cls->nfree--;
+    }
+    pthread_mutex_unlock(&cls->lock);
+
+    if (block) {
+        return block;
+    }
+    return malloc((lcb_size_t)1 << (ARENA_MIN_SHIFT + ix));
+}
+
+LCBMT_INTERNAL
+void lcbmt_arena_free(lcbmt_arena_t *arena, void *ptr, lcb_size_t size)
+{
+    int ix = size_class(size);
+    arena_class *cls;
+
+    if (ix < 0) {
+        free(ptr);
+        return;
+    }
+
+    cls = &arena->classes[ix];
+    pthread_mutex_lock(&cls->lock);
+    if (cls->nfree < cls->max_free) {
+        arena_block *block = ptr;
+        block->next = cls->free;
+        cls->free = block;
+        cls->nfree++;
+        ptr = NULL;
+    }
+    pthread_mutex_unlock(&cls->lock);
+
+    free(ptr);
+}
+
+LIBCOUCHBASE_API
+lcb_error_t lcb_mt_enable_response_copy(lcbmt_t mt, lcb_size_t max_pooled)
+{
+    if (mt->arena) {
+        return LCB_EINVAL;
+    }
+
+    mt->arena = lcbmt_arena_create(max_pooled);
+    if (!mt->arena) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    return LCB_SUCCESS;
+}
@@ -0,0 +1,163 @@
+#include "mt_internal.h"
+
+/**
+ * Batching of operations scheduled from different threads. Rather than each
+ * scheduling thread locking the context (and typically waking up the IO
+ * thread) on its own, operations are collected for a short window and then
+ * scheduled together under a single lock.
+ *
+ * There is no dedicated thread for this. The thread which submits the first
+ * operation of a batch arms a one-shot libcouchbase timer for the window,
+ * and returns like everyone else. The timer fires in the thread running the
+ * event loop, with the event lock held, and schedules everything which
+ * accumulated in the meantime. If the batch reaches its maximum size, the
+ * submitting thread schedules it at once; the timer then finds whatever was
+ * submitted since (possibly nothing).
+ *
+ * No thread ever waits for the window, so this is safe from callbacks which
+ * hold the event lock (inline, or the leader in leader/follower mode).
+ */
+
+LCBMT_INTERNAL
+void lcbmt_batch_append(lcbmt_batch_t *batch, lcbmt_op_t *op)
+{
+    op->next = NULL;
+    if (batch->tail) {
+        batch->tail->next = op;
+    } else {
+        batch->head = op;
+    }
+    batch->tail = op;
+    batch->count++;
+}
+
+/**
+ * Take the pending batch. Must be called with the batch lock held
+ */
+static void take_batch(lcbmt_ctx_t *mt, lcbmt_batch_t *out)
+{
+    *out = mt->batch;
+    memset(&mt->batch, 0, sizeof(mt->batch));
+    mt->batch_armed = 0;
+}
+
+static void flush_batch(lcbmt_ctx_t *mt, lcbmt_batch_t *batch)
+{
+    lcbmt_op_t *op = batch->head;
+
+    if (!op) {
+        return;
+    }
+
+    lcb_mt_lock(mt);
+    mt->batch_flushes++;
+    mt->batch_ops += batch->count;
+
+    while (op) {
+        lcbmt_op_t *next = op->next;
+        lcb_error_t err = lcbmt_op_schedule(op);
+        if (err != LCB_SUCCESS) {
+            lcbmt_op_fail(op, err);
+        }
+        op = next;
+    }
+    lcb_mt_unlock(mt);
+}
+
+static void flush_pending(lcbmt_ctx_t *mt)
+{
+    lcbmt_batch_t mine;
+
+    pthread_mutex_lock(&mt->batch_lock);
+    take_batch(mt, &mine);
+    pthread_mutex_unlock(&mt->batch_lock);
+    flush_batch(mt, &mine);
+}
+
+static void window_expired(lcb_timer_t timer,
+                           lcb_t instance,
+                           const void *cookie)
+{
+    lcbmt_ctx_t *mt = (lcbmt_ctx_t *)cookie;
+
+    /** One-shot timers are destroyed by libcouchbase once they fire */
+    mt->batch_timer = NULL;
+    flush_pending(mt);
+
+    (void)timer;
+    (void)instance;
+}
+
+LCBMT_INTERNAL
+void lcbmt_batch_submit(lcbmt_ctx_t *mt, lcbmt_batch_t *batch)
+{
+    lcbmt_batch_t mine;
+
+    pthread_mutex_lock(&mt->batch_lock);
+    if (mt->batch.tail) {
+        mt->batch.tail->next = batch->head;
+    } else {
+        mt->batch.head = batch->head;
+    }
+    mt->batch.tail = batch->tail;
+    mt->batch.count += batch->count;
+
+    if (mt->batch.count >= mt->batch_max) {
+        take_batch(mt, &mine);
+        pthread_mutex_unlock(&mt->batch_lock);
+        flush_batch(mt, &mine);
+        return;
+    }
+
+    if (mt->batch_armed) {
+        pthread_mutex_unlock(&mt->batch_lock);
+        return;
+    }
+    mt->batch_armed = 1;
+    pthread_mutex_unlock(&mt->batch_lock);
+
+    /**
+     * A timer armed for an earlier batch (which was then flushed for being
+     * full) may still be pending, in which case this batch is scheduled
+     * early.
+     */
+    lcb_mt_lock(mt);
+    if (!mt->batch_timer) {
+        lcb_error_t err;
+        mt->batch_timer = lcb_timer_create(mt->instance, mt,
+                                           mt->batch_window, 0,
+                                           window_expired, &err);
+    }
+    if (!mt->batch_timer) {
+        /** Nothing would ever schedule the batch */
+        flush_pending(mt);
+    }
+    lcb_mt_unlock(mt);
+}
+
+LCBMT_INTERNAL
+void lcbmt_batch_cleanup(lcbmt_ctx_t *mt)
+{
+    if (!mt->batch_window) {
+        return;
+    }
+    pthread_mutex_destroy(&mt->batch_lock);
+}
+
+LIBCOUCHBASE_API
+lcb_error_t lcb_mt_enable_batching(lcbmt_t mt,
+                                   lcb_uint32_t window,
+                                   unsigned int max_ops)
+{
+    if (mt->batch_window || window == 0 || max_ops == 0) {
+        return LCB_EINVAL;
+    }
+
+    if (pthread_mutex_init(&mt->batch_lock, NULL) != 0) {
+        return LCB_EINTERNAL;
+    }
+
+    mt->batch_max = max_ops;
+    mt->batch_window = window;
+    return LCB_SUCCESS;
+}
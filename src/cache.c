@@ -0,0 +1,302 @@
+#include "mt_internal.h"
+
+/**
+ * Near cache. This is a read cache of GET responses, split into several
+ * shards each with its own lock (so that lookups from different threads
+ * rarely contend), and each bounded by a share of the total byte budget.
+ *
+ * Eviction uses the CLOCK algorithm: entries are kept in a ring, and a hit
+ * sets the entry's 'referenced' bit. When space is needed, the hand sweeps
+ * the ring clearing the bits and evicting the first entry whose bit is
+ * already clear.
+ *
+ * Any mutation of a key seen by the context removes the key and bumps the
+ * shard's epoch, both when it is scheduled (if through the scheduling API)
+ * and when its response arrives. A GET response is only inserted if the
+ * epoch did not change since the GET was scheduled, so that a GET racing
+ * with a mutation cannot insert a value older than the mutation.
+ */
+
+#define CACHE_NSHARDS 16
+
+/** Relative expiry times larger than this are absolute timestamps */
+#define CACHE_MAX_RELATIVE_EXPTIME (30 * 24 * 60 * 60)
+
+typedef struct lcbmt_cache_entry_st {
+    lcbmt_keyent_t kent;
+
+    /** CLOCK ring */
+    struct lcbmt_cache_entry_st *prev;
+    struct lcbmt_cache_entry_st *next;
+    int referenced;
+
+    lcb_uint64_t expiry;
+    lcb_uint32_t flags;
+    lcb_cas_t cas;
+    lcb_size_t nvalue;
+
+    /** Key, followed by the value */
+    char buf[1];
+} cache_entry;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    lcbmt_keytab_t tab;
+    cache_entry *hand;
+    lcb_size_t nbytes;
+    volatile lcb_uint32_t epoch;
+} cache_shard;
+
+struct lcbmt_cache_st {
+    cache_shard shards[CACHE_NSHARDS];
+    lcb_size_t max_bytes;
+    lcb_uint64_t ttl;
+};
+
+#define ENTRY_SIZE(ent) (sizeof(*(ent)) + (ent)->kent.nkey + (ent)->nvalue)
+
+static cache_shard *get_shard(lcbmt_cache_t *cache, lcb_uint32_t hash)
+{
+    /**
+     * The key tables index by the low bits of the hash. Use the high bits
+     * here so that each shard's table is evenly populated
+     */
+    return &cache->shards[(hash >> 16) % CACHE_NSHARDS];
+}
+
+static void entry_unlink(cache_shard *shard, cache_entry *ent)
+{
+    lcbmt_keytab_remove(&shard->tab, &ent->kent);
+
+    if (ent->next == ent) {
+        shard->hand = NULL;
+    } else {
+        ent->prev->next = ent->next;
+        ent->next->prev = ent->prev;
+        if (shard->hand == ent) {
+            shard->hand = ent->next;
+        }
+    }
+
+    shard->nbytes -= ENTRY_SIZE(ent);
+    free(ent);
+}
+
+static void entry_link(cache_shard *shard, cache_entry *ent)
+{
+    lcbmt_keytab_insert(&shard->tab, &ent->kent);
+
+    /** Insert right behind the hand, i.e. as the last entry to be swept */
+    if (!shard->hand) {
+        ent->next = ent->prev = ent;
+        shard->hand = ent;
+    } else {
+        ent->next = shard->hand;
+        ent->prev = shard->hand->prev;
+        ent->prev->next = ent;
+        shard->hand->prev = ent;
+    }
+
+    shard->nbytes += ENTRY_SIZE(ent);
+}
+
+static void shard_evict(cache_shard *shard, lcb_size_t limit)
+{
+    while (shard->hand && shard->nbytes > limit) {
+        cache_entry *ent = shard->hand;
+        if (ent->referenced) {
+            ent->referenced = 0;
+            shard->hand = ent->next;
+        } else {
+            entry_unlink(shard, ent);
+        }
+    }
+}
+
+static cache_entry *shard_find(cache_shard *shard,
+                               const void *key, lcb_size_t nkey,
+                               lcb_uint32_t hash)
+{
+    lcbmt_keyent_t *kent = lcbmt_keytab_find(&shard->tab, key, nkey, hash);
+    if (!kent) {
+        return NULL;
+    }
+    return (cache_entry *)((char *)kent - offsetof(cache_entry, kent));
+}
+
+LCBMT_INTERNAL
+lcbmt_cache_t *lcbmt_cache_create(lcb_size_t max_bytes, lcb_uint32_t ttl)
+{
+    unsigned int ii;
+    lcbmt_cache_t *cache = calloc(1, sizeof(*cache));
+
+    if (!cache) {
+        return NULL;
+    }
+
+    cache->max_bytes = max_bytes / CACHE_NSHARDS;
+    cache->ttl = (lcb_uint64_t)ttl * 1000;
+
+    for (ii = 0; ii < CACHE_NSHARDS; ii++) {
+        cache_shard *shard = &cache->shards[ii];
+        if (lcbmt_keytab_init(&shard->tab, 64) != 0) {
+            lcbmt_cache_destroy(cache);
+            return NULL;
+        }
+        pthread_mutex_init(&shard->mutex, NULL);
+    }
+    return cache;
+}
+
+LCBMT_INTERNAL
+void lcbmt_cache_destroy(lcbmt_cache_t *cache)
+{
+    unsigned int ii;
+    for (ii = 0; ii < CACHE_NSHARDS; ii++) {
+        cache_shard *shard = &cache->shards[ii];
+        if (!shard->tab.buckets) {
+            continue;
+        }
+        while (shard->hand) {
+            entry_unlink(shard, shard->hand);
+        }
+        lcbmt_keytab_cleanup(&shard->tab);
+        pthread_mutex_destroy(&shard->mutex);
+    }
+    free(cache);
+}
+
+LCBMT_INTERNAL
+lcb_uint32_t lcbmt_cache_epoch(lcbmt_cache_t *cache, lcb_uint32_t hash)
+{
+    return get_shard(cache, hash)->epoch;
+}
+
+LCBMT_INTERNAL
+lcbmt_record_t *lcbmt_cache_lookup(lcbmt_ctx_t *mt,
+                                   const void *key, lcb_size_t nkey)
+{
+    lcb_uint32_t hash = lcbmt_hash_key(key, nkey);
+    cache_shard *shard = get_shard(mt->cache, hash);
+    cache_entry *ent;
+    lcbmt_record_t *rec = NULL;
+
+    pthread_mutex_lock(&shard->mutex);
+    ent = shard_find(shard, key, nkey, hash);
+    if (ent && ent->expiry <= lcbmt_now_usec()) {
+        entry_unlink(shard, ent);
+        ent = NULL;
+    }
+
+    if (ent) {
+        ent->referenced = 1;
+        rec = lcbmt_record_get(mt, LCB_SUCCESS,
+                               ent->buf, ent->kent.nkey,
+                               ent->buf + ent->kent.nkey, ent->nvalue,
+                               ent->flags, ent->cas);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+
+    /** Lookups are made without the event lock */
+    if (rec) {
+        __sync_fetch_and_add(&mt->cache_hits, 1);
+    } else {
+        __sync_fetch_and_add(&mt->cache_misses, 1);
+    }
+    return rec;
+}
+
+LCBMT_INTERNAL
+void lcbmt_cache_store(lcbmt_cache_t *cache,
+                       lcb_uint32_t epoch,
+                       lcb_time_t exptime,
+                       const lcb_get_resp_t *resp)
+{
+    const void *key = resp->v.v0.key;
+    lcb_size_t nkey = resp->v.v0.nkey;
+    lcb_uint32_t hash = lcbmt_hash_key(key, nkey);
+    cache_shard *shard = get_shard(cache, hash);
+    cache_entry *ent;
+    lcb_uint64_t ttl = cache->ttl;
+
+    ent = malloc(sizeof(*ent) + nkey + resp->v.v0.nbytes);
+    if (!ent) {
+        return;
+    }
+
+    memset(ent, 0, sizeof(*ent));
+    ent->kent.nkey = nkey;
+    ent->nvalue = resp->v.v0.nbytes;
+    if (ENTRY_SIZE(ent) > cache->max_bytes) {
+        free(ent);
+        return;
+    }
+
+    /**
+     * If the GET also set the expiry of the item, make sure we do not hold
+     * on to it for longer than the server does.
+     */
+    if (exptime > 0 && exptime <= CACHE_MAX_RELATIVE_EXPTIME &&
+            (lcb_uint64_t)exptime * 1000000 < ttl) {
+        ttl = (lcb_uint64_t)exptime * 1000000;
+    }
+
+    memcpy(ent->buf, key, nkey);
+    memcpy(ent->buf + nkey, resp->v.v0.bytes, resp->v.v0.nbytes);
+    ent->kent.key = ent->buf;
+    ent->kent.hash = hash;
+    ent->flags = resp->v.v0.flags;
+    ent->cas = resp->v.v0.cas;
+    ent->expiry = lcbmt_now_usec() + ttl;
+
+    pthread_mutex_lock(&shard->mutex);
+    if (shard->epoch != epoch) {
+        pthread_mutex_unlock(&shard->mutex);
+        free(ent);
+        return;
+    }
+
+    {
+        cache_entry *old = shard_find(shard, key, nkey, hash);
+        if (old) {
+            entry_unlink(shard, old);
+        }
+    }
+
+    shard_evict(shard, cache->max_bytes - ENTRY_SIZE(ent));
+    entry_link(shard, ent);
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+LCBMT_INTERNAL
+void lcbmt_cache_invalidate(lcbmt_cache_t *cache,
+                            const void *key, lcb_size_t nkey,
+                            lcb_uint32_t hash)
+{
+    cache_shard *shard = get_shard(cache, hash);
+    cache_entry *ent;
+
+    pthread_mutex_lock(&shard->mutex);
+    shard->epoch++;
+    ent = shard_find(shard, key, nkey, hash);
+    if (ent) {
+        entry_unlink(shard, ent);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+LIBCOUCHBASE_API
+lcb_error_t lcb_mt_enable_cache(lcbmt_t mt,
+                                lcb_size_t max_bytes,
+                                lcb_uint32_t ttl)
+{
+    if (mt->cache || max_bytes == 0 || ttl == 0) {
+        return LCB_EINVAL;
+    }
+
+    mt->cache = lcbmt_cache_create(max_bytes, ttl);
+    if (!mt->cache) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    return LCB_SUCCESS;
+}
@@ -1,7 +1,14 @@
 #include "mt_internal.h"
 
-#define SET_NEXT_CALLBACK(tok, name) \
-    tok->next_callback = (void(*)(void))tok->parent->callbacks.v.v0.name
+/**
+ * Responses are passed the token's current cookie, unless the operation was
+ * scheduled through the MT layer, in which case the deliver_* functions pass
+ * the cookie the token had at the time.
+ */
+#define SET_NEXT_CALLBACK(tok, name, type) \
+    tok->next_callback = (void(*)(void))LCBMT_TOKEN_CALLBACKS(tok)->v.v0.name; \
+    tok->resptype = type; \
+    tok->rcookie = tok->ucookie
 
 #define ASSIGN_COMMON(tok, err, resp) \
     tok->err = err; \
@@ -10,12 +17,127 @@
 static void token_enter(lcbmt_token_t token)
 {
     pthread_mutex_lock(&token->mutex);
+    token->handoff = 1;
+}
+
+/**
+ * Invoke the callback right here, in the thread running the event loop. The
+ * count is only decremented once the callback has returned, as the waiting
+ * thread may destroy the token as soon as it drops to zero.
+ */
+static void token_deliver_inline(lcbmt_token_t token, unsigned int decrcount)
+{
+    lcbmt_ctx_t *mt = token->parent;
+    void (*target)(void) = token->next_callback;
+    lcbmt_resptype_t type = token->resptype;
+    const void *cookie = token->rcookie;
+    lcb_error_t err = token->err;
+    lcb_storage_t storop = token->u_cb_special.storop;
+    const void *resp = token->resp;
+
+    token->resp = NULL;
+    token->next_callback = NULL;
+    pthread_mutex_unlock(&token->mutex);
+
+    /**
+     * The callback runs with the event lock held, so operations it
+     * schedules take the recursive path of lcb_mt_lock() and are sent by
+     * the event loop we're in.
+     */
+    lcbmt_token_dispatch(token, cookie, type, target, err, storop, resp);
+
+    pthread_mutex_lock(&token->mutex);
+    token->remaining -= decrcount;
+    token->handoff = 0;
+    lcbmt_token_signal(token);
+    pthread_mutex_unlock(&token->mutex);
+
+    /**
+     * The waiting thread has been woken up; let it schedule its next
+     * operations without having to notify us.
+     */
+    lcb_mt_enter(mt);
+    lcb_mt_leave(mt);
+}
+
+/**
+ * Copy the response and queue it to the token, to be consumed by
+ * lcb_mt_token_wait() or lcb_mt_token_next(), or hand it to the executor.
+ * Returns 0 if it has to be delivered some other way.
+ */
+static int token_deliver_copy(lcbmt_token_t token, unsigned int decrcount)
+{
+    lcbmt_record_t *rec;
+    const void *cookie;
+
+    if (decrcount != 1) {
+        return 0;
+    }
+
+    rec = lcbmt_record_copy(token->parent, token->resptype, token->err,
+                            token->u_cb_special.storop, token->resp);
+    if (!rec) {
+        return 0;
+    }
+
+    cookie = token->rcookie;
+    token->resp = NULL;
+    token->next_callback = NULL;
+    token->handoff = 0;
+    pthread_mutex_unlock(&token->mutex);
+
+    lcbmt_token_push(token, cookie, rec);
+    return 1;
 }
 
 static void token_leave(lcbmt_token_t token, unsigned int decrcount)
 {
+    lcbmt_ctx_t *mt = token->parent;
+    lcb_uint64_t begin = 0;
+
+    if ((token->flags & LCBMT_TOKEN_PULL) &&
+            token_deliver_copy(token, decrcount)) {
+        if (mt->leader_follower) {
+            lcbmt_lf_yield(mt, token);
+        }
+        return;
+    }
+
+    /** There is nobody to hand it to */
+    if (!token->next_callback) {
+        token->remaining -= decrcount;
+        token->resp = NULL;
+        token->handoff = 0;
+        lcbmt_token_signal(token);
+        pthread_mutex_unlock(&token->mutex);
+        return;
+    }
+
+    if (mt->exec_submit && token_deliver_copy(token, decrcount)) {
+        return;
+    }
+
+    if (mt->leader_follower && lcbmt_lf_deliver(token, decrcount)) {
+        return;
+    }
+
+    if (mt->inline_callbacks ||
+            (token->flags & LCBMT_TOKEN_INLINE_CALLBACKS)) {
+        token_deliver_inline(token, decrcount);
+        return;
+    }
+
+    if (mt->arena && token_deliver_copy(token, decrcount)) {
+        mt->responses_copied++;
+        return;
+    }
+
+    if (mt->stats_page) {
+        begin = lcbmt_now_usec();
+    }
+
     /** This mutex should be unlocked by the cond_wait loop in token.c */
-    lcb_mt_enter(token->parent);
+    lcb_mt_enter(mt);
 
     token->remaining -= decrcount;
     assert(token->next_callback);
@@ -24,7 +146,7 @@ static void token_leave(lcbmt_token_t token, unsigned int decrcount)
      * Signal that we're done setting information in the token. We don't
      * need to lock here since it's already done in token_enter()
      */
-    pthread_cond_signal(&token->cond);
+    lcbmt_token_signal(token);
 
     /**
      * This implies an unlock.
@@ -32,21 +154,72 @@ static void token_leave(lcbmt_token_t token, unsigned int decrcount)
     while (token->next_callback) {
         pthread_cond_wait(&token->cond, &token->mutex);
     }
+
+    /** The token may be destroyed as soon as the mutex is released */
+    token->handoff = 0;
+    pthread_cond_broadcast(&token->cond);
     pthread_mutex_unlock(&token->mutex);
-    lcb_mt_leave(token->parent);
+    lcb_mt_leave(mt);
+
+    if (mt->stats_page) {
+        lcbmt_hist_record(&mt->handoff, lcbmt_now_usec() - begin);
+        lcbmt_stats_update(mt);
+    }
+}
+
+static void deliver_store(lcbmt_token_t token,
+                          const void *ucookie,
+                          lcb_storage_t op,
+                          lcb_error_t err,
+                          const lcb_store_resp_t *resp)
+{
+    token_enter(token);
+    SET_NEXT_CALLBACK(token, store, LCBMT_RESP_STORE);
+    token->rcookie = ucookie;
+    ASSIGN_COMMON(token, err, resp);
+    token->u_cb_special.storop = op;
+    token_leave(token, 1);
 }
 
 static void store_callback(lcb_t instance,
                            const void *cookie,
-                           lcb_storage_t op,
+                           lcb_storage_t storop,
                            lcb_error_t err,
                            const lcb_store_resp_t *resp)
 {
-    lcbmt_token_t token = (lcbmt_token_t)cookie;
-    token_enter(token);
-    SET_NEXT_CALLBACK(token, store);
-    ASSIGN_COMMON(token, err, resp);
-    token_leave(token, 1);
+    lcbmt_op_t *op;
+    lcbmt_waiter_t *w;
+
+    if (LCBMT_COOKIE_TYPE(cookie) == LCBMT_COOKIE_TOKEN) {
+        lcbmt_token_t token = (lcbmt_token_t)cookie;
+        lcbmt_invalidate_key(token->parent, resp->v.v0.key, resp->v.v0.nkey);
+        deliver_store(token, token->ucookie, storop, err, resp);
+        return;
+    }
+
+    /**
+     * Stores superseded by this one are reported as having succeeded (or
+     * failed) along with it, with its CAS.
+     */
+    op = (lcbmt_op_t *)cookie;
+    if (lcbmt_op_retry(op, err)) {
+        return;
+    }
+    lcbmt_invalidate_key(op->parent, resp->v.v0.key, resp->v.v0.nkey);
+    lcbmt_op_complete(op);
+    if (op->timed_out) {
+        /** The waiters were told of the timeout; drop the late response */
+        lcbmt_op_destroy(op);
+        return;
+    }
+    lcbmt_timeout_stop(op);
+
+    for (w = &op->waiters; w; w = w->next) {
+        if (!w->timed_out) {
+            deliver_store(w->token, w->ucookie, storop, err, resp);
+        }
+    }
+    lcbmt_op_destroy(op);
 }
 
 
@@ -58,7 +231,7 @@ static void stats_callback(lcb_t instance, const void *cookie,
     int decrcount = 0;
 
     token_enter(token);
-    SET_NEXT_CALLBACK(token, stats);
+    SET_NEXT_CALLBACK(token, stats, LCBMT_RESP_OTHER);
     ASSIGN_COMMON(token, err, resp);
 
     if (resp->v.v0.server_endpoint == NULL) {
@@ -77,7 +250,7 @@ static void http_data_callback(lcb_http_request_t htreq,
 
     token_enter(token);
 
-    SET_NEXT_CALLBACK(token, http_data);
+    SET_NEXT_CALLBACK(token, http_data, LCBMT_RESP_OTHER);
     ASSIGN_COMMON(token, err, resp);
     token->u_cb_special.htreq = htreq;
 
@@ -93,7 +266,7 @@ static void http_complete_callback(lcb_http_request_t htreq,
     lcbmt_token_t token = (lcbmt_token_t)cookie;
     token_enter(token);
 
-    SET_NEXT_CALLBACK(token, http_complete);
+    SET_NEXT_CALLBACK(token, http_complete, LCBMT_RESP_OTHER);
     ASSIGN_COMMON(token, err, resp);
     token->u_cb_special.htreq = htreq;
 
@@ -101,24 +274,167 @@ static void http_complete_callback(lcb_http_request_t htreq,
 }
 
 
-#define DECLARE_CALLBACK(t_resp, cb_fld, name) \
+static void deliver_get(lcbmt_token_t token,
+                        const void *ucookie,
+                        lcb_error_t err,
+                        const lcb_get_resp_t *resp)
+{
+    token_enter(token);
+    SET_NEXT_CALLBACK(token, get, LCBMT_RESP_GET);
+    token->rcookie = ucookie;
+    ASSIGN_COMMON(token, err, resp);
+    token_leave(token, 1);
+}
+
+static void get_callback(lcb_t instance, const void *cookie, lcb_error_t err,
+                         const lcb_get_resp_t *resp)
+{
+    lcbmt_op_t *op;
+    lcbmt_waiter_t *w;
+    int replica = 0;
+
+    if (LCBMT_COOKIE_TYPE(cookie) == LCBMT_COOKIE_TOKEN) {
+        lcbmt_token_t token = (lcbmt_token_t)cookie;
+        deliver_get(token, token->ucookie, err, resp);
+        return;
+    }
+
+    if (LCBMT_COOKIE_TYPE(cookie) == LCBMT_COOKIE_HEDGE) {
+        op = LCBMT_OP_FROM_HEDGE(cookie);
+        replica = 1;
+    } else {
+        op = (lcbmt_op_t *)cookie;
+    }
+
+    if (op->legs && lcbmt_hedge_filter(op, replica, err)) {
+        return;
+    }
+
+    /**
+     * Remove the operation from the flight table before delivering. The
+     * event lock is released during each delivery, and any GET scheduled
+     * in the meantime must not attach itself to a response which has
+     * already arrived.
+     */
+    if (lcbmt_op_retry(op, err)) {
+        return;
+    }
+    lcbmt_op_complete(op);
+    if (op->timed_out) {
+        lcbmt_op_destroy(op);
+        return;
+    }
+    lcbmt_timeout_stop(op);
+
+    /** Replicas may lag behind; only remember what the active node says */
+    if (op->parent->cache && err == LCB_SUCCESS && !replica) {
+        lcbmt_cache_store(op->parent->cache,
+                          op->u.get.epoch, op->u.get.exptime, resp);
+    }
+
+    if (op->parent->negfilter && err == LCB_KEY_ENOENT && !replica) {
+        lcbmt_negfilter_add(op->parent->negfilter, op->u.get.nepoch,
+                            op->kent.key, op->kent.nkey, op->kent.hash);
+    }
+
+    for (w = &op->waiters; w; w = w->next) {
+        if (!w->timed_out) {
+            deliver_get(w->token, w->ucookie, err, resp);
+        }
+    }
+    if (!op->legs || !lcbmt_hedge_answered(op)) {
+        lcbmt_op_destroy(op);
+    }
+}
+
+static void deliver_arithmetic(lcbmt_token_t token,
+                               const void *ucookie,
+                               lcb_error_t err,
+                               const lcb_arithmetic_resp_t *resp)
+{
+    token_enter(token);
+    SET_NEXT_CALLBACK(token, arithmetic, LCBMT_RESP_ARITHMETIC);
+    token->rcookie = ucookie;
+    ASSIGN_COMMON(token, err, resp);
+    token_leave(token, 1);
+}
+
+static void arithmetic_callback(lcb_t instance, const void *cookie,
+                                lcb_error_t err,
+                                const lcb_arithmetic_resp_t *resp)
+{
+    lcbmt_op_t *op;
+    lcbmt_waiter_t *w;
+    lcb_arithmetic_resp_t copy;
+    lcb_int64_t later;
+
+    if (LCBMT_COOKIE_TYPE(cookie) == LCBMT_COOKIE_TOKEN) {
+        lcbmt_token_t token = (lcbmt_token_t)cookie;
+        lcbmt_invalidate_key(token->parent, resp->v.v0.key, resp->v.v0.nkey);
+        deliver_arithmetic(token, token->ucookie, err, resp);
+        return;
+    }
+
+    op = (lcbmt_op_t *)cookie;
+    if (lcbmt_op_retry(op, err)) {
+        return;
+    }
+    lcbmt_invalidate_key(op->parent, resp->v.v0.key, resp->v.v0.nkey);
+    lcbmt_op_complete(op);
+    if (op->timed_out) {
+        lcbmt_op_destroy(op);
+        return;
+    }
+    lcbmt_timeout_stop(op);
+
+    /**
+     * For a combined operation the server applied the waiters' deltas in
+     * one go, in the order they were scheduled. Each waiter's own result
+     * is the total minus the deltas of those which came after it. The
+     * arithmetic is modulo 2^64, as it is on the server.
+     */
+    copy = *resp;
+    later = op->u.arithmetic.delta;
+    for (w = &op->waiters; w; w = w->next) {
+        later -= w->delta;
+        if (w->timed_out) {
+            continue;
+        }
+        if (err == LCB_SUCCESS) {
+            copy.v.v0.value = resp->v.v0.value - (lcb_uint64_t)later;
+        }
+        deliver_arithmetic(w->token, w->ucookie, err, &copy);
+    }
+    lcbmt_op_destroy(op);
+}
+
+#define DECLARE_CALLBACK(t_resp, cb_fld, type, name, mutates) \
 static void name(lcb_t instance, const void *cookie, lcb_error_t err, \
                  const t_resp *resp) \
 { \
     lcbmt_token_t token = (lcbmt_token_t)cookie; \
+    if (mutates) { \
+        lcbmt_invalidate_key(token->parent, \
+                             resp->v.v0.key, resp->v.v0.nkey); \
+    } \
     token_enter(token); \
-    SET_NEXT_CALLBACK(token, cb_fld); \
+    SET_NEXT_CALLBACK(token, cb_fld, type); \
     token->resp = resp; \
     token->err = err; \
     token_leave(token, 1); \
 }
 
-DECLARE_CALLBACK(lcb_get_resp_t, get, get_callback)
-DECLARE_CALLBACK(lcb_remove_resp_t, remove, remove_callback)
-DECLARE_CALLBACK(lcb_arithmetic_resp_t, arithmetic, arithmetic_callback)
-DECLARE_CALLBACK(lcb_touch_resp_t, touch, touch_callback)
-DECLARE_CALLBACK(lcb_unlock_resp_t, unlock, unlock_callback)
-DECLARE_CALLBACK(lcb_durability_resp_t, endure, endure_callback);
+DECLARE_CALLBACK(lcb_remove_resp_t, remove, LCBMT_RESP_REMOVE,
+                 remove_callback, 1)
+DECLARE_CALLBACK(lcb_touch_resp_t, touch, LCBMT_RESP_TOUCH,
+                 touch_callback, 0)
+DECLARE_CALLBACK(lcb_unlock_resp_t, unlock, LCBMT_RESP_UNLOCK,
+                 unlock_callback, 0)
+DECLARE_CALLBACK(lcb_durability_resp_t, endure, LCBMT_RESP_OTHER,
+                 endure_callback, 0);
+
+/** Used until callbacks are set */
+static const struct lcb_mt_callback_table empty_callbacks;
 
 LCBMT_INTERNAL
 void lcbmt_wrap_callbacks(lcbmt_ctx_t *mt, lcb_t instance)
@@ -133,10 +449,39 @@ void lcbmt_wrap_callbacks(lcbmt_ctx_t *mt, lcb_t instance)
     lcb_set_durability_callback(instance, endure_callback);
     lcb_set_http_data_callback(instance, http_data_callback);
     lcb_set_http_complete_callback(instance, http_complete_callback);
+    mt->callbacks = &empty_callbacks;
 }
 
+/**
+ * Tables are published by swapping the context's pointer. Responses already
+ * handed over keep the callback they were resolved with, and readers which
+ * loaded the old pointer may go on using it, as it is never freed before
+ * the context.
+ */
 LIBCOUCHBASE_API
-void lcb_mt_set_callbacks(lcbmt_t mtp, const struct lcb_mt_callback_table *tbl)
+lcb_error_t lcb_mt_set_callbacks(lcbmt_t mtp,
+                                 const struct lcb_mt_callback_table *tbl)
+{
+    lcbmt_cbtable_t *ent = malloc(sizeof(*ent));
+    if (!ent) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    ent->tbl = *tbl;
+
+    do {
+        ent->next = mtp->cbtables;
+    } while (!__sync_bool_compare_and_swap(&mtp->cbtables, ent->next, ent));
+
+    mtp->callbacks = &ent->tbl;
+    return LCB_SUCCESS;
+}
+
+LCBMT_INTERNAL
+void lcbmt_callbacks_cleanup(lcbmt_ctx_t *mt)
 {
-    mtp->callbacks = *tbl;
+    while (mt->cbtables) {
+        lcbmt_cbtable_t *next = mt->cbtables->next;
+        free(mt->cbtables);
+        mt->cbtables = next;
+    }
 }
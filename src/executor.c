@@ -0,0 +1,297 @@
+#include "mt_internal.h"
+
+/**
+ * A simple work stealing thread pool. Each worker has its own queue; tasks
+ * submitted from a worker go onto its own queue, and those submitted from
+ * elsewhere are spread over the queues in turn. A worker takes the most
+ * recently queued task from its own queue, and once that is empty, the
+ * oldest task from another worker's queue.
+ */
+
+typedef struct {
+    lcb_mt_task_fn fn;
+    void *arg;
+} exec_task;
+
+typedef struct {
+    pthread_mutex_t lock;
+    exec_task *tasks;
+
+    /** Capacity of 'tasks', always a power of two */
+    unsigned int cap;
+
+    /** Oldest task (where others steal from) and the next free slot */
+    unsigned int head;
+    unsigned int tail;
+
+    pthread_t thr;
+    struct lcbmt_executor_st *pool;
+} exec_worker;
+
+struct lcbmt_executor_st {
+    exec_worker *workers;
+    unsigned int nworkers;
+    unsigned int nstarted;
+    unsigned int next;
+
+    /** Number of tasks queued but not yet taken */
+    volatile unsigned int pending;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    volatile unsigned int sleeping;
+    int stopping;
+};
+
+#define EXEC_INITIAL_CAP 64
+
+static pthread_key_t current_worker;
+static pthread_once_t current_worker_once = PTHREAD_ONCE_INIT;
+
+static void make_current_worker(void)
+{
+    pthread_key_create(&current_worker, NULL);
+}
+
+static int queue_push(exec_worker *w, lcb_mt_task_fn fn, void *arg)
+{
+    pthread_mutex_lock(&w->lock);
+    if (w->tail - w->head == w->cap) {
+        unsigned int ii, ncap = w->cap * 2;
+        exec_task *tasks = malloc(sizeof(*tasks) * ncap);
+        if (!tasks) {
+            pthread_mutex_unlock(&w->lock);
+            return -1;
+        }
+        for (ii = 0; ii < w->cap; ii++) {
+            tasks[ii] = w->tasks[(w->head + ii) & (w->cap - 1)];
+        }
+        free(w->tasks);
+        w->tasks = tasks;
+        w->head = 0;
+        w->tail = w->cap;
+        w->cap = ncap;
+    }
+    w->tasks[w->tail & (w->cap - 1)].fn = fn;
+    w->tasks[w->tail & (w->cap - 1)].arg = arg;
+    w->tail++;
+    pthread_mutex_unlock(&w->lock);
+    return 0;
+}
+
+static int queue_pop(exec_worker *w, exec_task *task)
+{
+    int found = 0;
+    pthread_mutex_lock(&w->lock);
+    if (w->tail != w->head) {
+        w->tail--;
+        *task = w->tasks[w->tail & (w->cap - 1)];
+        found = 1;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return found;
+}
+
+static int queue_steal(exec_worker *w, exec_task *task)
+{
+    int found = 0;
+    pthread_mutex_lock(&w->lock);
+    if (w->tail != w->head) {
+        *task = w->tasks[w->head & (w->cap - 1)];
+        w->head++;
+        found = 1;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return found;
+}
+
+static int take_task(exec_worker *self, exec_task *task)
+{
+    struct lcbmt_executor_st *pool = self->pool;
+    unsigned int ii, begin;
+
+    if (queue_pop(self, task)) {
+        return 1;
+    }
+
+    begin = (unsigned int)(self - pool->workers);
+    for (ii = 1; ii < pool->nworkers; ii++) {
+        if (queue_steal(&pool->workers[(begin + ii) % pool->nworkers], task)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void *worker_run(void *arg)
+{
+    exec_worker *self = arg;
+    struct lcbmt_executor_st *pool = self->pool;
+    exec_task task;
+
+    pthread_setspecific(current_worker, self);
+
+    while (1) {
+        int stop;
+
+        if (take_task(self, &task)) {
+            __sync_fetch_and_sub(&pool->pending, 1);
+            task.fn(task.arg);
+            continue;
+        }
+
+        /**
+         * Submitters only signal if someone is sleeping, so announce it
+         * before checking for pending tasks once more.
+         */
+        pthread_mutex_lock(&pool->lock);
+        pool->sleeping++;
+        lcbmt_barrier();
+        while (!pool->pending && !pool->stopping) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        pool->sleeping--;
+        stop = pool->stopping && !pool->pending;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (stop) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+LIBCOUCHBASE_API
+lcbmt_executor_t lcb_mt_executor_create(unsigned int nthreads)
+{
+    struct lcbmt_executor_st *pool;
+    unsigned int ii;
+
+    if (!nthreads) {
+        return NULL;
+    }
+
+    pthread_once(&current_worker_once, make_current_worker);
+
+    pool = calloc(1, sizeof(*pool));
+    if (!pool) {
+        return NULL;
+    }
+
+    pool->workers = calloc(nthreads, sizeof(*pool->workers));
+    if (!pool->workers) {
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    pool->nworkers = nthreads;
+
+    for (ii = 0; ii < nthreads; ii++) {
+        exec_worker *w = &pool->workers[ii];
+        w->pool = pool;
+        w->cap = EXEC_INITIAL_CAP;
+        w->tasks = malloc(sizeof(*w->tasks) * w->cap);
+        pthread_mutex_init(&w->lock, NULL);
+        if (!w->tasks) {
+            lcb_mt_executor_destroy(pool);
+            return NULL;
+        }
+    }
+
+    for (ii = 0; ii < nthreads; ii++) {
+        if (pthread_create(&pool->workers[ii].thr, NULL,
+                           worker_run, &pool->workers[ii]) != 0) {
+            lcb_mt_executor_destroy(pool);
+            return NULL;
+        }
+        pool->nstarted++;
+    }
+    return pool;
+}
+
+LIBCOUCHBASE_API
+void lcb_mt_executor_submit(void *executor, lcb_mt_task_fn fn, void *arg)
+{
+    struct lcbmt_executor_st *pool = executor;
+    exec_worker *w = pthread_getspecific(current_worker);
+
+    if (!w || w->pool != pool) {
+        w = &pool->workers[__sync_fetch_and_add(&pool->next, 1) %
+                           pool->nworkers];
+    }
+
+    /** Count the task first, as a worker may take (and uncount) it at once */
+    __sync_fetch_and_add(&pool->pending, 1);
+    if (queue_push(w, fn, arg) != 0) {
+        /** Can't queue it. Run it here rather than lose it */
+        __sync_fetch_and_sub(&pool->pending, 1);
+        fn(arg);
+        return;
+    }
+
+    if (pool->sleeping) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_signal(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+LIBCOUCHBASE_API
+void lcb_mt_executor_destroy(lcbmt_executor_t pool)
+{
+    unsigned int ii;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (ii = 0; ii < pool->nstarted; ii++) {
+        pthread_join(pool->workers[ii].thr, NULL);
+    }
+
+    for (ii = 0; ii < pool->nworkers; ii++) {
+        pthread_mutex_destroy(&pool->workers[ii].lock);
+        free(pool->workers[ii].tasks);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    free(pool->workers);
+    free(pool);
+}
+
+static void run_record(void *arg)
+{
+    lcbmt_record_t *rec = arg;
+    lcbmt_token_t token = rec->token;
+
+    lcbmt_token_dispatch(token, rec->ucookie, rec->type, rec->callback,
+                         rec->err, rec->storop, &rec->resp);
+    lcbmt_record_destroy(rec);
+
+    /** The token may be destroyed as soon as the count drops to zero */
+    pthread_mutex_lock(&token->mutex);
+    token->remaining--;
+    lcbmt_token_signal(token);
+    pthread_mutex_unlock(&token->mutex);
+}
+
+LCBMT_INTERNAL
+void lcbmt_exec_submit(lcbmt_token_t token, lcbmt_record_t *rec)
+{
+    lcbmt_ctx_t *mt = token->parent;
+    rec->token = token;
+    mt->exec_submit(mt->exec_arg, run_record, rec);
+}
+
+LIBCOUCHBASE_API
+void lcb_mt_set_executor(lcbmt_t mt,
+                         lcb_mt_submit_fn submit,
+                         void *executor)
+{
+    mt->exec_submit = submit;
+    mt->exec_arg = executor;
+}
@@ -0,0 +1,163 @@
+#include "mt_internal.h"
+
+/**
+ * Hedged GETs. A plain GET which has not been answered after a delay
+ * (derived from a percentile of recent GET latencies) is also sent to a
+ * replica, through a timer in the context's wheel. The two reads share the
+ * operation: the replica read is given the operation's 'hedge_cookie', so
+ * that the wrappers can tell the responses apart.
+ *
+ * The first successful response (or a miss reported by the active node) is
+ * delivered; a failed response is ignored while the other read is still
+ * outstanding. The operation is destroyed once both responses have
+ * arrived.
+ */
+
+/** Latencies are halved once this many are held, to favour recent ones */
+#define HEDGE_DECAY_TOTAL 4096
+
+/** How often (in samples) the delay is derived again */
+#define HEDGE_UPDATE_MASK 63
+
+/**
+ * Returns the latency (in microseconds) at the given percentile, with
+ * linear interpolation within the histogram's buckets
+ */
+static lcb_uint32_t latency_percentile(const struct lcb_mt_stats_histogram *h,
+                                       double percentile)
+{
+    double rank = (double)h->total * percentile / 100.0;
+    double seen = 0;
+    int ii;
+
+    for (ii = 0; ii < LCBMT_STATS_NBUCKETS; ii++) {
+        double count = (double)h->buckets[ii];
+        double lo, hi;
+
+        if (seen + count < rank) {
+            seen += count;
+            continue;
+        }
+
+        lo = ii ? (double)((lcb_uint32_t)1 << (ii - 1)) : 0;
+        hi = (double)((lcb_uint32_t)1 << ii);
+        return (lcb_uint32_t)(lo + (hi - lo) * (rank - seen) / count);
+    }
+    return (lcb_uint32_t)1 << (LCBMT_STATS_NBUCKETS - 1);
+}
+
+static void record_latency(lcbmt_ctx_t *mt, lcb_uint64_t usec)
+{
+    struct lcb_mt_stats_histogram *h = &mt->hedge_latency;
+    lcb_uint32_t delay;
+
+    lcbmt_hist_record(h, usec);
+
+    if (h->total >= HEDGE_DECAY_TOTAL) {
+        int ii;
+        h->total = 0;
+        for (ii = 0; ii < LCBMT_STATS_NBUCKETS; ii++) {
+            h->buckets[ii] /= 2;
+            h->total += h->buckets[ii];
+        }
+    }
+
+    if ((h->total & HEDGE_UPDATE_MASK) != 0) {
+        return;
+    }
+
+    delay = latency_percentile(h, mt->hedge_percentile);
+    if (delay < mt->hedge_min) {
+        delay = mt->hedge_min;
+    } else if (delay > mt->hedge_max) {
+        delay = mt->hedge_max;
+    }
+    mt->hedge_delay = delay;
+}
+
+static void hedge_expire(lcbmt_tnode_t *node)
+{
+    lcbmt_op_t *op = (lcbmt_op_t *)((char *)node -
+                                    offsetof(lcbmt_op_t, hnode));
+    lcb_get_replica_cmd_t cmd;
+    const lcb_get_replica_cmd_t *cmdp = &cmd;
+
+    /** While waiting to be retried, the GET isn't slow but failing */
+    if (op->answered || op->timed_out || op->retry.waiting) {
+        return;
+    }
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.v.v0.key = op->kent.key;
+    cmd.v.v0.nkey = op->kent.nkey;
+    if (lcb_get_replica(op->parent->instance, &op->hedge_cookie,
+                        1, &cmdp) == LCB_SUCCESS) {
+        op->legs++;
+        op->parent->hedges++;
+    }
+}
+
+LCBMT_INTERNAL
+void lcbmt_hedge_start(lcbmt_op_t *op)
+{
+    lcbmt_ctx_t *mt = op->parent;
+
+    op->hedge_cookie = LCBMT_COOKIE_HEDGE;
+    op->legs = 1;
+    op->issued = lcbmt_now_usec();
+    op->hnode.expire = hedge_expire;
+    lcbmt_ctx_timer_add(mt, &op->hnode, LCBMT_WHEEL_AFTER(mt->hedge_delay));
+}
+
+LCBMT_INTERNAL
+int lcbmt_hedge_filter(lcbmt_op_t *op, int replica, lcb_error_t err)
+{
+    if (op->answered || op->timed_out) {
+        if (--op->legs == 0) {
+            lcbmt_op_destroy(op);
+        }
+        return 1;
+    }
+
+    if (op->legs > 1 && err != LCB_SUCCESS &&
+            (replica || err != LCB_KEY_ENOENT)) {
+        op->legs--;
+        return 1;
+    }
+
+    /** Only first attempts say how long the active node takes */
+    if (replica) {
+        op->parent->hedge_wins += err == LCB_SUCCESS;
+    } else if (op->retry.attempts == 0) {
+        record_latency(op->parent, lcbmt_now_usec() - op->issued);
+    }
+    return 0;
+}
+
+LCBMT_INTERNAL
+int lcbmt_hedge_answered(lcbmt_op_t *op)
+{
+    if (--op->legs == 0) {
+        return 0;
+    }
+    /** The waiters are done with; only the other response is awaited */
+    op->answered = 1;
+    return 1;
+}
+
+LIBCOUCHBASE_API
+lcb_error_t lcb_mt_enable_hedging(lcbmt_t mt,
+                                  double percentile,
+                                  lcb_uint32_t min_delay,
+                                  lcb_uint32_t max_delay)
+{
+    if (mt->hedge_percentile || percentile <= 0 || percentile >= 100 ||
+            min_delay > max_delay) {
+        return LCB_EINVAL;
+    }
+    mt->hedge_percentile = percentile;
+    mt->hedge_min = min_delay;
+    mt->hedge_max = max_delay;
+    mt->hedge_delay = max_delay;
+    return LCB_SUCCESS;
+}
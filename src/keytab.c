@@ -0,0 +1,125 @@
+#include "mt_internal.h"
+
+/**
+ * A simple chained hash table keyed by item keys. Entries are embedded in
+ * the structures they index (see lcbmt_keyent_t), so the table itself never
+ * allocates anything except for its bucket array.
+ *
+ * The table does not perform any locking; this is the job of the owner.
+ */
+
+LCBMT_INTERNAL
+lcb_uint32_t lcbmt_hash_key(const void *key, lcb_size_t nkey)
+{
+    /** FNV-1a */
+    const unsigned char *p = key;
+    lcb_uint32_t hash = 2166136261U;
+    lcb_size_t ii;
+
+    for (ii = 0; ii < nkey; ii++) {
+        hash ^= p[ii];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+LCBMT_INTERNAL
+int lcbmt_keytab_init(lcbmt_keytab_t *tab, lcb_size_t nbuckets)
+{
+    tab->count = 0;
+    tab->nbuckets = nbuckets;
+    tab->buckets = calloc(nbuckets, sizeof(*tab->buckets));
+    if (!tab->buckets) {
+        return -1;
+    }
+    return 0;
+}
+
+LCBMT_INTERNAL
+void lcbmt_keytab_cleanup(lcbmt_keytab_t *tab)
+{
+    free(tab->buckets);
+    tab->buckets = NULL;
+    tab->nbuckets = 0;
+    tab->count = 0;
+}
+
+LCBMT_INTERNAL
+lcbmt_keyent_t *lcbmt_keytab_find(lcbmt_keytab_t *tab,
+                                  const void *key,
+                                  lcb_size_t nkey,
+                                  lcb_uint32_t hash)
+{
+    lcbmt_keyent_t *ent;
+
+    if (!tab->nbuckets) {
+        return NULL;
+    }
+
+    for (ent = tab->buckets[hash % tab->nbuckets]; ent; ent = ent->next) {
+        if (ent->hash == hash &&
+                ent->nkey == nkey &&
+                memcmp(ent->key, key, nkey) == 0) {
+            return ent;
+        }
+    }
+    return NULL;
+}
+
+static void keytab_grow(lcbmt_keytab_t *tab)
+{
+    lcbmt_keyent_t **buckets;
+    lcb_size_t nbuckets = tab->nbuckets * 2;
+    lcb_size_t ii;
+
+    buckets = calloc(nbuckets, sizeof(*buckets));
+    if (!buckets) {
+        /** Not fatal; we just get longer chains */
+        return;
+    }
+
+    for (ii = 0; ii < tab->nbuckets; ii++) {
+        lcbmt_keyent_t *ent = tab->buckets[ii];
+        while (ent) {
+            lcbmt_keyent_t *next = ent->next;
+            ent->next = buckets[ent->hash % nbuckets];
+            buckets[ent->hash % nbuckets] = ent;
+            ent = next;
+        }
+    }
+
+    free(tab->buckets);
+    tab->buckets = buckets;
+    tab->nbuckets = nbuckets;
+}
+
+LCBMT_INTERNAL
+void lcbmt_keytab_insert(lcbmt_keytab_t *tab, lcbmt_keyent_t *ent)
+{
+    lcbmt_keyent_t **head;
+
+    if (tab->count >= tab->nbuckets * 2) {
+        keytab_grow(tab);
+    }
+
+    head = &tab->buckets[ent->hash % tab->nbuckets];
+    ent->next = *head;
+    *head = ent;
+    tab->count++;
+}
+
+LCBMT_INTERNAL
+void lcbmt_keytab_remove(lcbmt_keytab_t *tab, lcbmt_keyent_t *ent)
+{
+    lcbmt_keyent_t **pp = &tab->buckets[ent->hash % tab->nbuckets];
+
+    for (; *pp; pp = &(*pp)->next) {
+        if (*pp == ent) {
+            *pp = ent->next;
+            ent->next = NULL;
+            tab->count--;
+            return;
+        }
+    }
+    abort();
+}
@@ -0,0 +1,186 @@
+#include "mt_internal.h"
+
+/**
+ * Priority lanes. The context admits a limited number of operations into
+ * libcouchbase at a time; operations scheduled beyond that wait in the lane
+ * of their token's priority. Whenever an admitted operation is done with,
+ * the lanes are drained in weighted round robin order: the current lane
+ * gives up its turn once it has used up its weight (or is empty).
+ *
+ * An operation stays admitted until it is destroyed, so a GET joining a
+ * flight, or an increment combined into a pending one, gives its slot back
+ * right away. Everything here is done with the event lock held.
+ */
+
+struct lcbmt_lanes_st {
+    lcbmt_batch_t lane[LCB_MT_PRIORITY_MAX];
+    unsigned int weight[LCB_MT_PRIORITY_MAX];
+
+    /** Lane whose turn it is, and how many more operations it may issue */
+    unsigned int current;
+    unsigned int credit;
+
+    unsigned int inflight;
+    unsigned int max_inflight;
+
+    /** Set while dispatching queued operations */
+    int draining;
+};
+
+static lcbmt_op_t *lane_pop(lcbmt_batch_t *lane)
+{
+    lcbmt_op_t *op = lane->head;
+
+    lane->head = op->next;
+    if (!lane->head) {
+        lane->tail = NULL;
+    }
+    lane->count--;
+    op->next = NULL;
+    return op;
+}
+
+/**
+ * Returns the next queued operation to be issued, or NULL if all lanes are
+ * empty
+ */
+static lcbmt_op_t *next_queued(lcbmt_lanes_t *lanes)
+{
+    unsigned int ii;
+
+    for (ii = 0; ii <= LCB_MT_PRIORITY_MAX; ii++) {
+        lcbmt_batch_t *lane = &lanes->lane[lanes->current];
+
+        if (lane->head && lanes->credit) {
+            lanes->credit--;
+            return lane_pop(lane);
+        }
+
+        lanes->current = (lanes->current + 1) % LCB_MT_PRIORITY_MAX;
+        lanes->credit = lanes->weight[lanes->current];
+    }
+    return NULL;
+}
+
+static void admit(lcbmt_lanes_t *lanes, lcbmt_op_t *op)
+{
+    op->admitted = 1;
+    lanes->inflight++;
+}
+
+static void drain(lcbmt_ctx_t *mt)
+{
+    lcbmt_lanes_t *lanes = mt->lanes;
+
+    /** Operations failing below release their slot from in here */
+    if (lanes->draining) {
+        return;
+    }
+    lanes->draining = 1;
+
+    while (lanes->inflight < lanes->max_inflight) {
+        lcbmt_op_t *op = next_queued(lanes);
+        lcb_error_t err;
+
+        if (!op) {
+            break;
+        }
+
+        /** Already reported to its waiters */
+        if (op->timed_out) {
+            lcbmt_op_destroy(op);
+            continue;
+        }
+
+        admit(lanes, op);
+        err = lcbmt_op_dispatch(op);
+        if (err != LCB_SUCCESS) {
+            lcbmt_op_fail(op, err);
+        }
+    }
+
+    lanes->draining = 0;
+}
+
+LCBMT_INTERNAL
+int lcbmt_lanes_hold(lcbmt_op_t *op)
+{
+    lcbmt_ctx_t *mt = op->parent;
+    lcbmt_lanes_t *lanes = mt->lanes;
+    unsigned int ii;
+    int queued = 0;
+
+    for (ii = 0; ii < LCB_MT_PRIORITY_MAX; ii++) {
+        queued |= lanes->lane[ii].head != NULL;
+    }
+
+    /** Don't overtake operations already waiting */
+    if (lanes->inflight < lanes->max_inflight && !queued) {
+        admit(lanes, op);
+        return 0;
+    }
+
+    lcbmt_batch_append(&lanes->lane[op->priority], op);
+    mt->lane_holds++;
+    return 1;
+}
+
+LCBMT_INTERNAL
+void lcbmt_lanes_release(lcbmt_op_t *op)
+{
+    lcbmt_ctx_t *mt = op->parent;
+
+    op->admitted = 0;
+    mt->lanes->inflight--;
+    drain(mt);
+}
+
+LCBMT_INTERNAL
+void lcbmt_lanes_destroy(lcbmt_lanes_t *lanes)
+{
+    unsigned int ii;
+
+    for (ii = 0; ii < LCB_MT_PRIORITY_MAX; ii++) {
+        while (lanes->lane[ii].head) {
+            lcbmt_op_destroy(lane_pop(&lanes->lane[ii]));
+        }
+    }
+    free(lanes);
+}
+
+LIBCOUCHBASE_API
+lcb_error_t lcb_mt_enable_lanes(lcbmt_t mt,
+                                unsigned int max_inflight,
+                                unsigned int interactive_weight,
+                                unsigned int bulk_weight)
+{
+    lcbmt_lanes_t *lanes;
+
+    if (mt->lanes || max_inflight == 0 ||
+            interactive_weight == 0 || bulk_weight == 0) {
+        return LCB_EINVAL;
+    }
+
+    lanes = calloc(1, sizeof(*lanes));
+    if (!lanes) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    lanes->weight[LCB_MT_PRIORITY_INTERACTIVE] = interactive_weight;
+    lanes->weight[LCB_MT_PRIORITY_BULK] = bulk_weight;
+    lanes->credit = interactive_weight;
+    lanes->max_inflight = max_inflight;
+    mt->lanes = lanes;
+    return LCB_SUCCESS;
+}
+
+LIBCOUCHBASE_API
+lcb_error_t lcb_mt_token_set_priority(lcbmt_token_t token,
+                                      lcb_mt_priority_t priority)
+{
+    /** The priority indexes the lanes */
+    if ((unsigned int)priority >= LCB_MT_PRIORITY_MAX) {
+        return LCB_EINVAL;
+    }
+    token->priority = priority;
+    return LCB_SUCCESS;
+}
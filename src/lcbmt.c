@@ -2,54 +2,114 @@
 #include <stdlib.h>
 #include <stdio.h>
 /**
- * Run from within the IOPS thread.
+ * Run from within the IOPS thread. The instances of all contexts attached
+ * to the loop share its IO options, so running the event loop for one of
+ * them serves the others too; each is waited for in turn until none has
+ * anything left to do.
  */
-static void lcbmt_internal_run(lcbmt_ctx_t *mt)
+static void lcbmt_internal_run(lcbmt_loop_t loop)
 {
-    if (lcbmt_negotiate_client(mt) != 0) {
+    if (lcbmt_negotiate_client(loop) != 0) {
         fprintf(stderr, "Couldn't negotiate client connection..\n");
         return;
     }
 
     while (1) {
-        pthread_mutex_lock(&mt->event_lock);
-        pthread_cond_wait(&mt->cond, &mt->event_lock);
-        lcb_wait(mt->instance);
-        pthread_mutex_unlock(&mt->event_lock);
+        lcbmt_ctx_t *mt;
+
+        pthread_mutex_lock(&loop->event_lock);
+        while (!loop->scheduled && !loop->stopping) {
+            /** Keep the statistics pages (if any) ticking while idle */
+            if (lcbmt_stats_update_loop(loop)) {
+                lcbmt_cond_timedwait(&loop->cond, &loop->event_lock,
+                                     LCBMT_STATS_PERIOD);
+            } else {
+                pthread_cond_wait(&loop->cond, &loop->event_lock);
+            }
+        }
+        if (loop->stopping) {
+            pthread_mutex_unlock(&loop->event_lock);
+            break;
+        }
+        loop->scheduled = 0;
+        lcbmt_lock_acquired(loop);
+        for (mt = loop->contexts; mt; mt = mt->loop_next) {
+            loop->waiting = mt;
+            lcb_wait(mt->instance);
+            loop->waiting = NULL;
+            if (loop->detaching) {
+                pthread_cond_broadcast(&loop->cond);
+            }
+        }
+        lcbmt_stats_update_loop(loop);
+        lcbmt_lock_releasing(loop);
+        pthread_mutex_unlock(&loop->event_lock);
     }
 }
 
+static void set_wait_start(lcbmt_loop_t loop)
+{
+    pthread_mutex_lock(&loop->wait_lock);
+    loop->waiters++;
+}
+
+static void set_wait_done(lcbmt_loop_t loop)
+{
+    pthread_mutex_unlock(&loop->wait_lock);
+}
+
+static void wait_for_schedulers(lcbmt_loop_t loop)
+{
+    pthread_mutex_lock(&loop->wait_lock);
+    if (loop->waiters > loop->max_queue) {
+        loop->max_queue = loop->waiters;
+    }
+    loop->waiters = 0;
+
+    pthread_mutex_lock(&loop->event_lock);
+    lcbmt_lock_acquired(loop);
+    pthread_mutex_unlock(&loop->wait_lock);
+}
+
 /**
  * Handler invoked by the socket callback (from the event loop)
  */
-void lcbmt_internal_callback(lcbmt_ctx_t *mt)
+void lcbmt_internal_callback(lcbmt_loop_t loop)
 {
-    mt->enter_count++;
-    lcb_mt_enter(mt);
-    lcb_mt_leave(mt);
+    loop->enter_count++;
+    lcbmt_lock_releasing(loop);
+    pthread_mutex_unlock(&loop->event_lock);
+    wait_for_schedulers(loop);
+    lcbmt_stats_update_loop(loop);
 }
 
-static void set_wait_start(lcbmt_ctx_t *mt)
+LCBMT_INTERNAL
+void lcbmt_lock_acquired(lcbmt_loop_t loop)
 {
-    pthread_mutex_lock(&mt->wait_lock);
-    mt->waiters++;
+    loop->lock_owner = pthread_self();
+    loop->lock_depth = 0;
+    lcbmt_barrier();
+    loop->lock_owned = 1;
 }
 
-static void set_wait_done(lcbmt_ctx_t *mt)
+LCBMT_INTERNAL
+void lcbmt_lock_releasing(lcbmt_loop_t loop)
 {
-    pthread_mutex_unlock(&mt->wait_lock);
+    loop->lock_owned = 0;
 }
 
-static void wait_for_schedulers(lcbmt_ctx_t *mt)
+/**
+ * Whether the calling thread holds the event lock. Only the owner itself
+ * can find 'lock_owner' set to it while 'lock_owned' is set; others may
+ * read stale values, but never their own.
+ */
+static int lock_is_mine(lcbmt_loop_t loop)
 {
-    pthread_mutex_lock(&mt->wait_lock);
-    if (mt->waiters > mt->max_queue) {
-        mt->max_queue = mt->waiters;
+    if (!loop->lock_owned) {
+        return 0;
     }
-    mt->waiters = 0;
-
-    pthread_mutex_lock(&mt->event_lock);
-    pthread_mutex_unlock(&mt->wait_lock);
+    lcbmt_barrier();
+    return pthread_equal(loop->lock_owner, pthread_self());
 }
 
 LIBCOUCHBASE_API
@@ -60,7 +120,8 @@ void lcb_mt_enter(lcbmt_ctx_t *mt)
      * event mutex to not send spurious I/O events; and that any lock
      * contention is due to a different scheduler thread using it.
      */
-    pthread_mutex_unlock(&mt->event_lock);
+    lcbmt_lock_releasing(mt->loop);
+    pthread_mutex_unlock(&mt->loop->event_lock);
 }
 
 LIBCOUCHBASE_API
@@ -73,93 +134,254 @@ void lcb_mt_leave(lcbmt_ctx_t *mt)
      * occurs. The socket event itself may take place *before* the scheuler
      * has had the chance to enter the lock queue.
      */
-    wait_for_schedulers(mt);
+    wait_for_schedulers(mt->loop);
 }
 
 /**
  * Basic pattern:
- * Try to get a lock immediately. If that doesn't work,
- * see if another thread has sent a socket request yet (so we don't spam
- * the socket).
+ * If we already hold the lock (e.g. we're in a callback invoked by the
+ * thread running the event loop), just count it. Otherwise, try to get a
+ * lock immediately. If that doesn't work, see if another thread has sent a
+ * socket request yet (so we don't spam the socket).
  */
 LIBCOUCHBASE_API
 lcb_error_t lcb_mt_lock(lcbmt_t mtp)
 {
-    if (pthread_mutex_trylock(&mtp->event_lock)) {
-        set_wait_start(mtp);
-        lcbmt_notify(mtp);
-        pthread_mutex_lock(&mtp->event_lock);
-        set_wait_done(mtp);
+    lcbmt_loop_t loop = mtp->loop;
+
+    if (lock_is_mine(loop)) {
+        loop->lock_depth++;
+        mtp->fast_count++;
+        return LCB_SUCCESS;
+    }
+
+    if (pthread_mutex_trylock(&loop->event_lock)) {
+        lcb_uint64_t begin = 0;
+        if (mtp->stats_page) {
+            begin = lcbmt_now_usec();
+        }
+
+        set_wait_start(loop);
+        lcbmt_notify(loop);
+        mtp->notify_count++;
+        pthread_mutex_lock(&loop->event_lock);
+        set_wait_done(loop);
+
+        if (mtp->stats_page) {
+            lcbmt_hist_record(&mtp->lock_wait, lcbmt_now_usec() - begin);
+        }
 
     } else {
         mtp->fast_count++;
     }
 
+    lcbmt_lock_acquired(loop);
     return LCB_SUCCESS;
 }
 
 LIBCOUCHBASE_API
 void lcb_mt_unlock(lcbmt_t mtp)
 {
-    pthread_cond_signal(&mtp->cond);
-    pthread_mutex_unlock(&mtp->event_lock);
+    lcbmt_loop_t loop = mtp->loop;
+
+    loop->scheduled = 1;
+
+    /**
+     * Nested unlock: whoever holds the lock on the outside either runs the
+     * event loop, which sends what was scheduled, or wakes up the thread
+     * which does when it unlocks.
+     */
+    if (loop->lock_depth) {
+        loop->lock_depth--;
+        return;
+    }
+
+    lcbmt_stats_update(mtp);
+    pthread_cond_signal(&loop->cond);
+    lcbmt_lock_releasing(loop);
+    pthread_mutex_unlock(&loop->event_lock);
+}
+
+/**
+ * Acquire the event lock of a loop, waking up its IO thread if needed
+ */
+static void loop_lock(lcbmt_loop_t loop)
+{
+    if (pthread_mutex_trylock(&loop->event_lock)) {
+        set_wait_start(loop);
+        lcbmt_notify(loop);
+        pthread_mutex_lock(&loop->event_lock);
+        set_wait_done(loop);
+    }
+    lcbmt_lock_acquired(loop);
 }
 
 /**
  * Call this after the instance has been set, and the connection to
  * us has been initiated
  */
-lcb_error_t lcb_mt_io_start(lcbmt_t mtp)
+LCBMT_INTERNAL
+lcb_error_t lcbmt_loop_start(lcbmt_loop_t loop)
 {
-    if (lcbmt_start_iops_thread(mtp, lcbmt_internal_run) != 0) {
+    if (lcbmt_start_iops_thread(loop, lcbmt_internal_run) != 0) {
         return LCB_EINTERNAL;
     }
+    loop->started = 1;
 
-    if (lcbmt_negotiate_server(mtp) != 0) {
+    if (lcbmt_negotiate_server(loop) != 0) {
         return LCB_EINTERNAL;
     }
 
     return LCB_SUCCESS;
 }
 
+LCBMT_INTERNAL
+void lcbmt_loop_stop(lcbmt_loop_t loop)
+{
+    if (!loop->started) {
+        return;
+    }
+
+    loop_lock(loop);
+    loop->stopping = 1;
+    pthread_cond_signal(&loop->cond);
+    lcbmt_lock_releasing(loop);
+    pthread_mutex_unlock(&loop->event_lock);
+
+    pthread_join(loop->iothread, NULL);
+    loop->started = 0;
+}
+
+static void loop_attach(lcbmt_ctx_t *mt)
+{
+    lcbmt_loop_t loop = mt->loop;
+
+    lcb_mt_lock(mt);
+    mt->loop_next = loop->contexts;
+    loop->contexts = mt;
+    lcb_mt_unlock(mt);
+}
+
+static void loop_detach(lcbmt_ctx_t *mt)
+{
+    lcbmt_loop_t loop = mt->loop;
+    lcbmt_ctx_t **pp;
+
+    lcb_mt_lock(mt);
+
+    /**
+     * The IO thread may be waiting for the instance (and be in a callback,
+     * waiting for the lock); let it finish before the context is gone
+     */
+    loop->detaching++;
+    while (loop->waiting == mt) {
+        lcbmt_lock_releasing(loop);
+        pthread_cond_wait(&loop->cond, &loop->event_lock);
+        lcbmt_lock_acquired(loop);
+    }
+    loop->detaching--;
+
+    for (pp = &loop->contexts; *pp; pp = &(*pp)->loop_next) {
+        if (*pp == mt) {
+            *pp = mt->loop_next;
+            break;
+        }
+    }
+    mt->loop_next = NULL;
+
+    /** The other instances keep running the IO options */
+    lcbmt_ctx_timer_cleanup(mt);
+    lcb_mt_unlock(mt);
+}
+
 LIBCOUCHBASE_API
 void lcb_mt_destroy(lcbmt_t mtp)
 {
-    lcbmt_cleanup_locks(mtp);
-
-    if (mtp->sock_lsn != -1) {
-        closesocket(mtp->sock_lsn);
+    if (mtp->loop) {
+        if (mtp->loop->shared) {
+            loop_detach(mtp);
+        } else {
+            lcbmt_loop_cleanup(mtp->loop);
+            lcbmt_ctx_timer_cleanup(mtp);
+        }
     }
 
-    if (mtp->sock_accepted != -1) {
-        closesocket(mtp->sock_accepted);
+    lcbmt_stats_cleanup(mtp);
+    lcbmt_batch_cleanup(mtp);
+    lcbmt_lf_cleanup(mtp);
+    lcbmt_keytab_cleanup(&mtp->flights);
+    lcbmt_keytab_cleanup(&mtp->combine);
+    lcbmt_callbacks_cleanup(mtp);
+    if (mtp->cache) {
+        lcbmt_cache_destroy(mtp->cache);
+    }
+    if (mtp->negfilter) {
+        lcbmt_negfilter_destroy(mtp->negfilter);
+    }
+    if (mtp->arena) {
+        lcbmt_arena_destroy(mtp->arena);
+    }
+    if (mtp->lanes) {
+        lcbmt_lanes_destroy(mtp->lanes);
     }
 
     free(mtp);
 }
 
-LIBCOUCHBASE_API
-lcb_error_t lcb_mt_init(lcbmt_t *mtpp, lcb_t instance, lcb_io_opt_t io)
+/**
+ * Allocate a context for the instance, without a loop
+ */
+static lcb_error_t ctx_create(lcbmt_t *mtpp, lcb_t instance, int flags)
 {
     *mtpp = calloc(1, sizeof(**mtpp));
     if (!*mtpp) {
         return LCB_CLIENT_ENOMEM;
     }
 
-    if (lcbmt_init_locks(*mtpp) != 0) {
+    if (lcbmt_keytab_init(&(*mtpp)->flights, 64) != 0 ||
+            lcbmt_keytab_init(&(*mtpp)->combine, 64) != 0) {
         lcb_mt_destroy(*mtpp);
-        return LCB_EINTERNAL;
+        return LCB_CLIENT_ENOMEM;
     }
+    lcbmt_wheel_init(&(*mtpp)->wheel, 0);
 
-    if (lcbmt_setup_socket(*mtpp) != 0) {
-        lcb_mt_destroy(*mtpp);
-        return LCB_EINTERNAL;
+    (*mtpp)->instance = instance;
+    (*mtpp)->inline_callbacks = (flags & LCBMT_INIT_INLINE_CALLBACKS) != 0;
+    return LCB_SUCCESS;
+}
+
+LIBCOUCHBASE_API
+lcb_error_t lcb_mt_init(lcbmt_t *mtpp, lcb_t instance, lcb_io_opt_t io)
+{
+    return lcb_mt_init_ex(mtpp, instance, io, 0);
+}
+
+LIBCOUCHBASE_API
+lcb_error_t lcb_mt_init_ex(lcbmt_t *mtpp,
+                           lcb_t instance,
+                           lcb_io_opt_t io,
+                           int flags)
+{
+    lcb_error_t err;
+
+    err = ctx_create(mtpp, instance, flags);
+    if (err != LCB_SUCCESS) {
+        return err;
     }
 
-    (*mtpp)->iops = io;
-    (*mtpp)->instance = instance;
+    err = lcbmt_loop_init(&(*mtpp)->loop, io);
+    if (err != LCB_SUCCESS) {
+        lcb_mt_destroy(*mtpp);
+        return err;
+    }
+    (*mtpp)->loop->contexts = *mtpp;
 
-    if (lcb_mt_io_start(*mtpp) != 0) {
+    if (flags & LCBMT_INIT_LEADER_FOLLOWER) {
+        if (lcbmt_lf_start(*mtpp) != 0) {
+            lcb_mt_destroy(*mtpp);
+            return LCB_EINTERNAL;
+        }
+    } else if (lcbmt_loop_start((*mtpp)->loop) != LCB_SUCCESS) {
         lcb_mt_destroy(*mtpp);
         return LCB_EINTERNAL;
     }
@@ -167,5 +389,45 @@ lcb_error_t lcb_mt_init(lcbmt_t *mtpp, lcb_t instance, lcb_io_opt_t io)
     lcbmt_wrap_callbacks(*mtpp, instance);
 
 
+    return LCB_SUCCESS;
+}
+
+LIBCOUCHBASE_API
+lcb_error_t lcb_mt_init_shared(lcbmt_t *mtpp,
+                               lcb_t instance,
+                               lcbmt_loop_t loop,
+                               int flags)
+{
+    lcb_error_t err;
+
+    /** The loop's IO thread is what runs the instance */
+    if (flags & LCBMT_INIT_LEADER_FOLLOWER) {
+        return LCB_EINVAL;
+    }
+
+    err = ctx_create(mtpp, instance, flags);
+    if (err != LCB_SUCCESS) {
+        return err;
+    }
+
+    (*mtpp)->loop = loop;
+    lcbmt_wrap_callbacks(*mtpp, instance);
+
+    /** Contexts may be attached from several threads at once */
+    pthread_mutex_lock(&loop->attach_lock);
+    if (!loop->started) {
+        loop->contexts = *mtpp;
+        if (lcbmt_loop_start(loop) != LCB_SUCCESS) {
+            loop->contexts = NULL;
+            pthread_mutex_unlock(&loop->attach_lock);
+            (*mtpp)->loop = NULL;
+            lcb_mt_destroy(*mtpp);
+            return LCB_EINTERNAL;
+        }
+    } else {
+        loop_attach(*mtpp);
+    }
+    pthread_mutex_unlock(&loop->attach_lock);
+
     return LCB_SUCCESS;
 }
@@ -0,0 +1,231 @@
+#include "mt_internal.h"
+
+/**
+ * Leader/follower mode. There is no IO thread; instead, one of the threads
+ * blocked in lcb_mt_token_wait() (the leader) runs the event loop. Responses
+ * for the leader's own token are delivered inline, without any handoff.
+ * Responses for other tokens are handed over to their waiting threads (the
+ * followers) as usual.
+ *
+ * Once the leader's token has no more responses outstanding, it stops the
+ * event loop and wakes up the followers, one of which takes over.
+ */
+
+static void stop_loop(lcbmt_ctx_t *mt)
+{
+    lcb_io_opt_t io = mt->loop->iops;
+
+    if (io->version == 0) {
+        io->v.v0.stop_event_loop(io);
+    } else {
+        io->v.v1.stop_event_loop(io);
+    }
+}
+
+static void lead(lcbmt_token_t token)
+{
+    lcbmt_ctx_t *mt = token->parent;
+    lcbmt_loop_t loop = mt->loop;
+
+    pthread_mutex_lock(&loop->event_lock);
+
+    /**
+     * If nothing was scheduled since the loop last ran, the token's
+     * operations may not have been scheduled yet (e.g. they are waiting
+     * in a batch). Don't spin.
+     */
+    if (!loop->scheduled) {
+        lcbmt_cond_timedwait(&loop->cond, &loop->event_lock, 1000);
+    }
+    loop->scheduled = 0;
+    lcbmt_lock_acquired(loop);
+
+    lcb_wait(mt->instance);
+    lcbmt_stats_update(mt);
+    lcbmt_lock_releasing(loop);
+    pthread_mutex_unlock(&loop->event_lock);
+}
+
+/**
+ * Give up the leadership and wake up all the followers. Those still
+ * waiting for responses will elect a new leader among themselves.
+ *
+ * A follower whose token is done may stop following at any time, and
+ * destroy its token; it goes through remove_follower() first, so the list
+ * is walked with 'lf_lock' held.
+ */
+static void abdicate(lcbmt_ctx_t *mt)
+{
+    lcbmt_token_t followers;
+
+    pthread_mutex_lock(&mt->lf_lock);
+    mt->lf_leader = NULL;
+    followers = mt->lf_followers;
+    mt->lf_followers = NULL;
+
+    while (followers) {
+        lcbmt_token_t next = followers->lf_next;
+        pthread_mutex_lock(&followers->mutex);
+        followers->lf_next = NULL;
+        followers->lf_wakeup = 1;
+        pthread_cond_broadcast(&followers->cond);
+        pthread_mutex_unlock(&followers->mutex);
+        followers = next;
+    }
+    pthread_mutex_unlock(&mt->lf_lock);
+}
+
+static void follow(lcbmt_token_t token)
+{
+    pthread_mutex_lock(&token->mutex);
+    while (!token->resp && !token->records && token->remaining &&
+            !token->lf_wakeup) {
+        pthread_cond_wait(&token->cond, &token->mutex);
+    }
+    token->lf_wakeup = 0;
+    pthread_mutex_unlock(&token->mutex);
+}
+
+static void remove_follower(lcbmt_ctx_t *mt, lcbmt_token_t token)
+{
+    lcbmt_token_t *pp;
+
+    pthread_mutex_lock(&mt->lf_lock);
+    for (pp = &mt->lf_followers; *pp; pp = &(*pp)->lf_next) {
+        if (*pp == token) {
+            *pp = token->lf_next;
+            token->lf_next = NULL;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&mt->lf_lock);
+}
+
+LCBMT_INTERNAL
+void lcbmt_lf_wait(lcbmt_token_t token, int pull)
+{
+    lcbmt_ctx_t *mt = token->parent;
+
+    while (1) {
+        int pending, outstanding;
+
+        pthread_mutex_lock(&token->mutex);
+        pending = token->resp || token->records;
+        outstanding = token->remaining;
+        if (pull && token->records && !token->resp) {
+            pthread_mutex_unlock(&token->mutex);
+            return;
+        }
+        pthread_mutex_unlock(&token->mutex);
+
+        if (pending) {
+            lcbmt_token_get_response(token);
+            continue;
+        }
+        if (!outstanding) {
+            return;
+        }
+
+        pthread_mutex_lock(&mt->lf_lock);
+        if (!mt->lf_leader) {
+            mt->lf_leader = token;
+            pthread_mutex_unlock(&mt->lf_lock);
+
+            lead(token);
+            abdicate(mt);
+            continue;
+        }
+
+        token->lf_next = mt->lf_followers;
+        mt->lf_followers = token;
+        pthread_mutex_unlock(&mt->lf_lock);
+
+        follow(token);
+        remove_follower(mt, token);
+    }
+}
+
+LCBMT_INTERNAL
+int lcbmt_lf_deliver(lcbmt_token_t token, unsigned int decrcount)
+{
+    lcbmt_ctx_t *mt = token->parent;
+    void (*target)(void);
+    lcbmt_resptype_t type;
+    const void *cookie;
+    lcb_error_t err;
+    lcb_storage_t storop;
+    const void *resp;
+    int done;
+
+    /** Only the leader itself runs callbacks, so this is race free */
+    if (mt->lf_leader != token) {
+        return 0;
+    }
+
+    target = token->next_callback;
+    type = token->resptype;
+    cookie = token->rcookie;
+    err = token->err;
+    storop = token->u_cb_special.storop;
+    resp = token->resp;
+
+    token->remaining -= decrcount;
+    done = token->remaining == 0;
+    token->resp = NULL;
+    token->next_callback = NULL;
+    token->handoff = 0;
+    pthread_mutex_unlock(&token->mutex);
+
+    /**
+     * The event lock is held throughout; operations scheduled by the
+     * callback take the recursive path of lcb_mt_lock() and are sent by
+     * the event loop we're in.
+     */
+    lcbmt_token_dispatch(token, cookie, type, target, err, storop, resp);
+
+    if (done) {
+        /**
+         * Other operations may still be in progress; make sure the next
+         * leader does not wait for something to be scheduled first.
+         */
+        mt->loop->scheduled = 1;
+        stop_loop(mt);
+    }
+    return 1;
+}
+
+LCBMT_INTERNAL
+void lcbmt_lf_yield(lcbmt_ctx_t *mt, lcbmt_token_t token)
+{
+    /** The token may already have been destroyed; only compare it */
+    if (mt->lf_leader == token) {
+        mt->loop->scheduled = 1;
+        stop_loop(mt);
+    }
+}
+
+LCBMT_INTERNAL
+int lcbmt_lf_start(lcbmt_ctx_t *mt)
+{
+    if (pthread_mutex_init(&mt->lf_lock, NULL) != 0) {
+        return -1;
+    }
+    mt->leader_follower = 1;
+
+    /**
+     * The connection is accepted by the kernel before accept() is called,
+     * so both sides may be set up from the calling thread.
+     */
+    if (lcbmt_negotiate_client(mt->loop) != 0) {
+        return -1;
+    }
+    return lcbmt_negotiate_server(mt->loop);
+}
+
+LCBMT_INTERNAL
+void lcbmt_lf_cleanup(lcbmt_ctx_t *mt)
+{
+    if (mt->leader_follower) {
+        pthread_mutex_destroy(&mt->lf_lock);
+    }
+}
@@ -0,0 +1,70 @@
+#include "mt_internal.h"
+
+/**
+ * Event loops. Each context runs its instance through a loop, which holds
+ * the event lock and the IO thread. A loop created with
+ * lcb_mt_loop_create() is shared by the contexts attached to it with
+ * lcb_mt_init_shared(): their instances share its IO options, and a single
+ * thread (and wakeup socket) serves all of them.
+ */
+
+LCBMT_INTERNAL
+lcb_error_t lcbmt_loop_init(lcbmt_loop_t *loopp, lcb_io_opt_t io)
+{
+    lcbmt_loop_t loop = calloc(1, sizeof(*loop));
+
+    if (!loop) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    loop->sock_lsn = -1;
+    loop->sock_accepted = -1;
+    loop->iops = io;
+
+    if (lcbmt_init_locks(loop) != 0) {
+        free(loop);
+        return LCB_EINTERNAL;
+    }
+
+    if (lcbmt_setup_socket(loop) != 0) {
+        lcbmt_loop_cleanup(loop);
+        return LCB_EINTERNAL;
+    }
+
+    *loopp = loop;
+    return LCB_SUCCESS;
+}
+
+LCBMT_INTERNAL
+void lcbmt_loop_cleanup(lcbmt_loop_t loop)
+{
+    lcbmt_loop_stop(loop);
+    lcbmt_release_client(loop);
+    lcbmt_cleanup_locks(loop);
+
+    if (loop->sock_lsn != -1) {
+        closesocket(loop->sock_lsn);
+    }
+
+    if (loop->sock_accepted != -1) {
+        closesocket(loop->sock_accepted);
+    }
+
+    free(loop);
+}
+
+LIBCOUCHBASE_API
+lcb_error_t lcb_mt_loop_create(lcbmt_loop_t *loop, lcb_io_opt_t io)
+{
+    lcb_error_t err = lcbmt_loop_init(loop, io);
+
+    if (err == LCB_SUCCESS) {
+        (*loop)->shared = 1;
+    }
+    return err;
+}
+
+LIBCOUCHBASE_API
+void lcb_mt_loop_destroy(lcbmt_loop_t loop)
+{
+    lcbmt_loop_cleanup(loop);
+}
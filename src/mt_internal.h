@@ -2,6 +2,7 @@
 #ifndef LCB_MT_INTERNAL_H
 #define LCB_MT_INTERNAL_H
 #include <libcouchbase/lcbmt.h>
+#include <libcouchbase/lcbmt_stats.h>
 
 #include "platform_internal.h"
 #include <sys/socket.h>
@@ -10,17 +11,29 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stddef.h>
+#include <assert.h>
 
 #define LCBMT_INTERNAL
 
-typedef void (*lcbmt_thrfunc)(lcbmt_ctx_t *);
+typedef void (*lcbmt_thrfunc)(lcbmt_loop_t);
 
 
 LCBMT_INTERNAL
-int lcbmt_init_locks(lcbmt_ctx_t *);
+int lcbmt_init_locks(lcbmt_loop_t);
 
 LCBMT_INTERNAL
-void lcbmt_cleanup_locks(lcbmt_ctx_t *);
+void lcbmt_cleanup_locks(lcbmt_loop_t);
+
+/**
+ * Must be called right after acquiring, and right before releasing, the
+ * event lock, to keep track of its owner
+ */
+LCBMT_INTERNAL
+void lcbmt_lock_acquired(lcbmt_loop_t loop);
+
+LCBMT_INTERNAL
+void lcbmt_lock_releasing(lcbmt_loop_t loop);
 
 
 typedef enum {
@@ -49,45 +62,904 @@ LCBMT_INTERNAL
 void lcbmt_release_lock(lcbmt_ctx_t *proxy, lcbmt_lock_target target);
 
 LCBMT_INTERNAL
-int lcbmt_start_iops_thread(lcbmt_ctx_t *, lcbmt_thrfunc);
+int lcbmt_start_iops_thread(lcbmt_loop_t, lcbmt_thrfunc);
 
 LCBMT_INTERNAL
-int lcbmt_blocking_connect(lcbmt_ctx_t *);
+int lcbmt_blocking_connect(lcbmt_loop_t);
 
 LCBMT_INTERNAL
-int lcbmt_set_server_nonblocking(lcbmt_ctx_t *mt);
+int lcbmt_set_server_nonblocking(lcbmt_loop_t loop);
 
-int lcbmt_notify(lcbmt_ctx_t *proxy);
+int lcbmt_notify(lcbmt_loop_t loop);
 
 LCBMT_INTERNAL
 void lcbmt_wrap_callbacks(lcbmt_ctx_t *mt, lcb_t instance);
 
+LCBMT_INTERNAL
+void lcbmt_callbacks_cleanup(lcbmt_ctx_t *mt);
+
 /**
  * Sets up the listening socket. The listening socket is established
  * from outside the IO thread (i.e. it is established from the calling thread);
  * because the connection from the IOPS thread must be made by one of the
  * internal connect routines.
  */
-int lcbmt_setup_socket(lcbmt_ctx_t *);
+int lcbmt_setup_socket(lcbmt_loop_t);
 
 /**
  * Call this from the IOPS thread. Waits until the socket is connected
  */
-int lcbmt_negotiate_client(lcbmt_ctx_t *proxy);
+int lcbmt_negotiate_client(lcbmt_loop_t loop);
 
 /**
  * Call this from the main thread. Waits until accept returns with the
  * incoming connection made from the IOPS thread
  */
-int lcbmt_negotiate_server(lcbmt_ctx_t *proxy);
+int lcbmt_negotiate_server(lcbmt_loop_t loop);
 
 /**
  * This is called from the IO routines.
  */
-void lcbmt_internal_callback(lcbmt_ctx_t *);
+void lcbmt_internal_callback(lcbmt_loop_t);
 
-struct lcbmt_ctx_st {
-    LCBMT_CTX_FIELDS
+/**
+ * Set up a loop for the given IO options, without starting its IO thread
+ */
+LCBMT_INTERNAL
+lcb_error_t lcbmt_loop_init(lcbmt_loop_t *loop, lcb_io_opt_t io);
+
+/**
+ * Start the IO thread of the loop (see lcbmt_loop_init())
+ */
+LCBMT_INTERNAL
+lcb_error_t lcbmt_loop_start(lcbmt_loop_t loop);
+
+/**
+ * Make the IO thread of the loop (if running) exit, and wait for it
+ */
+LCBMT_INTERNAL
+void lcbmt_loop_stop(lcbmt_loop_t loop);
+
+/**
+ * Stop the IO thread of the loop (if running) and free it
+ */
+LCBMT_INTERNAL
+void lcbmt_loop_cleanup(lcbmt_loop_t loop);
+
+/**
+ * Called from the IO thread before it exits, to stop listening on the
+ * socket used to wake it up
+ */
+LCBMT_INTERNAL
+void lcbmt_release_client(lcbmt_loop_t loop);
+
+/**
+ * Identifies what a cookie passed to libcouchbase refers to. Every structure
+ * which is used as a cookie starts with one of these.
+ */
+typedef enum {
+    /** A token passed directly by the user */
+    LCBMT_COOKIE_TOKEN = 0,
+
+    /** An operation scheduled via one of the lcb_mt_* scheduling functions */
+    LCBMT_COOKIE_OP,
+
+    /** The replica read hedging a GET operation */
+    LCBMT_COOKIE_HEDGE
+} lcbmt_cookie_type;
+
+#define LCBMT_COOKIE_TYPE(cookie) (*(const lcbmt_cookie_type *)(cookie))
+
+/**
+ * Entry in a key table. This is embedded into the structure being indexed
+ */
+typedef struct lcbmt_keyent_st {
+    struct lcbmt_keyent_st *next;
+    lcb_uint32_t hash;
+    lcb_size_t nkey;
+    const void *key;
+} lcbmt_keyent_t;
+
+typedef struct {
+    lcbmt_keyent_t **buckets;
+    lcb_size_t nbuckets;
+    lcb_size_t count;
+} lcbmt_keytab_t;
+
+LCBMT_INTERNAL
+lcb_uint32_t lcbmt_hash_key(const void *key, lcb_size_t nkey);
+
+LCBMT_INTERNAL
+int lcbmt_keytab_init(lcbmt_keytab_t *tab, lcb_size_t nbuckets);
+
+LCBMT_INTERNAL
+void lcbmt_keytab_cleanup(lcbmt_keytab_t *tab);
+
+LCBMT_INTERNAL
+lcbmt_keyent_t *lcbmt_keytab_find(lcbmt_keytab_t *tab,
+                                  const void *key,
+                                  lcb_size_t nkey,
+                                  lcb_uint32_t hash);
+
+/** The caller must have set the key and hash fields of the entry */
+LCBMT_INTERNAL
+void lcbmt_keytab_insert(lcbmt_keytab_t *tab, lcbmt_keyent_t *ent);
+
+LCBMT_INTERNAL
+void lcbmt_keytab_remove(lcbmt_keytab_t *tab, lcbmt_keyent_t *ent);
+
+/** Timer wheel: tick length (in microseconds) and slots per level */
+#define LCBMT_WHEEL_TICK 1000
+#define LCBMT_WHEEL_L0 256
+#define LCBMT_WHEEL_L1 64
+
+/**
+ * An entry in a timer wheel. 'next' is NULL while it is not linked into
+ * one; expired entries are returned chained through 'next'. 'expire' is
+ * invoked for entries of the context's wheel once they are due.
+ */
+typedef struct lcbmt_tnode_st {
+    struct lcbmt_tnode_st *next;
+    struct lcbmt_tnode_st *prev;
+    lcb_uint64_t expiry;
+    void (*expire)(struct lcbmt_tnode_st *node);
+} lcbmt_tnode_t;
+
+typedef struct {
+    lcbmt_tnode_t l0[LCBMT_WHEEL_L0];
+    lcbmt_tnode_t l1[LCBMT_WHEEL_L1];
+
+    /** Last tick processed, and how many entries are linked */
+    lcb_uint64_t now;
+    unsigned int count;
+} lcbmt_wheel_t;
+
+LCBMT_INTERNAL
+void lcbmt_wheel_init(lcbmt_wheel_t *wheel, lcb_uint64_t now);
+
+/** Link an entry, due at the absolute tick 'expiry' */
+LCBMT_INTERNAL
+void lcbmt_wheel_add(lcbmt_wheel_t *wheel,
+                     lcbmt_tnode_t *node,
+                     lcb_uint64_t expiry);
+
+/** Unlink an entry, if it is linked */
+LCBMT_INTERNAL
+void lcbmt_wheel_remove(lcbmt_wheel_t *wheel, lcbmt_tnode_t *node);
+
+/**
+ * Link 'copy', a copy of the entry 'node', in place of it (if it is
+ * linked). 'node' is left unlinked.
+ */
+LCBMT_INTERNAL
+void lcbmt_wheel_replace(lcbmt_tnode_t *node, lcbmt_tnode_t *copy);
+
+/**
+ * Process the ticks up to 'now', returning the entries which are due
+ */
+LCBMT_INTERNAL
+lcbmt_tnode_t *lcbmt_wheel_advance(lcbmt_wheel_t *wheel, lcb_uint64_t now);
+
+/** Current time, in wheel ticks */
+#define LCBMT_WHEEL_NOW() (lcbmt_now_usec() / LCBMT_WHEEL_TICK)
+
+/** The tick at which a delay (in microseconds) from now has elapsed */
+#define LCBMT_WHEEL_AFTER(usec) \
+    ((lcbmt_now_usec() + (usec) + LCBMT_WHEEL_TICK - 1) / LCBMT_WHEEL_TICK)
+
+typedef enum {
+    LCBMT_OP_GET = 0,
+    LCBMT_OP_ARITHMETIC,
+    LCBMT_OP_STORE
+} lcbmt_opcode;
+
+/**
+ * A token waiting for the result of an operation. The first waiter is
+ * embedded in the operation itself.
+ */
+typedef struct lcbmt_waiter_st {
+    struct lcbmt_waiter_st *next;
+    lcbmt_token_t token;
+
+    /** Cookie of the token when the operation was scheduled */
+    const void *ucookie;
+
+    /** For combined arithmetic operations, the delta requested */
+    lcb_int64_t delta;
+
+    /**
+     * Timeout of the waiter, and the operation it is waiting on. 'tnode'
+     * links the waiter into the context's timer wheel (its expiry being
+     * set up when the operation is created). A timed out waiter has
+     * already been given LCB_ETIMEDOUT, and is skipped once the response
+     * arrives.
+     */
+    lcbmt_tnode_t tnode;
+    struct lcbmt_op_st *op;
+    int timed_out;
+} lcbmt_waiter_t;
+
+/**
+ * An operation scheduled through the MT layer. This contains a copy of the
+ * command (so that it may be issued after the scheduling function returns)
+ * and is passed as the cookie to libcouchbase.
+ */
+typedef struct lcbmt_op_st {
+    lcbmt_cookie_type cookie_type;
+    lcbmt_opcode opcode;
+    lcbmt_ctx_t *parent;
+
+    /** Next operation in a batch, before the operation is issued */
+    struct lcbmt_op_st *next;
+
+    /**
+     * Key of the operation. Linked into the flight table (or for arithmetic
+     * and store operations, the combine table) if shared
+     */
+    lcbmt_keyent_t kent;
+    int shared;
+
+    /**
+     * First of the operations held back behind this one (chained through
+     * their own 'pending'), to be scheduled once it completes
+     */
+    struct lcbmt_op_st *pending;
+
+    const void *hashkey;
+    lcb_size_t nhashkey;
+
+    lcbmt_waiter_t waiters;
+    lcbmt_waiter_t *last_waiter;
+
+    /**
+     * Retry state, from the policy in effect when the operation was
+     * created. 'backoff' is the delay (before jitter) of the next retry and
+     * 'deadline' an absolute time, or 0
+     */
+    struct {
+        unsigned int attempts;
+        unsigned int max_attempts;
+        int waiting;
+        lcb_uint32_t backoff;
+        lcb_uint32_t max_backoff;
+        lcb_uint64_t deadline;
+    } retry;
+
+    /**
+     * Set once each of the waiters has timed out. The operation is then
+     * only kept until libcouchbase is done with it.
+     */
+    int timed_out;
+
+    /**
+     * Lane of the operation, and whether it has been admitted (i.e. counts
+     * against the context's limit of operations in flight)
+     */
+    lcb_mt_priority_t priority;
+    int admitted;
+
+    /** When the operation was created, if load shedding is enabled */
+    lcb_uint64_t created;
+
+    /**
+     * Hedging, for GETs. 'hnode' is due when the replica read is to be
+     * issued, with 'hedge_cookie' as its cookie. 'legs' is how many
+     * commands (or retry timers) hold the operation, once it is hedged;
+     * 'answered' is set once the waiters have been given a response, so
+     * that the losing response is discarded.
+     */
+    lcbmt_tnode_t hnode;
+    lcbmt_cookie_type hedge_cookie;
+    unsigned int legs;
+    int answered;
+    lcb_uint64_t issued;
+
+    union {
+        struct {
+            lcb_time_t exptime;
+            int lock;
+
+            /** Cache epoch at the time the GET was scheduled */
+            lcb_uint32_t epoch;
+
+            /** Negative filter epoch at the time the GET was scheduled */
+            lcb_uint32_t nepoch;
+        } get;
+
+        struct {
+            lcb_time_t exptime;
+            int create;
+            lcb_uint64_t initial;
+            int combinable;
+
+            /** Sum of the deltas of all the waiters */
+            lcb_int64_t delta;
+        } arithmetic;
+
+        struct {
+            /** Copy of the value, owned by the operation */
+            char *bytes;
+            lcb_size_t nbytes;
+            lcb_uint32_t flags;
+            lcb_cas_t cas;
+            lcb_datatype_t datatype;
+            lcb_time_t exptime;
+            lcb_storage_t operation;
+            int coalescable;
+        } store;
+    } u;
+
+    /** Key and hashkey are stored here */
+    char kbuf[1];
+} lcbmt_op_t;
+
+#define LCBMT_OP_FROM_KENT(ent) \
+    ((lcbmt_op_t *)((char *)(ent) - offsetof(lcbmt_op_t, kent)))
+
+#define LCBMT_OP_FROM_HEDGE(cookie) \
+    ((lcbmt_op_t *)((char *)(cookie) - offsetof(lcbmt_op_t, hedge_cookie)))
+
+LCBMT_INTERNAL
+lcbmt_op_t *lcbmt_op_create(lcbmt_ctx_t *mt,
+                            lcbmt_opcode opcode,
+                            lcbmt_token_t token,
+                            const void *key, lcb_size_t nkey,
+                            const void *hashkey, lcb_size_t nhashkey);
+
+LCBMT_INTERNAL
+void lcbmt_op_destroy(lcbmt_op_t *op);
+
+/**
+ * Set up the retry state of a new operation, from the token's policy
+ */
+LCBMT_INTERNAL
+void lcbmt_retry_init(lcbmt_op_t *op, lcbmt_token_t token);
+
+/**
+ * Called with the error of a response for the operation, before anything
+ * else is done with it. If the operation is to be retried, arranges for it
+ * to be sent again later and returns nonzero; the response must then be
+ * ignored.
+ */
+LCBMT_INTERNAL
+int lcbmt_op_retry(lcbmt_op_t *op, lcb_error_t err);
+
+/**
+ * Set up the timeout of a new operation's waiter, from the token's (or
+ * context's) timeout
+ */
+LCBMT_INTERNAL
+void lcbmt_timeout_init(lcbmt_op_t *op, lcbmt_token_t token);
+
+/**
+ * Start the timeout of an operation being scheduled. Must be called with
+ * the event lock held
+ */
+LCBMT_INTERNAL
+void lcbmt_timeout_start(lcbmt_op_t *op);
+
+/**
+ * Stop the timeouts of each of the operation's waiters, once they are
+ * about to be given the response. Must be called with the event lock held
+ */
+LCBMT_INTERNAL
+void lcbmt_timeout_stop(lcbmt_op_t *op);
+
+/**
+ * Link an entry into the context's timer wheel, starting the timer driving
+ * it if needed. Returns nonzero if the timer could not be started (and the
+ * entry will never expire). Must be called with the event lock held, as
+ * must lcbmt_ctx_timer_remove()
+ */
+LCBMT_INTERNAL
+int lcbmt_ctx_timer_add(lcbmt_ctx_t *mt,
+                        lcbmt_tnode_t *node,
+                        lcb_uint64_t expiry);
+
+LCBMT_INTERNAL
+void lcbmt_ctx_timer_remove(lcbmt_ctx_t *mt, lcbmt_tnode_t *node);
+
+/**
+ * Destroy the timer driving the context's wheel, and the batching timer, if
+ * running. The wheel must be empty, and the event lock held (or the
+ * instance not run).
+ */
+LCBMT_INTERNAL
+void lcbmt_ctx_timer_cleanup(lcbmt_ctx_t *mt);
+
+/**
+ * Arm the hedge of a GET which has just been issued, if hedging is enabled
+ * and the GET may be served by a replica. Must be called with the event
+ * lock held
+ */
+LCBMT_INTERNAL
+void lcbmt_hedge_start(lcbmt_op_t *op);
+
+/**
+ * Called with each response for a hedged GET, before anything else is done
+ * with it. Returns nonzero if the response is to be ignored: it lost
+ * the race (in which case the operation may have been destroyed), or it
+ * failed while the other read may still succeed.
+ */
+LCBMT_INTERNAL
+int lcbmt_hedge_filter(lcbmt_op_t *op, int replica, lcb_error_t err);
+
+/**
+ * Called once the waiters of a hedged GET have been given a response.
+ * Returns nonzero if the operation must be kept for the other response.
+ */
+LCBMT_INTERNAL
+int lcbmt_hedge_answered(lcbmt_op_t *op);
+
+/**
+ * Report an error to each of the waiters of an operation which have not
+ * timed out, without destroying it
+ */
+LCBMT_INTERNAL
+void lcbmt_op_report(lcbmt_op_t *op, lcb_error_t err);
+
+/**
+ * Report an error to a single waiter of an operation
+ */
+LCBMT_INTERNAL
+void lcbmt_op_report_waiter(lcbmt_op_t *op,
+                            lcbmt_waiter_t *w,
+                            lcb_error_t err);
+
+/**
+ * Moves the waiters of the operation 'from' (typically one which has been
+ * merged into this one, and is about to be destroyed) over to the end of
+ * the operation's list. Returns nonzero on allocation failure, in which
+ * case nothing is moved.
+ */
+LCBMT_INTERNAL
+int lcbmt_op_merge_waiters(lcbmt_op_t *op, lcbmt_op_t *from);
+
+/**
+ * Passes the operation to libcouchbase. Must be called with the event lock
+ * held
+ */
+LCBMT_INTERNAL
+lcb_error_t lcbmt_op_issue(lcbmt_op_t *op);
+
+/**
+ * Issues the operation, or attaches its token to an equivalent operation
+ * already in flight (in which case the operation is destroyed). On failure
+ * the operation is left to the caller, which must fail or destroy it. Must
+ * be called with the event lock held
+ */
+LCBMT_INTERNAL
+lcb_error_t lcbmt_op_schedule(lcbmt_op_t *op);
+
+/**
+ * Like lcbmt_op_schedule(), for an operation which has been admitted by the
+ * priority lanes (or if they are not enabled)
+ */
+LCBMT_INTERNAL
+lcb_error_t lcbmt_op_dispatch(lcbmt_op_t *op);
+
+/**
+ * Completes an operation which could not be scheduled, delivering the error
+ * to each of its waiters, and destroys it.
+ */
+LCBMT_INTERNAL
+void lcbmt_op_fail(lcbmt_op_t *op, lcb_error_t err);
+
+/**
+ * A list of operations waiting to be scheduled together
+ */
+typedef struct {
+    lcbmt_op_t *head;
+    lcbmt_op_t *tail;
+    unsigned int count;
+} lcbmt_batch_t;
+
+LCBMT_INTERNAL
+void lcbmt_batch_append(lcbmt_batch_t *batch, lcbmt_op_t *op);
+
+typedef struct lcbmt_lanes_st lcbmt_lanes_t;
+
+/**
+ * Called for each operation being scheduled. If the limit of operations in
+ * flight has been reached, queues the operation in its lane and returns
+ * nonzero. Otherwise the operation is admitted, and is to be dispatched by
+ * the caller. Must be called with the event lock held
+ */
+LCBMT_INTERNAL
+int lcbmt_lanes_hold(lcbmt_op_t *op);
+
+/**
+ * Called as an admitted operation is destroyed. Dispatches queued
+ * operations in its place
+ */
+LCBMT_INTERNAL
+void lcbmt_lanes_release(lcbmt_op_t *op);
+
+LCBMT_INTERNAL
+void lcbmt_lanes_destroy(lcbmt_lanes_t *lanes);
+
+/**
+ * Record how long an operation waited before being dispatched. Must be
+ * called with the event lock held
+ */
+LCBMT_INTERNAL
+void lcbmt_shed_sample(lcbmt_op_t *op);
+
+/**
+ * Whether operations scheduled on the token are to be rejected with
+ * LCB_MT_EOVERLOAD. Called without the event lock
+ */
+LCBMT_INTERNAL
+int lcbmt_shed_reject(lcbmt_token_t token);
+
+/**
+ * Hands the operations in the batch over to the context's batching window.
+ * They are scheduled (by the thread running the event loop) once the window
+ * expires, or at once if enough operations have accumulated. Never waits
+ * for the window.
+ */
+LCBMT_INTERNAL
+void lcbmt_batch_submit(lcbmt_ctx_t *mt, lcbmt_batch_t *batch);
+
+LCBMT_INTERNAL
+void lcbmt_batch_cleanup(lcbmt_ctx_t *mt);
+
+/**
+ * Called by the callback wrappers once the response for an operation has
+ * arrived, before it is delivered to the waiters. This makes the operation
+ * private to the caller, and schedules the operations held back behind it.
+ */
+LCBMT_INTERNAL
+void lcbmt_op_complete(lcbmt_op_t *op);
+
+/**
+ * Invalidates any state held for a key which has been modified: the cached
+ * value or negative filter entry (if any), and any in-flight GET which
+ * could otherwise be joined by GETs scheduled after the modification. This
+ * is called when a modification is scheduled through the scheduling API,
+ * and again once the response for any modification arrives. Must be
+ * called with the event lock held.
+ */
+LCBMT_INTERNAL
+void lcbmt_invalidate_key(lcbmt_ctx_t *mt, const void *key, lcb_size_t nkey);
+
+/**
+ * Installed callback table. Tables replaced by lcb_mt_set_callbacks() are
+ * kept until the context is destroyed, as other threads may still be
+ * reading them.
+ */
+typedef struct lcbmt_cbtable_st {
+    struct lcb_mt_callback_table tbl;
+    struct lcbmt_cbtable_st *next;
+} lcbmt_cbtable_t;
+
+typedef struct lcbmt_arena_st lcbmt_arena_t;
+
+LCBMT_INTERNAL
+lcbmt_arena_t *lcbmt_arena_create(lcb_size_t max_bytes);
+
+LCBMT_INTERNAL
+void lcbmt_arena_destroy(lcbmt_arena_t *arena);
+
+LCBMT_INTERNAL
+void *lcbmt_arena_alloc(lcbmt_arena_t *arena, lcb_size_t size);
+
+/**
+ * Releases a buffer returned by lcbmt_arena_alloc(). 'size' must be the size
+ * it was allocated with.
+ */
+LCBMT_INTERNAL
+void lcbmt_arena_free(lcbmt_arena_t *arena, void *ptr, lcb_size_t size);
+
+/**
+ * A self-contained copy of a response, which is delivered to the token
+ * without involving the IO thread.
+ */
+typedef struct lcbmt_record_st {
+    struct lcbmt_record_st *next;
+
+    /** Where the record was allocated from (NULL if from malloc) */
+    lcbmt_arena_t *arena;
+    lcb_size_t size;
+
+    /** Set when the record is handed to an executor */
+    lcbmt_token_t token;
+
+    /** Set when the record is queued to its token */
+    const void *ucookie;
+    void (*callback)(void);
+
+    lcbmt_resptype_t type;
+    lcb_error_t err;
+    lcb_storage_t storop;
+    union {
+        lcb_get_resp_t get;
+        lcb_arithmetic_resp_t arithmetic;
+        lcb_store_resp_t store;
+        lcb_remove_resp_t remove;
+        lcb_touch_resp_t touch;
+        lcb_unlock_resp_t unlock;
+    } resp;
+
+    /** Buffers referenced by the response */
+    char buf[1];
+} lcbmt_record_t;
+
+LCBMT_INTERNAL
+lcbmt_record_t *lcbmt_record_create(lcbmt_ctx_t *mt, lcb_size_t nbuf);
+
+LCBMT_INTERNAL
+void lcbmt_record_destroy(lcbmt_record_t *rec);
+
+LCBMT_INTERNAL
+lcbmt_record_t *lcbmt_record_get(lcbmt_ctx_t *mt,
+                                 lcb_error_t err,
+                                 const void *key, lcb_size_t nkey,
+                                 const void *bytes, lcb_size_t nbytes,
+                                 lcb_uint32_t flags, lcb_cas_t cas);
+
+LCBMT_INTERNAL
+lcbmt_record_t *lcbmt_record_arithmetic(lcbmt_ctx_t *mt,
+                                        lcb_error_t err,
+                                        const void *key, lcb_size_t nkey,
+                                        lcb_uint64_t value, lcb_cas_t cas);
+
+LCBMT_INTERNAL
+lcbmt_record_t *lcbmt_record_store(lcbmt_ctx_t *mt,
+                                   lcb_error_t err,
+                                   lcb_storage_t storop,
+                                   const void *key, lcb_size_t nkey,
+                                   lcb_cas_t cas);
+
+/**
+ * Copy a response of the given type. Returns NULL if out of memory or if the
+ * response type can't be copied.
+ */
+LCBMT_INTERNAL
+lcbmt_record_t *lcbmt_record_copy(lcbmt_ctx_t *mt,
+                                  lcbmt_resptype_t type,
+                                  lcb_error_t err,
+                                  lcb_storage_t storop,
+                                  const void *resp);
+
+LCBMT_INTERNAL
+void lcbmt_record_export(lcbmt_record_t *rec, struct lcb_mt_response *out);
+
+/**
+ * The callbacks for a response arriving for the token now. A table, once
+ * published, is never modified or freed while the context exists, so it may
+ * be read without any synchronization.
+ */
+#define LCBMT_TOKEN_CALLBACKS(tok) \
+    ((tok)->callbacks ? (tok)->callbacks : (tok)->parent->callbacks)
+
+/**
+ * Returns the callback for a record of the given type in the table
+ */
+LCBMT_INTERNAL
+void (*lcbmt_callback_for(const struct lcb_mt_callback_table *tbl,
+                          lcbmt_resptype_t type))(void);
+
+/**
+ * Hand a record (with its user cookie set) to the context's executor. This
+ * counts as one of the token's responses once the callback has been invoked.
+ */
+LCBMT_INTERNAL
+void lcbmt_exec_submit(lcbmt_token_t token, lcbmt_record_t *rec);
+
+/**
+ * Invoke the user's callback for a response. 'target' is the callback
+ * resolved when the response arrived (see LCBMT_TOKEN_CALLBACKS), and is
+ * invoked according to 'type'; responses without one are discarded. Must
+ * be called without the token mutex held
+ */
+LCBMT_INTERNAL
+void lcbmt_token_dispatch(lcbmt_token_t token,
+                          const void *cookie,
+                          lcbmt_resptype_t type,
+                          void (*target)(void),
+                          lcb_error_t err,
+                          lcb_storage_t storop,
+                          const void *resp);
+
+/**
+ * Wait for the next response for the token (or for its count to drain)
+ * and dispatch it. Returns nonzero if more responses are outstanding.
+ */
+LCBMT_INTERNAL
+int lcbmt_token_get_response(lcbmt_token_t token);
+
+/**
+ * Set up the context for leader/follower mode (i.e. without an IO thread)
+ */
+LCBMT_INTERNAL
+int lcbmt_lf_start(lcbmt_ctx_t *mt);
+
+LCBMT_INTERNAL
+void lcbmt_lf_cleanup(lcbmt_ctx_t *mt);
+
+/**
+ * lcb_mt_token_wait() for leader/follower mode. If 'pull' is set, returns as
+ * soon as records are queued on the token rather than dispatching them.
+ */
+LCBMT_INTERNAL
+void lcbmt_lf_wait(lcbmt_token_t token, int pull);
+
+/**
+ * Called when a record has been queued for the token. If the token belongs
+ * to the leader, the event loop is stopped so that it may consume it.
+ */
+LCBMT_INTERNAL
+void lcbmt_lf_yield(lcbmt_ctx_t *mt, lcbmt_token_t token);
+
+/**
+ * Called by the callback wrappers with the token locked and the response
+ * assigned. If the token belongs to the leader, the response is dispatched
+ * right away, the token is unlocked and nonzero is returned.
+ */
+LCBMT_INTERNAL
+int lcbmt_lf_deliver(lcbmt_token_t token, unsigned int decrcount);
+
+/**
+ * A condition shared by several tokens, for lcb_mt_token_wait_any() and
+ * lcb_mt_token_wait_all()
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int signalled;
+} lcbmt_waitset_t;
+
+/**
+ * Wake up whoever waits for the token. Must be called with the token mutex
+ * held.
+ */
+LCBMT_INTERNAL
+void lcbmt_token_signal(lcbmt_token_t token);
+
+/**
+ * Queue a record for delivery to the token, with the given user cookie.
+ * This counts as one of the token's responses. If 'rec' is NULL (i.e. the
+ * record could not be allocated), the response is only counted.
+ */
+LCBMT_INTERNAL
+void lcbmt_token_push(lcbmt_token_t token,
+                      const void *cookie,
+                      lcbmt_record_t *rec);
+
+typedef struct lcbmt_cache_st lcbmt_cache_t;
+
+/** 'ttl' is in milliseconds */
+LCBMT_INTERNAL
+lcbmt_cache_t *lcbmt_cache_create(lcb_size_t max_bytes, lcb_uint32_t ttl);
+
+LCBMT_INTERNAL
+void lcbmt_cache_destroy(lcbmt_cache_t *cache);
+
+/**
+ * Returns the current epoch for the key's shard. This should be saved when
+ * a GET is scheduled and passed to lcbmt_cache_store()
+ */
+LCBMT_INTERNAL
+lcb_uint32_t lcbmt_cache_epoch(lcbmt_cache_t *cache, lcb_uint32_t hash);
+
+/**
+ * Looks up a key in the cache. Returns a new GET record on a hit
+ */
+LCBMT_INTERNAL
+lcbmt_record_t *lcbmt_cache_lookup(lcbmt_ctx_t *mt,
+                                   const void *key, lcb_size_t nkey);
+
+LCBMT_INTERNAL
+void lcbmt_cache_store(lcbmt_cache_t *cache,
+                       lcb_uint32_t epoch,
+                       lcb_time_t exptime,
+                       const lcb_get_resp_t *resp);
+
+LCBMT_INTERNAL
+void lcbmt_cache_invalidate(lcbmt_cache_t *cache,
+                            const void *key, lcb_size_t nkey,
+                            lcb_uint32_t hash);
+
+typedef struct lcbmt_negfilter_st lcbmt_negfilter_t;
+
+LCBMT_INTERNAL
+lcbmt_negfilter_t *lcbmt_negfilter_create(lcb_size_t ncounters,
+                                          lcb_uint32_t window);
+
+LCBMT_INTERNAL
+void lcbmt_negfilter_destroy(lcbmt_negfilter_t *filter);
+
+/**
+ * Returns the current epoch for the key. This should be saved when a GET is
+ * scheduled and passed to lcbmt_negfilter_add()
+ */
+LCBMT_INTERNAL
+lcb_uint32_t lcbmt_negfilter_epoch(lcbmt_negfilter_t *filter,
+                                   lcb_uint32_t hash);
+
+/**
+ * Returns true if the key is (probably) known not to exist
+ */
+LCBMT_INTERNAL
+int lcbmt_negfilter_contains(lcbmt_negfilter_t *filter,
+                             const void *key, lcb_size_t nkey,
+                             lcb_uint32_t hash);
+
+LCBMT_INTERNAL
+void lcbmt_negfilter_add(lcbmt_negfilter_t *filter,
+                         lcb_uint32_t epoch,
+                         const void *key, lcb_size_t nkey,
+                         lcb_uint32_t hash);
+
+LCBMT_INTERNAL
+void lcbmt_negfilter_remove(lcbmt_negfilter_t *filter,
+                            const void *key, lcb_size_t nkey,
+                            lcb_uint32_t hash);
+
+/**
+ * Returns a monotonic timestamp, in microseconds
+ */
+LCBMT_INTERNAL
+lcb_uint64_t lcbmt_now_usec(void);
+
+/**
+ * Waits on the condition for at most 'usec' microseconds. Returns 0 if
+ * signalled, nonzero on timeout
+ */
+LCBMT_INTERNAL
+int lcbmt_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                         lcb_uint64_t usec);
+
+/**
+ * Create (or truncate) a named shared memory segment of the given size and
+ * map it into memory. Returns NULL on failure.
+ */
+LCBMT_INTERNAL
+void *lcbmt_shm_create(const char *name, lcb_size_t size);
+
+/**
+ * Unmap and remove a segment created with lcbmt_shm_create()
+ */
+LCBMT_INTERNAL
+void lcbmt_shm_destroy(const char *name, void *addr, lcb_size_t size);
+
+/**
+ * Record a latency sample (in microseconds) into the histogram
+ */
+LCBMT_INTERNAL
+void lcbmt_hist_record(struct lcb_mt_stats_histogram *hist,
+                       lcb_uint64_t usec);
+
+/**
+ * Refresh the shared statistics page (if any), unless it was refreshed
+ * less than a millisecond ago. Must be called with the event lock held, as
+ * this is what serializes the writers of the page.
+ */
+LCBMT_INTERNAL
+void lcbmt_stats_update(lcbmt_ctx_t *mt);
+
+/**
+ * lcbmt_stats_update() for each of the loop's contexts. Returns nonzero if
+ * any of them publishes a page.
+ */
+LCBMT_INTERNAL
+int lcbmt_stats_update_loop(lcbmt_loop_t loop);
+
+/** How often (in microseconds) an idle IO thread refreshes the pages */
+#define LCBMT_STATS_PERIOD 100000
+
+LCBMT_INTERNAL
+void lcbmt_stats_cleanup(lcbmt_ctx_t *mt);
+
+/**
+ * The event loop of one or more contexts: the IO options, the event lock
+ * serializing their use, and the IO thread running them along with the
+ * socket used to wake it up. A context created with lcb_mt_init() has a
+ * loop of its own; contexts created with lcb_mt_init_shared() share one.
+ */
+struct lcbmt_loop_st {
+    LCBMT_LOOP_FIELDS
 
     lcb_socket_t sock_lsn;
     lcb_socket_t sock_accepted;
@@ -105,34 +977,195 @@ struct lcbmt_ctx_st {
         } ev;
     } loopsock;
 
-    /** Whether we're entered into the loop */
-    int entered;
+    /**
+     * Whether operations may have been scheduled since the IO thread last
+     * ran the event loop. This guards against the IO thread missing the
+     * signal because it was not yet waiting on the condition.
+     */
+    int scheduled;
 
-    /** Whether a byte has been sent to the socket */
-    int signalled;
+    /**
+     * Whether 'lock_owner' holds the event lock, and how many times it has
+     * locked it again through lcb_mt_lock() (e.g. from callbacks invoked
+     * while holding it). Only the owner modifies these.
+     */
+    volatile int lock_owned;
+    unsigned int lock_depth;
 
     /** How many waiters */
     unsigned int volatile waiters;
 
     struct sockaddr_in saddr;
     struct lcb_io_opt_st *iops;
+
+    /**
+     * Contexts whose instances the IO thread runs, chained through
+     * 'loop_next'. Only modified with the event lock held, or (for the
+     * first context, before the IO thread is started) the attach lock.
+     */
+    lcbmt_ctx_t *contexts;
+
+    /**
+     * Context whose instance the IO thread is waiting for, and how many
+     * threads are waiting for it to be done with theirs (see
+     * lcb_mt_destroy())
+     */
+    lcbmt_ctx_t *waiting;
+    unsigned int detaching;
+
+    /**
+     * Set (with the event lock held) to make the IO thread exit. 'started'
+     * is checked and set by lcb_mt_init_shared() with the attach lock held,
+     * so that only one context starts the IO thread.
+     */
+    int stopping;
+    int started;
+
+    /** Whether the loop was created by lcb_mt_loop_create() */
+    int shared;
+
+    /** Statistics */
+    unsigned long enter_count;
+    unsigned long max_queue;
+};
+
+struct lcbmt_ctx_st {
+    lcbmt_loop_t loop;
+    lcbmt_ctx_t *loop_next;
+
+    /**
+     * Leader/follower mode. The leader is the token whose waiter is running
+     * the event loop; followers are tokens whose waiters may take over.
+     */
+    int leader_follower;
+    pthread_mutex_t lf_lock;
+    lcbmt_token_t lf_leader;
+    lcbmt_token_t lf_followers;
+
+    /** Invoke the callbacks of all tokens from the IO thread */
+    int inline_callbacks;
+
     lcb_t instance;
 
-    /** Callbacks */
-    struct lcb_mt_callback_table callbacks;
+    /**
+     * Callbacks. 'callbacks' is the current table, replaced as a whole by
+     * lcb_mt_set_callbacks(); all tables ever set are kept in 'cbtables'
+     * until the context is destroyed.
+     */
+    const struct lcb_mt_callback_table *volatile callbacks;
+    lcbmt_cbtable_t *cbtables;
 
     /** Statistics */
     unsigned long notify_count;
-    unsigned long enter_count;
     unsigned long fast_count;
-    unsigned long max_queue;
 
+    /** Shared statistics page, if published, and when it was refreshed */
+    struct lcb_mt_stats_page *stats_page;
+    char *stats_name;
+    lcb_uint64_t stats_updated;
+    struct lcb_mt_stats_histogram lock_wait;
+    struct lcb_mt_stats_histogram handoff;
+
+    /** GET operations which may be joined by other GETs for the same key */
+    lcbmt_keytab_t flights;
+    unsigned long flight_joins;
+
+    /**
+     * Arithmetic operations and (with coalescing enabled) stores in
+     * flight; later operations for the same key are held back behind them
+     */
+    lcbmt_keytab_t combine;
+    unsigned long arithmetic_combined;
+    int coalesce_stores;
+    unsigned long stores_coalesced;
+
+    /** Retry policy for new operations, and the state of the jitter PRNG */
+    struct lcb_mt_retry_policy retry;
+    lcb_uint32_t retry_seed;
+    unsigned long retries;
+
+    /**
+     * Operation timeouts. The waiters of scheduled operations with a
+     * timeout are linked into 'wheel', which is advanced by 'wheel_timer'
+     * while it is not empty.
+     */
+    lcb_uint32_t op_timeout;
+    lcbmt_wheel_t wheel;
+    lcb_timer_t wheel_timer;
+    unsigned long timeouts;
+
+    /** Priority lanes, if enabled */
+    lcbmt_lanes_t *lanes;
+    unsigned long lane_holds;
+
+    /**
+     * Load shedding, if 'shed_target' is set. 'shed_above' is when the
+     * waiting time was first seen above the target (or 0), and
+     * 'shed_sampled' the time of the latest sample. 'shedding' is only
+     * written with the event lock held; 'ops_shed' is counted by the
+     * scheduling threads, without it (and read for the statistics page
+     * with it)
+     */
+    lcb_uint32_t shed_target;
+    lcb_uint32_t shed_interval;
+    lcb_uint64_t shed_above;
+    volatile lcb_uint64_t shed_sampled;
+    volatile int shedding;
+    unsigned long ops_shed;
+
+    /**
+     * Hedged GETs, if 'hedge_percentile' is set. 'hedge_latency' holds
+     * recent GET latencies (decayed by halving), from which 'hedge_delay'
+     * is periodically derived
+     */
+    double hedge_percentile;
+    lcb_uint32_t hedge_min;
+    lcb_uint32_t hedge_max;
+    lcb_uint32_t hedge_delay;
+    struct lcb_mt_stats_histogram hedge_latency;
+    unsigned long hedges;
+    unsigned long hedge_wins;
+
+    /** Near cache, if enabled */
+    lcbmt_cache_t *cache;
+    unsigned long cache_hits;
+    unsigned long cache_misses;
+
+    /** Filter of keys recently found not to exist, if enabled */
+    lcbmt_negfilter_t *negfilter;
+    unsigned long negative_hits;
+
+    /**
+     * Arena for records, if responses are copied. Copied responses are
+     * queued to their tokens without waiting for the consumer.
+     */
+    lcbmt_arena_t *arena;
+    unsigned long responses_copied;
+
+    /**
+     * Batching window, if enabled. Operations accumulate in 'batch' until
+     * 'batch_timer' (armed by the thread which submitted the first of them)
+     * fires, or until 'batch_max' operations are pending. 'batch_armed' is
+     * protected by the batch lock, 'batch_timer' by the event lock.
+     */
+    lcb_uint32_t batch_window;
+    unsigned int batch_max;
+    pthread_mutex_t batch_lock;
+    lcbmt_batch_t batch;
+    int batch_armed;
+    lcb_timer_t batch_timer;
+    unsigned long batch_flushes;
+    unsigned long batch_ops;
+
+    /** Executor invoking the callbacks, if any */
+    lcb_mt_submit_fn exec_submit;
+    void *exec_arg;
 };
 
 struct lcbmt_token_st {
+    lcbmt_cookie_type cookie_type;
     LCBMT_TOKEN_FIELDS
 
-
     /** Actual cookie passed */
     const void *ucookie;
     lcbmt_ctx_t *parent;
@@ -142,6 +1175,38 @@ struct lcbmt_token_st {
     lcb_error_t err;
     const void *resp;
     void (*next_callback)(void);
+    lcbmt_resptype_t resptype;
+    const void *rcookie;
+
+    /** Set while the IO thread is handing a response over */
+    int handoff;
+
+    /** Signalled along with 'cond', while waited on with other tokens */
+    lcbmt_waitset_t *waitset;
+
+    /** LCBMT_TOKEN_* flags */
+    int flags;
+
+    /** Callbacks overriding the context's, if any */
+    struct lcb_mt_callback_table *callbacks;
+
+    /** Retry policy overriding the context's, if 'has_retry' is set */
+    struct lcb_mt_retry_policy retry;
+    int has_retry;
+
+    /** Operation timeout overriding the context's, or 0 */
+    lcb_uint32_t op_timeout;
+
+    /** Lane of the operations scheduled on the token */
+    lcb_mt_priority_t priority;
+
+    /** Leader/follower mode: list of followers, and wakeup flag */
+    lcbmt_token_t lf_next;
+    int lf_wakeup;
+
+    /** Responses delivered without the IO thread */
+    lcbmt_record_t *records;
+    lcbmt_record_t *last_record;
 
     /** Special arguments for individual callbacks */
     union {
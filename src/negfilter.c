@@ -0,0 +1,217 @@
+#include "mt_internal.h"
+
+/**
+ * Negative lookup filter. This is a counting Bloom filter of keys which
+ * recently returned LCB_KEY_ENOENT, used to answer GETs for those keys
+ * without going to the network.
+ *
+ * To bound staleness the filter is split into two generations. New keys are
+ * added to the current generation, which is retired (becoming the previous
+ * generation) after half the window has elapsed, replacing the previous one.
+ * A generation older than the window is ignored by lookups, so a key is
+ * never reported missing for longer than the window after being added.
+ *
+ * All modifications take place with the event lock held. Lookups are done
+ * without any lock: a lookup racing with a modification may miss a key
+ * which was just added, which is harmless.
+ *
+ * As with the near cache, any modification of a key bumps an epoch (one of
+ * several, selected by the key's hash) and a miss is only added if the
+ * epoch did not change since the GET was scheduled.
+ */
+
+#define NEG_NHASHES 4
+#define NEG_NSTRIPES 64
+#define NEG_COUNTER_MAX 255
+
+struct lcbmt_negfilter_st {
+    lcb_size_t ncounters;
+    lcb_uint64_t window;
+    volatile unsigned int cur;
+    volatile lcb_uint64_t started[2];
+    volatile lcb_uint32_t epochs[NEG_NSTRIPES];
+    unsigned char *counters[2];
+};
+
+/**
+ * Compute the counter positions for the key. The positions are derived
+ * from two independent hashes (Kirsch-Mitzenmacher double hashing)
+ */
+static void get_positions(lcbmt_negfilter_t *filter,
+                          const void *key, lcb_size_t nkey,
+                          lcb_uint32_t hash,
+                          lcb_size_t *positions)
+{
+    const unsigned char *p = key;
+    lcb_uint32_t hash2 = 5381;
+    lcb_size_t ii;
+
+    for (ii = 0; ii < nkey; ii++) {
+        hash2 = (hash2 * 33) ^ p[ii];
+    }
+    hash2 |= 1;
+
+    for (ii = 0; ii < NEG_NHASHES; ii++) {
+        positions[ii] = (hash + ii * hash2) % filter->ncounters;
+    }
+}
+
+static int gen_contains(const unsigned char *counters,
+                        const lcb_size_t *positions)
+{
+    int ii;
+    for (ii = 0; ii < NEG_NHASHES; ii++) {
+        if (!counters[positions[ii]]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void maybe_rotate(lcbmt_negfilter_t *filter, lcb_uint64_t now)
+{
+    unsigned int next;
+
+    if (now - filter->started[filter->cur] < filter->window / 2) {
+        return;
+    }
+
+    next = !filter->cur;
+    memset(filter->counters[next], 0, filter->ncounters);
+    filter->started[next] = now;
+    lcbmt_barrier();
+    filter->cur = next;
+}
+
+LCBMT_INTERNAL
+lcbmt_negfilter_t *lcbmt_negfilter_create(lcb_size_t ncounters,
+                                          lcb_uint32_t window)
+{
+    lcbmt_negfilter_t *filter = calloc(1, sizeof(*filter));
+    if (!filter) {
+        return NULL;
+    }
+
+    filter->ncounters = ncounters;
+    filter->window = window;
+    filter->counters[0] = calloc(ncounters, 1);
+    filter->counters[1] = calloc(ncounters, 1);
+    if (!filter->counters[0] || !filter->counters[1]) {
+        lcbmt_negfilter_destroy(filter);
+        return NULL;
+    }
+
+    filter->started[0] = filter->started[1] = lcbmt_now_usec();
+    return filter;
+}
+
+LCBMT_INTERNAL
+void lcbmt_negfilter_destroy(lcbmt_negfilter_t *filter)
+{
+    free(filter->counters[0]);
+    free(filter->counters[1]);
+    free(filter);
+}
+
+LCBMT_INTERNAL
+lcb_uint32_t lcbmt_negfilter_epoch(lcbmt_negfilter_t *filter,
+                                   lcb_uint32_t hash)
+{
+    return filter->epochs[hash % NEG_NSTRIPES];
+}
+
+LCBMT_INTERNAL
+int lcbmt_negfilter_contains(lcbmt_negfilter_t *filter,
+                             const void *key, lcb_size_t nkey,
+                             lcb_uint32_t hash)
+{
+    lcb_size_t positions[NEG_NHASHES];
+    lcb_uint64_t now = lcbmt_now_usec();
+    unsigned int ii;
+
+    get_positions(filter, key, nkey, hash, positions);
+
+    for (ii = 0; ii < 2; ii++) {
+        if (now - filter->started[ii] >= filter->window) {
+            continue;
+        }
+        if (gen_contains(filter->counters[ii], positions)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+LCBMT_INTERNAL
+void lcbmt_negfilter_add(lcbmt_negfilter_t *filter,
+                         lcb_uint32_t epoch,
+                         const void *key, lcb_size_t nkey,
+                         lcb_uint32_t hash)
+{
+    lcb_size_t positions[NEG_NHASHES];
+    unsigned char *counters;
+    int ii;
+
+    if (filter->epochs[hash % NEG_NSTRIPES] != epoch) {
+        return;
+    }
+
+    maybe_rotate(filter, lcbmt_now_usec());
+    counters = filter->counters[filter->cur];
+
+    get_positions(filter, key, nkey, hash, positions);
+    if (gen_contains(counters, positions)) {
+        /** Already there. Adding it again would require two removals */
+        return;
+    }
+
+    for (ii = 0; ii < NEG_NHASHES; ii++) {
+        if (counters[positions[ii]] < NEG_COUNTER_MAX) {
+            counters[positions[ii]]++;
+        }
+    }
+}
+
+LCBMT_INTERNAL
+void lcbmt_negfilter_remove(lcbmt_negfilter_t *filter,
+                            const void *key, lcb_size_t nkey,
+                            lcb_uint32_t hash)
+{
+    lcb_size_t positions[NEG_NHASHES];
+    unsigned int ii;
+    int jj;
+
+    filter->epochs[hash % NEG_NSTRIPES]++;
+    get_positions(filter, key, nkey, hash, positions);
+
+    for (ii = 0; ii < 2; ii++) {
+        unsigned char *counters = filter->counters[ii];
+        if (!gen_contains(counters, positions)) {
+            continue;
+        }
+
+        /** Saturated counters can no longer be decremented reliably */
+        for (jj = 0; jj < NEG_NHASHES; jj++) {
+            if (counters[positions[jj]] < NEG_COUNTER_MAX) {
+                counters[positions[jj]]--;
+            }
+        }
+    }
+    lcbmt_barrier();
+}
+
+LIBCOUCHBASE_API
+lcb_error_t lcb_mt_enable_negative_filter(lcbmt_t mt,
+                                          lcb_size_t ncounters,
+                                          lcb_uint32_t window)
+{
+    if (mt->negfilter || ncounters == 0 || window == 0) {
+        return LCB_EINVAL;
+    }
+
+    mt->negfilter = lcbmt_negfilter_create(ncounters, window);
+    if (!mt->negfilter) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    return LCB_SUCCESS;
+}
@@ -0,0 +1,803 @@
+#include "mt_internal.h"
+
+/**
+ * Operations scheduled through the MT layer (i.e. lcb_mt_get() rather than
+ * lcb_get()). Each command is copied into an lcbmt_op_t, which is then used
+ * as the cookie for libcouchbase. Because the layer knows about every such
+ * operation it can share a single network operation between several tokens.
+ */
+
+LCBMT_INTERNAL
+lcbmt_op_t *lcbmt_op_create(lcbmt_ctx_t *mt,
+                            lcbmt_opcode opcode,
+                            lcbmt_token_t token,
+                            const void *key, lcb_size_t nkey,
+                            const void *hashkey, lcb_size_t nhashkey)
+{
+    lcbmt_op_t *op = calloc(1, sizeof(*op) + nkey + nhashkey);
+    if (!op) {
+        return NULL;
+    }
+
+    op->cookie_type = LCBMT_COOKIE_OP;
+    op->opcode = opcode;
+    op->parent = mt;
+
+    memcpy(op->kbuf, key, nkey);
+    op->kent.key = op->kbuf;
+    op->kent.nkey = nkey;
+    op->kent.hash = lcbmt_hash_key(key, nkey);
+
+    if (nhashkey) {
+        memcpy(op->kbuf + nkey, hashkey, nhashkey);
+        op->hashkey = op->kbuf + nkey;
+        op->nhashkey = nhashkey;
+    }
+
+    op->waiters.token = token;
+    op->waiters.ucookie = token->ucookie;
+    op->waiters.op = op;
+    op->last_waiter = &op->waiters;
+    lcbmt_retry_init(op, token);
+    lcbmt_timeout_init(op, token);
+    op->priority = token->priority;
+    if (mt->shed_target) {
+        op->created = lcbmt_now_usec();
+    }
+    return op;
+}
+
+LCBMT_INTERNAL
+void lcbmt_op_destroy(lcbmt_op_t *op)
+{
+    lcbmt_waiter_t *w = op->waiters.next;
+
+    lcbmt_timeout_stop(op);
+    lcbmt_ctx_timer_remove(op->parent, &op->hnode);
+    while (w) {
+        lcbmt_waiter_t *next = w->next;
+        free(w);
+        w = next;
+    }
+    if (op->opcode == LCBMT_OP_STORE) {
+        free(op->u.store.bytes);
+    }
+    if (op->admitted) {
+        lcbmt_lanes_release(op);
+    }
+    free(op);
+}
+
+LCBMT_INTERNAL
+int lcbmt_op_merge_waiters(lcbmt_op_t *op, lcbmt_op_t *from)
+{
+    lcbmt_waiter_t *w = calloc(1, sizeof(*w));
+    if (!w) {
+        return -1;
+    }
+
+    /** Only the embedded waiter is copied; the others are moved over */
+    *w = from->waiters;
+    lcbmt_wheel_replace(&from->waiters.tnode, &w->tnode);
+    op->last_waiter->next = w;
+    op->last_waiter = w->next ? from->last_waiter : w;
+    from->waiters.next = NULL;
+    from->last_waiter = &from->waiters;
+
+    for (; w; w = w->next) {
+        w->op = op;
+    }
+    return 0;
+}
+
+LCBMT_INTERNAL
+lcb_error_t lcbmt_op_issue(lcbmt_op_t *op)
+{
+    lcb_t instance = op->parent->instance;
+
+    switch (op->opcode) {
+    case LCBMT_OP_GET: {
+        lcb_get_cmd_t cmd;
+        const lcb_get_cmd_t *cmdp = &cmd;
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.v.v0.key = op->kent.key;
+        cmd.v.v0.nkey = op->kent.nkey;
+        cmd.v.v0.hashkey = op->hashkey;
+        cmd.v.v0.nhashkey = op->nhashkey;
+        cmd.v.v0.exptime = op->u.get.exptime;
+        cmd.v.v0.lock = op->u.get.lock;
+        return lcb_get(instance, op, 1, &cmdp);
+    }
+
+    case LCBMT_OP_ARITHMETIC: {
+        lcb_arithmetic_cmd_t cmd;
+        const lcb_arithmetic_cmd_t *cmdp = &cmd;
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.v.v0.key = op->kent.key;
+        cmd.v.v0.nkey = op->kent.nkey;
+        cmd.v.v0.hashkey = op->hashkey;
+        cmd.v.v0.nhashkey = op->nhashkey;
+        cmd.v.v0.exptime = op->u.arithmetic.exptime;
+        cmd.v.v0.create = op->u.arithmetic.create;
+        cmd.v.v0.initial = op->u.arithmetic.initial;
+        cmd.v.v0.delta = op->u.arithmetic.delta;
+        return lcb_arithmetic(instance, op, 1, &cmdp);
+    }
+
+    case LCBMT_OP_STORE: {
+        lcb_store_cmd_t cmd;
+        const lcb_store_cmd_t *cmdp = &cmd;
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.v.v0.key = op->kent.key;
+        cmd.v.v0.nkey = op->kent.nkey;
+        cmd.v.v0.hashkey = op->hashkey;
+        cmd.v.v0.nhashkey = op->nhashkey;
+        cmd.v.v0.bytes = op->u.store.bytes;
+        cmd.v.v0.nbytes = op->u.store.nbytes;
+        cmd.v.v0.flags = op->u.store.flags;
+        cmd.v.v0.cas = op->u.store.cas;
+        cmd.v.v0.datatype = op->u.store.datatype;
+        cmd.v.v0.exptime = op->u.store.exptime;
+        cmd.v.v0.operation = op->u.store.operation;
+        return lcb_store(instance, op, 1, &cmdp);
+    }
+
+    default:
+        abort();
+    }
+    return LCB_EINTERNAL;
+}
+
+static lcbmt_keytab_t *op_table(lcbmt_op_t *op)
+{
+    if (op->opcode == LCBMT_OP_GET) {
+        return &op->parent->flights;
+    }
+    return &op->parent->combine;
+}
+
+static lcb_error_t route_op(lcbmt_op_t *op);
+
+LCBMT_INTERNAL
+void lcbmt_op_complete(lcbmt_op_t *op)
+{
+    lcbmt_op_t *held = op->pending;
+
+    if (op->shared) {
+        lcbmt_keytab_remove(op_table(op), &op->kent);
+        op->shared = 0;
+    }
+    op->pending = NULL;
+
+    /**
+     * The operations held back behind this one are scheduled again, in
+     * order: the first is issued, and each of the others is issued or held
+     * back behind the ones before it as if it had just been scheduled.
+     */
+    while (held) {
+        lcbmt_op_t *next = held->pending;
+        lcb_error_t err;
+
+        held->pending = NULL;
+        if (held->timed_out) {
+            lcbmt_op_destroy(held);
+        } else if ((err = route_op(held)) != LCB_SUCCESS) {
+            lcbmt_op_fail(held, err);
+        }
+        held = next;
+    }
+}
+
+LCBMT_INTERNAL
+void lcbmt_invalidate_key(lcbmt_ctx_t *mt, const void *key, lcb_size_t nkey)
+{
+    lcb_uint32_t hash = lcbmt_hash_key(key, nkey);
+    lcbmt_keyent_t *ent = lcbmt_keytab_find(&mt->flights, key, nkey, hash);
+
+    if (ent) {
+        lcbmt_op_complete(LCBMT_OP_FROM_KENT(ent));
+    }
+
+    if (mt->cache) {
+        lcbmt_cache_invalidate(mt->cache, key, nkey, hash);
+    }
+
+    if (mt->negfilter) {
+        lcbmt_negfilter_remove(mt->negfilter, key, nkey, hash);
+    }
+}
+
+/**
+ * Whether a GET may be shared with other GETs for the same key. Locking
+ * and touching GETs have side effects and are always sent on their own
+ */
+static int get_is_shareable(const lcb_get_cmd_t *cmd)
+{
+    return cmd->v.v0.exptime == 0 &&
+           cmd->v.v0.lock == 0 &&
+           cmd->v.v0.nhashkey == 0;
+}
+
+static int get_op_is_shareable(const lcbmt_op_t *op)
+{
+    return op->u.get.exptime == 0 &&
+           op->u.get.lock == 0 &&
+           op->nhashkey == 0;
+}
+
+/**
+ * Whether an arithmetic operation may be combined with others for the same
+ * key. Decrements stop at zero, so only increments may be summed up, and
+ * creating the item (or setting its expiry) is only done by lone operations
+ */
+static int arithmetic_is_combinable(const lcb_arithmetic_cmd_t *cmd)
+{
+    return cmd->v.v0.delta >= 0 &&
+           cmd->v.v0.create == 0 &&
+           cmd->v.v0.exptime == 0 &&
+           cmd->v.v0.nhashkey == 0;
+}
+
+/**
+ * Whether a store may be superseded by a later store for the same key.
+ * Only unconditional SETs may: for the others, whether the store succeeds
+ * depends on the stores before it.
+ */
+static int store_is_coalescable(const lcb_store_cmd_t *cmd)
+{
+    return cmd->v.v0.operation == LCB_SET &&
+           cmd->v.v0.cas == 0 &&
+           cmd->v.v0.nhashkey == 0;
+}
+
+static lcbmt_op_t *create_get(lcbmt_ctx_t *mt,
+                              lcbmt_token_t token,
+                              const lcb_get_cmd_t *cmd)
+{
+    lcbmt_op_t *op = lcbmt_op_create(mt, LCBMT_OP_GET, token,
+                                     cmd->v.v0.key, cmd->v.v0.nkey,
+                                     cmd->v.v0.hashkey, cmd->v.v0.nhashkey);
+    if (!op) {
+        return NULL;
+    }
+    op->u.get.exptime = cmd->v.v0.exptime;
+    op->u.get.lock = cmd->v.v0.lock;
+    return op;
+}
+
+static lcbmt_op_t *create_arithmetic(lcbmt_ctx_t *mt,
+                                     lcbmt_token_t token,
+                                     const lcb_arithmetic_cmd_t *cmd)
+{
+    lcbmt_op_t *op = lcbmt_op_create(mt, LCBMT_OP_ARITHMETIC, token,
+                                     cmd->v.v0.key, cmd->v.v0.nkey,
+                                     cmd->v.v0.hashkey, cmd->v.v0.nhashkey);
+    if (!op) {
+        return NULL;
+    }
+    op->u.arithmetic.exptime = cmd->v.v0.exptime;
+    op->u.arithmetic.create = cmd->v.v0.create;
+    op->u.arithmetic.initial = cmd->v.v0.initial;
+    op->u.arithmetic.delta = cmd->v.v0.delta;
+    op->u.arithmetic.combinable = arithmetic_is_combinable(cmd);
+    op->waiters.delta = cmd->v.v0.delta;
+    return op;
+}
+
+static lcbmt_op_t *create_store(lcbmt_ctx_t *mt,
+                                lcbmt_token_t token,
+                                const lcb_store_cmd_t *cmd)
+{
+    lcbmt_op_t *op = lcbmt_op_create(mt, LCBMT_OP_STORE, token,
+                                     cmd->v.v0.key, cmd->v.v0.nkey,
+                                     cmd->v.v0.hashkey, cmd->v.v0.nhashkey);
+    if (!op) {
+        return NULL;
+    }
+
+    op->u.store.bytes = malloc(cmd->v.v0.nbytes ? cmd->v.v0.nbytes : 1);
+    if (!op->u.store.bytes) {
+        lcbmt_op_destroy(op);
+        return NULL;
+    }
+    memcpy(op->u.store.bytes, cmd->v.v0.bytes, cmd->v.v0.nbytes);
+    op->u.store.nbytes = cmd->v.v0.nbytes;
+    op->u.store.flags = cmd->v.v0.flags;
+    op->u.store.cas = cmd->v.v0.cas;
+    op->u.store.datatype = cmd->v.v0.datatype;
+    op->u.store.exptime = cmd->v.v0.exptime;
+    op->u.store.operation = cmd->v.v0.operation;
+    op->u.store.coalescable = mt->coalesce_stores &&
+                              store_is_coalescable(cmd);
+    return op;
+}
+
+/**
+ * Returns the last operation held back behind a shared operation (or the
+ * operation itself, if none are)
+ */
+static lcbmt_op_t *last_held(lcbmt_op_t *op)
+{
+    while (op->pending) {
+        op = op->pending;
+    }
+    return op;
+}
+
+/**
+ * A GET for a key with arithmetic operations or stores still in progress
+ * is held back behind them, so that it sees their effect. Plain GETs held
+ * back one after the other share a single operation.
+ */
+static lcb_error_t schedule_get(lcbmt_op_t *op)
+{
+    lcbmt_ctx_t *mt = op->parent;
+    lcbmt_keyent_t *ent;
+    lcb_error_t err;
+    int shareable = get_op_is_shareable(op);
+
+    ent = lcbmt_keytab_find(&mt->combine,
+                            op->kent.key, op->kent.nkey, op->kent.hash);
+    if (ent) {
+        lcbmt_op_t *last = last_held(LCBMT_OP_FROM_KENT(ent));
+
+        if (last->shared || last->opcode != LCBMT_OP_GET ||
+                !shareable || !get_op_is_shareable(last) || last->timed_out) {
+            last->pending = op;
+            return LCB_SUCCESS;
+        }
+
+        if (lcbmt_op_merge_waiters(last, op) != 0) {
+            return LCB_CLIENT_ENOMEM;
+        }
+        mt->flight_joins++;
+        lcbmt_op_destroy(op);
+        return LCB_SUCCESS;
+    }
+
+    if (shareable) {
+        ent = lcbmt_keytab_find(&mt->flights,
+                                op->kent.key, op->kent.nkey, op->kent.hash);
+        if (ent) {
+            if (lcbmt_op_merge_waiters(LCBMT_OP_FROM_KENT(ent), op) != 0) {
+                return LCB_CLIENT_ENOMEM;
+            }
+            mt->flight_joins++;
+            lcbmt_op_destroy(op);
+            return LCB_SUCCESS;
+        }
+    }
+
+    if (mt->cache) {
+        op->u.get.epoch = lcbmt_cache_epoch(mt->cache, op->kent.hash);
+    }
+    if (mt->negfilter) {
+        op->u.get.nepoch = lcbmt_negfilter_epoch(mt->negfilter,
+                                                 op->kent.hash);
+    }
+
+    err = lcbmt_op_issue(op);
+    if (err != LCB_SUCCESS) {
+        return err;
+    }
+
+    if (shareable) {
+        lcbmt_keytab_insert(&mt->flights, &op->kent);
+        op->shared = 1;
+        if (mt->hedge_percentile) {
+            lcbmt_hedge_start(op);
+        }
+    }
+    return LCB_SUCCESS;
+}
+
+/** Largest sum of deltas a combined increment may carry */
+#define ARITHMETIC_MAX_DELTA ((lcb_int64_t)(~(lcb_uint64_t)0 >> 1))
+
+/**
+ * Arithmetic operations are sent one at a time per key. While one is in
+ * flight, any further ones are held back behind it, and are sent in order
+ * once its response arrives. Combinable increments held back one after the
+ * other are summed up into a single operation.
+ */
+static lcb_error_t schedule_arithmetic(lcbmt_op_t *op)
+{
+    lcbmt_ctx_t *mt = op->parent;
+    lcbmt_keyent_t *ent;
+    lcb_error_t err;
+
+    ent = lcbmt_keytab_find(&mt->combine,
+                            op->kent.key, op->kent.nkey, op->kent.hash);
+    if (ent) {
+        lcbmt_op_t *last = last_held(LCBMT_OP_FROM_KENT(ent));
+
+        /** A timed out operation is followed rather than joined */
+        if (last->shared || last->opcode != LCBMT_OP_ARITHMETIC ||
+                !last->u.arithmetic.combinable ||
+                !op->u.arithmetic.combinable || last->timed_out ||
+                last->u.arithmetic.delta >
+                ARITHMETIC_MAX_DELTA - op->u.arithmetic.delta) {
+            last->pending = op;
+            return LCB_SUCCESS;
+        }
+
+        if (lcbmt_op_merge_waiters(last, op) != 0) {
+            return LCB_CLIENT_ENOMEM;
+        }
+        last->u.arithmetic.delta += op->u.arithmetic.delta;
+        mt->arithmetic_combined++;
+        lcbmt_op_destroy(op);
+        return LCB_SUCCESS;
+    }
+
+    err = lcbmt_op_issue(op);
+    if (err != LCB_SUCCESS) {
+        return err;
+    }
+    lcbmt_keytab_insert(&mt->combine, &op->kent);
+    op->shared = 1;
+    return LCB_SUCCESS;
+}
+
+/**
+ * Stores are held back behind arithmetic operations or stores for the same
+ * key still in progress, and sent in order. With coalescing enabled each
+ * store sent is itself waited for in this way, and a coalescable store held
+ * back right after another one replaces that store's value. The tokens of
+ * the replaced stores wait for the response of the store which is
+ * eventually sent.
+ */
+static lcb_error_t schedule_store(lcbmt_op_t *op)
+{
+    lcbmt_ctx_t *mt = op->parent;
+    lcbmt_keyent_t *ent;
+    lcb_error_t err;
+
+    ent = lcbmt_keytab_find(&mt->combine,
+                            op->kent.key, op->kent.nkey, op->kent.hash);
+    if (ent) {
+        lcbmt_op_t *last = last_held(LCBMT_OP_FROM_KENT(ent));
+
+        /** A timed out pending store is followed rather than replaced */
+        if (last->shared || last->opcode != LCBMT_OP_STORE ||
+                !last->u.store.coalescable || !op->u.store.coalescable ||
+                last->timed_out) {
+            last->pending = op;
+            return LCB_SUCCESS;
+        }
+
+        if (lcbmt_op_merge_waiters(last, op) != 0) {
+            return LCB_CLIENT_ENOMEM;
+        }
+
+        free(last->u.store.bytes);
+        last->u.store = op->u.store;
+        op->u.store.bytes = NULL;
+        mt->stores_coalesced++;
+        lcbmt_op_destroy(op);
+        return LCB_SUCCESS;
+    }
+
+    err = lcbmt_op_issue(op);
+    if (err != LCB_SUCCESS || !mt->coalesce_stores) {
+        return err;
+    }
+    lcbmt_keytab_insert(&mt->combine, &op->kent);
+    op->shared = 1;
+    return LCB_SUCCESS;
+}
+
+LCBMT_INTERNAL
+lcb_error_t lcbmt_op_schedule(lcbmt_op_t *op)
+{
+    lcbmt_timeout_start(op);
+
+    /**
+     * GETs scheduled from now on must see the modification, even while it
+     * is held back: they may no longer join a GET already in flight, nor
+     * be answered from what was known about the key before.
+     */
+    if (op->opcode != LCBMT_OP_GET) {
+        lcbmt_invalidate_key(op->parent, op->kent.key, op->kent.nkey);
+    }
+
+    if (op->parent->lanes && lcbmt_lanes_hold(op)) {
+        return LCB_SUCCESS;
+    }
+    return lcbmt_op_dispatch(op);
+}
+
+LCBMT_INTERNAL
+lcb_error_t lcbmt_op_dispatch(lcbmt_op_t *op)
+{
+    if (op->parent->shed_target) {
+        lcbmt_shed_sample(op);
+    }
+    return route_op(op);
+}
+
+/**
+ * Issues the operation, joins or combines it with another, or holds it
+ * back, according to its type
+ */
+static lcb_error_t route_op(lcbmt_op_t *op)
+{
+    switch (op->opcode) {
+    case LCBMT_OP_GET:
+        return schedule_get(op);
+
+    case LCBMT_OP_ARITHMETIC:
+        return schedule_arithmetic(op);
+
+    case LCBMT_OP_STORE:
+        return schedule_store(op);
+
+    default:
+        abort();
+    }
+    return LCB_EINTERNAL;
+}
+
+LCBMT_INTERNAL
+void lcbmt_op_report(lcbmt_op_t *op, lcb_error_t err)
+{
+    lcbmt_waiter_t *w;
+
+    for (w = &op->waiters; w; w = w->next) {
+        if (!w->timed_out) {
+            lcbmt_op_report_waiter(op, w, err);
+        }
+    }
+}
+
+LCBMT_INTERNAL
+void lcbmt_op_report_waiter(lcbmt_op_t *op,
+                            lcbmt_waiter_t *w,
+                            lcb_error_t err)
+{
+    lcbmt_record_t *rec;
+
+    switch (op->opcode) {
+    case LCBMT_OP_GET:
+        rec = lcbmt_record_get(op->parent, err,
+                               op->kent.key, op->kent.nkey,
+                               NULL, 0, 0, 0);
+        break;
+    case LCBMT_OP_ARITHMETIC:
+        rec = lcbmt_record_arithmetic(op->parent, err,
+                                      op->kent.key, op->kent.nkey,
+                                      0, 0);
+        break;
+    case LCBMT_OP_STORE:
+        rec = lcbmt_record_store(op->parent, err,
+                                 op->u.store.operation,
+                                 op->kent.key, op->kent.nkey, 0);
+        break;
+    default:
+        abort();
+    }
+
+    /**
+     * If we can't even report the error, the response is still
+     * counted, so that the waiter does not wait for it forever
+     */
+    lcbmt_token_push(w->token, w->ucookie, rec);
+}
+
+LCBMT_INTERNAL
+void lcbmt_op_fail(lcbmt_op_t *op, lcb_error_t err)
+{
+    lcbmt_op_report(op, err);
+    lcbmt_op_destroy(op);
+}
+
+/**
+ * Pass a newly created operation on, either to the batch or directly to
+ * libcouchbase (locking the context on first use).
+ */
+static lcb_error_t submit_op(lcbmt_op_t *op, lcbmt_batch_t *batch, int *locked)
+{
+    lcbmt_ctx_t *mt = op->parent;
+    lcb_error_t err;
+
+    /**
+     * The cache is looked up without the event lock, so the key must be
+     * gone from it by the time we return, even if the modification is
+     * only scheduled later on (see lcbmt_op_schedule())
+     */
+    if (op->opcode != LCBMT_OP_GET && mt->cache) {
+        lcbmt_cache_invalidate(mt->cache, op->kent.key, op->kent.nkey,
+                               op->kent.hash);
+    }
+
+    /**
+     * Likewise for the negative filter. Only batched operations need it
+     * here; it may only be modified with the event lock held.
+     */
+    if (op->opcode != LCBMT_OP_GET && mt->negfilter && mt->batch_window) {
+        if (!*locked) {
+            lcb_mt_lock(mt);
+            *locked = 1;
+        }
+        lcbmt_negfilter_remove(mt->negfilter, op->kent.key, op->kent.nkey,
+                               op->kent.hash);
+    }
+
+    if (mt->batch_window) {
+        lcbmt_batch_append(batch, op);
+        return LCB_SUCCESS;
+    }
+
+    if (!*locked) {
+        lcb_mt_lock(mt);
+        *locked = 1;
+    }
+
+    err = lcbmt_op_schedule(op);
+    if (err != LCB_SUCCESS) {
+        lcbmt_op_destroy(op);
+    }
+    return err;
+}
+
+static void submit_done(lcbmt_ctx_t *mt, lcbmt_batch_t *batch, int locked)
+{
+    if (locked) {
+        lcb_mt_unlock(mt);
+    }
+    if (batch->count) {
+        lcbmt_batch_submit(mt, batch);
+    }
+}
+
+LIBCOUCHBASE_API
+lcb_error_t lcb_mt_get(lcbmt_token_t token,
+                       lcb_size_t num,
+                       const lcb_get_cmd_t *const *commands)
+{
+    lcbmt_ctx_t *mt = token->parent;
+    lcb_error_t err = LCB_SUCCESS;
+    lcbmt_batch_t batch;
+    lcb_size_t ii;
+    int locked = 0;
+
+    if (lcbmt_shed_reject(token)) {
+        return LCB_MT_EOVERLOAD;
+    }
+
+    memset(&batch, 0, sizeof(batch));
+
+    for (ii = 0; ii < num && err == LCB_SUCCESS; ii++) {
+        const lcb_get_cmd_t *cmd = commands[ii];
+        lcbmt_op_t *op;
+
+        if (cmd->version != 0 || cmd->v.v0.nkey == 0) {
+            err = LCB_EINVAL;
+            break;
+        }
+
+        /** Cache hits are delivered without ever taking the lock */
+        if (mt->cache && get_is_shareable(cmd)) {
+            lcbmt_record_t *rec;
+            rec = lcbmt_cache_lookup(mt, cmd->v.v0.key, cmd->v.v0.nkey);
+            if (rec) {
+                lcbmt_token_push(token, token->ucookie, rec);
+                continue;
+            }
+        }
+
+        /** Likewise for keys which were recently found not to exist */
+        if (mt->negfilter && get_is_shareable(cmd)) {
+            lcb_uint32_t hash = lcbmt_hash_key(cmd->v.v0.key, cmd->v.v0.nkey);
+            if (lcbmt_negfilter_contains(mt->negfilter,
+                                         cmd->v.v0.key, cmd->v.v0.nkey,
+                                         hash)) {
+                lcbmt_record_t *rec;
+                rec = lcbmt_record_get(mt, LCB_KEY_ENOENT,
+                                       cmd->v.v0.key, cmd->v.v0.nkey,
+                                       NULL, 0, 0, 0);
+                if (rec) {
+                    __sync_fetch_and_add(&mt->negative_hits, 1);
+                    lcbmt_token_push(token, token->ucookie, rec);
+                    continue;
+                }
+            }
+        }
+
+        op = create_get(mt, token, cmd);
+        if (!op) {
+            err = LCB_CLIENT_ENOMEM;
+            break;
+        }
+        err = submit_op(op, &batch, &locked);
+    }
+
+    submit_done(mt, &batch, locked);
+    return err;
+}
+
+LIBCOUCHBASE_API
+lcb_error_t lcb_mt_arithmetic(lcbmt_token_t token,
+                              lcb_size_t num,
+                              const lcb_arithmetic_cmd_t *const *commands)
+{
+    lcbmt_ctx_t *mt = token->parent;
+    lcb_error_t err = LCB_SUCCESS;
+    lcbmt_batch_t batch;
+    lcb_size_t ii;
+    int locked = 0;
+
+    if (lcbmt_shed_reject(token)) {
+        return LCB_MT_EOVERLOAD;
+    }
+
+    memset(&batch, 0, sizeof(batch));
+
+    for (ii = 0; ii < num && err == LCB_SUCCESS; ii++) {
+        const lcb_arithmetic_cmd_t *cmd = commands[ii];
+        lcbmt_op_t *op;
+
+        if (cmd->version != 0 || cmd->v.v0.nkey == 0) {
+            err = LCB_EINVAL;
+            break;
+        }
+
+        op = create_arithmetic(mt, token, cmd);
+        if (!op) {
+            err = LCB_CLIENT_ENOMEM;
+            break;
+        }
+        err = submit_op(op, &batch, &locked);
+    }
+
+    submit_done(mt, &batch, locked);
+    return err;
+}
+
+LIBCOUCHBASE_API
+lcb_error_t lcb_mt_store(lcbmt_token_t token,
+                         lcb_size_t num,
+                         const lcb_store_cmd_t *const *commands)
+{
+    lcbmt_ctx_t *mt = token->parent;
+    lcb_error_t err = LCB_SUCCESS;
+    lcbmt_batch_t batch;
+    lcb_size_t ii;
+    int locked = 0;
+
+    if (lcbmt_shed_reject(token)) {
+        return LCB_MT_EOVERLOAD;
+    }
+
+    memset(&batch, 0, sizeof(batch));
+
+    for (ii = 0; ii < num && err == LCB_SUCCESS; ii++) {
+        const lcb_store_cmd_t *cmd = commands[ii];
+        lcbmt_op_t *op;
+
+        if (cmd->version != 0 || cmd->v.v0.nkey == 0) {
+            err = LCB_EINVAL;
+            break;
+        }
+
+        op = create_store(mt, token, cmd);
+        if (!op) {
+            err = LCB_CLIENT_ENOMEM;
+            break;
+        }
+        err = submit_op(op, &batch, &locked);
+    }
+
+    submit_done(mt, &batch, locked);
+    return err;
+}
+
+LIBCOUCHBASE_API
+lcb_error_t lcb_mt_enable_store_coalescing(lcbmt_t mt)
+{
+    if (mt->coalesce_stores) {
+        return LCB_EINVAL;
+    }
+    mt->coalesce_stores = 1;
+    return LCB_SUCCESS;
+}
@@ -0,0 +1,198 @@
+#include "mt_internal.h"
+
+/**
+ * A pool of contexts, each wrapping its own connected instance (with its
+ * own IO thread, unless leader/follower mode is requested). Threads lease a
+ * context for as long as they schedule through it; a lease only counts how
+ * many threads use each context, so that new leases go to the least used
+ * one.
+ *
+ * Each thread remembers the context it leased last and prefers it, so that
+ * its keys keep hitting the same near cache and in-flight tables, unless
+ * that context has become noticeably busier than the least used one.
+ */
+
+typedef struct {
+    lcbmt_t mt;
+    lcb_t instance;
+    lcb_io_opt_t io;
+
+    /** Number of threads holding a lease */
+    volatile unsigned int leases;
+} pool_slot;
+
+struct lcbmt_pool_st {
+    pool_slot *slots;
+    unsigned int nslots;
+
+    /** Number of slots set up (all of them once created) */
+    unsigned int nready;
+
+    /** Index (plus one) of the slot last leased by the calling thread */
+    pthread_key_t hint;
+};
+
+static lcb_error_t slot_connect(pool_slot *slot,
+                                const struct lcb_create_st *options,
+                                int flags)
+{
+    struct lcb_create_st cropts = *options;
+    lcb_error_t err;
+
+    err = lcb_create_io_ops(&slot->io, NULL);
+    if (err != LCB_SUCCESS) {
+        return err;
+    }
+
+    /** The IO field is at the same place in both versions */
+    cropts.v.v0.io = slot->io;
+    err = lcb_create(&slot->instance, &cropts);
+    if (err != LCB_SUCCESS) {
+        slot->instance = NULL;
+        return err;
+    }
+
+    err = lcb_connect(slot->instance);
+    if (err == LCB_SUCCESS) {
+        err = lcb_wait(slot->instance);
+    }
+    if (err == LCB_SUCCESS) {
+        err = lcb_get_last_error(slot->instance);
+    }
+    if (err != LCB_SUCCESS) {
+        return err;
+    }
+
+    err = lcb_mt_init_ex(&slot->mt, slot->instance, slot->io, flags);
+    if (err != LCB_SUCCESS) {
+        slot->mt = NULL;
+    }
+    return err;
+}
+
+/**
+ * The context still refers to the instance (e.g. to stop its timers), so
+ * it goes first
+ */
+static void slot_destroy(pool_slot *slot)
+{
+    if (slot->mt) {
+        lcb_mt_destroy(slot->mt);
+    }
+    if (slot->instance) {
+        lcb_destroy(slot->instance);
+    }
+    if (slot->io) {
+        lcb_destroy_io_ops(slot->io);
+    }
+}
+
+LIBCOUCHBASE_API
+lcb_error_t lcb_mt_pool_create(lcbmt_pool_t *poolp,
+                               const struct lcb_create_st *options,
+                               unsigned int ninstances,
+                               int flags)
+{
+    lcbmt_pool_t pool;
+    lcb_error_t err;
+
+    if (ninstances == 0) {
+        return LCB_EINVAL;
+    }
+
+    pool = calloc(1, sizeof(*pool));
+    if (!pool) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    pool->slots = calloc(ninstances, sizeof(*pool->slots));
+    if (!pool->slots) {
+        free(pool);
+        return LCB_CLIENT_ENOMEM;
+    }
+    if (pthread_key_create(&pool->hint, NULL) != 0) {
+        free(pool->slots);
+        free(pool);
+        return LCB_EINTERNAL;
+    }
+    pool->nslots = ninstances;
+
+    for (; pool->nready < ninstances; pool->nready++) {
+        err = slot_connect(&pool->slots[pool->nready], options, flags);
+        if (err != LCB_SUCCESS) {
+            /** Count it so that whatever was set up is destroyed */
+            pool->nready++;
+            lcb_mt_pool_destroy(pool);
+            return err;
+        }
+    }
+
+    *poolp = pool;
+    return LCB_SUCCESS;
+}
+
+LIBCOUCHBASE_API
+lcbmt_t lcb_mt_pool_context(lcbmt_pool_t pool, unsigned int index)
+{
+    if (index >= pool->nslots) {
+        return NULL;
+    }
+    return pool->slots[index].mt;
+}
+
+LIBCOUCHBASE_API
+lcbmt_t lcb_mt_pool_acquire(lcbmt_pool_t pool)
+{
+    size_t hint = (size_t)pthread_getspecific(pool->hint);
+    pool_slot *least = &pool->slots[0];
+    pool_slot *slot;
+    unsigned int ii;
+
+    for (ii = 1; ii < pool->nslots; ii++) {
+        if (pool->slots[ii].leases < least->leases) {
+            least = &pool->slots[ii];
+        }
+    }
+
+    /** Stay unless the preferred context has a quarter more leases */
+    slot = hint ? &pool->slots[hint - 1] : NULL;
+    if (!slot || slot->leases > least->leases + least->leases / 4 + 1) {
+        slot = least;
+        pthread_setspecific(pool->hint,
+                            (void *)(size_t)(slot - pool->slots + 1));
+    }
+
+    __sync_fetch_and_add(&slot->leases, 1);
+    return slot->mt;
+}
+
+LIBCOUCHBASE_API
+void lcb_mt_pool_release(lcbmt_pool_t pool, lcbmt_t mt)
+{
+    unsigned int ii;
+
+    for (ii = 0; ii < pool->nslots; ii++) {
+        if (pool->slots[ii].mt == mt) {
+            __sync_fetch_and_sub(&pool->slots[ii].leases, 1);
+            return;
+        }
+    }
+}
+
+LIBCOUCHBASE_API
+void lcb_mt_pool_destroy(lcbmt_pool_t pool)
+{
+    unsigned int ii;
+
+    for (ii = 0; ii < pool->nready; ii++) {
+        slot_destroy(&pool->slots[ii]);
+    }
+    pthread_key_delete(pool->hint);
+    free(pool->slots);
+    free(pool);
+}
+
+LIBCOUCHBASE_API
+lcb_t lcb_mt_get_instance(lcbmt_t mt)
+{
+    return mt->instance;
+}
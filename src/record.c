@@ -0,0 +1,242 @@
+#include "mt_internal.h"
+
+/**
+ * Records are self-contained copies of a response. They are used whenever a
+ * response must outlive the libcouchbase callback, or where there is no
+ * libcouchbase callback at all (e.g. responses served from the cache).
+ */
+
+LCBMT_INTERNAL
+lcbmt_record_t *lcbmt_record_create(lcbmt_ctx_t *mt, lcb_size_t nbuf)
+{
+    lcb_size_t size = sizeof(lcbmt_record_t) + nbuf;
+    lcbmt_record_t *rec;
+
+    if (mt->arena) {
+        rec = lcbmt_arena_alloc(mt->arena, size);
+    } else {
+        rec = malloc(size);
+    }
+    if (!rec) {
+        return NULL;
+    }
+    memset(rec, 0, sizeof(*rec));
+    rec->arena = mt->arena;
+    rec->size = size;
+    return rec;
+}
+
+LCBMT_INTERNAL
+void lcbmt_record_destroy(lcbmt_record_t *rec)
+{
+    if (rec->arena) {
+        lcbmt_arena_free(rec->arena, rec, rec->size);
+    } else {
+        free(rec);
+    }
+}
+
+LCBMT_INTERNAL
+lcbmt_record_t *lcbmt_record_get(lcbmt_ctx_t *mt,
+                                 lcb_error_t err,
+                                 const void *key, lcb_size_t nkey,
+                                 const void *bytes, lcb_size_t nbytes,
+                                 lcb_uint32_t flags, lcb_cas_t cas)
+{
+    lcbmt_record_t *rec = lcbmt_record_create(mt, nkey + nbytes);
+    lcb_get_resp_t *resp;
+
+    if (!rec) {
+        return NULL;
+    }
+
+    rec->type = LCBMT_RESP_GET;
+    rec->err = err;
+
+    resp = &rec->resp.get;
+    memcpy(rec->buf, key, nkey);
+    resp->v.v0.key = rec->buf;
+    resp->v.v0.nkey = nkey;
+
+    if (nbytes) {
+        memcpy(rec->buf + nkey, bytes, nbytes);
+    }
+    resp->v.v0.bytes = rec->buf + nkey;
+    resp->v.v0.nbytes = nbytes;
+    resp->v.v0.flags = flags;
+    resp->v.v0.cas = cas;
+    return rec;
+}
+
+LCBMT_INTERNAL
+lcbmt_record_t *lcbmt_record_arithmetic(lcbmt_ctx_t *mt,
+                                        lcb_error_t err,
+                                        const void *key, lcb_size_t nkey,
+                                        lcb_uint64_t value, lcb_cas_t cas)
+{
+    lcbmt_record_t *rec = lcbmt_record_create(mt, nkey);
+    lcb_arithmetic_resp_t *resp;
+
+    if (!rec) {
+        return NULL;
+    }
+
+    rec->type = LCBMT_RESP_ARITHMETIC;
+    rec->err = err;
+
+    resp = &rec->resp.arithmetic;
+    memcpy(rec->buf, key, nkey);
+    resp->v.v0.key = rec->buf;
+    resp->v.v0.nkey = nkey;
+    resp->v.v0.value = value;
+    resp->v.v0.cas = cas;
+    return rec;
+}
+
+LCBMT_INTERNAL
+lcbmt_record_t *lcbmt_record_store(lcbmt_ctx_t *mt,
+                                   lcb_error_t err,
+                                   lcb_storage_t storop,
+                                   const void *key, lcb_size_t nkey,
+                                   lcb_cas_t cas)
+{
+    lcbmt_record_t *rec = lcbmt_record_create(mt, nkey);
+    lcb_store_resp_t *resp;
+
+    if (!rec) {
+        return NULL;
+    }
+
+    rec->type = LCBMT_RESP_STORE;
+    rec->err = err;
+    rec->storop = storop;
+
+    resp = &rec->resp.store;
+    memcpy(rec->buf, key, nkey);
+    resp->v.v0.key = rec->buf;
+    resp->v.v0.nkey = nkey;
+    resp->v.v0.cas = cas;
+    return rec;
+}
+
+/**
+ * The responses which only carry a key (and possibly a CAS) are copied as a
+ * whole, with the key pointing into the record.
+ */
+#define COPY_KEY_RESPONSE(mt, rec, fld, t_resp, resp) \
+    rec = lcbmt_record_create(mt, ((const t_resp *)resp)->v.v0.nkey); \
+    if (rec) { \
+        rec->resp.fld = *(const t_resp *)resp; \
+        memcpy(rec->buf, rec->resp.fld.v.v0.key, rec->resp.fld.v.v0.nkey); \
+        rec->resp.fld.v.v0.key = rec->buf; \
+    }
+
+LCBMT_INTERNAL
+lcbmt_record_t *lcbmt_record_copy(lcbmt_ctx_t *mt,
+                                  lcbmt_resptype_t type,
+                                  lcb_error_t err,
+                                  lcb_storage_t storop,
+                                  const void *resp)
+{
+    lcbmt_record_t *rec;
+
+    switch (type) {
+    case LCBMT_RESP_STORE: {
+        const lcb_store_resp_t *r = resp;
+        return lcbmt_record_store(mt, err, storop,
+                                  r->v.v0.key, r->v.v0.nkey, r->v.v0.cas);
+    }
+
+    case LCBMT_RESP_GET: {
+        const lcb_get_resp_t *r = resp;
+        return lcbmt_record_get(mt, err, r->v.v0.key, r->v.v0.nkey,
+                                r->v.v0.bytes, r->v.v0.nbytes,
+                                r->v.v0.flags, r->v.v0.cas);
+    }
+
+    case LCBMT_RESP_ARITHMETIC: {
+        const lcb_arithmetic_resp_t *r = resp;
+        return lcbmt_record_arithmetic(mt, err, r->v.v0.key, r->v.v0.nkey,
+                                       r->v.v0.value, r->v.v0.cas);
+    }
+
+    case LCBMT_RESP_REMOVE:
+        COPY_KEY_RESPONSE(mt, rec, remove, lcb_remove_resp_t, resp);
+        break;
+
+    case LCBMT_RESP_TOUCH:
+        COPY_KEY_RESPONSE(mt, rec, touch, lcb_touch_resp_t, resp);
+        break;
+
+    case LCBMT_RESP_UNLOCK:
+        COPY_KEY_RESPONSE(mt, rec, unlock, lcb_unlock_resp_t, resp);
+        break;
+
+    default:
+        return NULL;
+    }
+
+    if (rec) {
+        rec->type = type;
+        rec->err = err;
+    }
+    return rec;
+}
+
+/**
+ * Fill in the public view of a record
+ */
+LCBMT_INTERNAL
+void lcbmt_record_export(lcbmt_record_t *rec, struct lcb_mt_response *out)
+{
+    memset(out, 0, sizeof(*out));
+    out->type = rec->type;
+    out->err = rec->err;
+    out->cookie = rec->ucookie;
+    out->record = rec;
+
+    switch (rec->type) {
+    case LCBMT_RESP_STORE:
+        out->key = rec->resp.store.v.v0.key;
+        out->nkey = rec->resp.store.v.v0.nkey;
+        out->cas = rec->resp.store.v.v0.cas;
+        out->storop = rec->storop;
+        break;
+
+    case LCBMT_RESP_GET:
+        out->key = rec->resp.get.v.v0.key;
+        out->nkey = rec->resp.get.v.v0.nkey;
+        out->bytes = rec->resp.get.v.v0.bytes;
+        out->nbytes = rec->resp.get.v.v0.nbytes;
+        out->flags = rec->resp.get.v.v0.flags;
+        out->cas = rec->resp.get.v.v0.cas;
+        break;
+
+    case LCBMT_RESP_ARITHMETIC:
+        out->key = rec->resp.arithmetic.v.v0.key;
+        out->nkey = rec->resp.arithmetic.v.v0.nkey;
+        out->value = rec->resp.arithmetic.v.v0.value;
+        out->cas = rec->resp.arithmetic.v.v0.cas;
+        break;
+
+    case LCBMT_RESP_REMOVE:
+        out->key = rec->resp.remove.v.v0.key;
+        out->nkey = rec->resp.remove.v.v0.nkey;
+        out->cas = rec->resp.remove.v.v0.cas;
+        break;
+
+    case LCBMT_RESP_TOUCH:
+        out->key = rec->resp.touch.v.v0.key;
+        out->nkey = rec->resp.touch.v.v0.nkey;
+        out->cas = rec->resp.touch.v.v0.cas;
+        break;
+
+    case LCBMT_RESP_UNLOCK:
+        out->key = rec->resp.unlock.v.v0.key;
+        out->nkey = rec->resp.unlock.v.v0.nkey;
+        break;
+
+    default:
+        break;
+    }
+}
@@ -0,0 +1,161 @@
+#include "mt_internal.h"
+
+/**
+ * Retries of operations scheduled through the MT layer. A response with a
+ * temporary error is swallowed, and the operation is sent again from a
+ * libcouchbase timer; the timer fires in the thread running the event loop,
+ * with the event lock held, so retries never contend for the lock. Tokens
+ * only see the final response.
+ *
+ * A shared operation stays in its key table while waiting to be retried,
+ * so that later GETs for the key still join it, and later increments or
+ * stores for the key are held back until it completes.
+ */
+
+static int is_retryable(lcb_error_t err)
+{
+    switch (err) {
+    case LCB_ETMPFAIL:
+    case LCB_EBUSY:
+    case LCB_ENOMEM:
+    case LCB_NOT_MY_VBUCKET:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * xorshift32. Only called with the event lock held
+ */
+static lcb_uint32_t next_random(lcbmt_ctx_t *mt)
+{
+    lcb_uint32_t x = mt->retry_seed;
+    if (!x) {
+        x = (lcb_uint32_t)lcbmt_now_usec() | 1;
+    }
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    mt->retry_seed = x;
+    return x;
+}
+
+/**
+ * Returns the delay before the next retry, with up to half of it taken off
+ * at random, and doubles the backoff for the one after that.
+ */
+static lcb_uint32_t next_delay(lcbmt_op_t *op)
+{
+    lcb_uint32_t backoff = op->retry.backoff;
+    lcb_uint32_t half = backoff / 2;
+
+    if (backoff < op->retry.max_backoff / 2) {
+        op->retry.backoff = backoff * 2;
+    } else {
+        op->retry.backoff = op->retry.max_backoff;
+    }
+
+    if (!half) {
+        return backoff;
+    }
+    return backoff - next_random(op->parent) % (half + 1);
+}
+
+static void retry_timer(lcb_timer_t timer, lcb_t instance, const void *cookie)
+{
+    lcbmt_op_t *op = (lcbmt_op_t *)cookie;
+    lcb_error_t err;
+
+    op->retry.waiting = 0;
+    if (op->timed_out) {
+        lcbmt_op_complete(op);
+        lcbmt_op_destroy(op);
+        return;
+    }
+
+    err = lcbmt_op_issue(op);
+    if (err != LCB_SUCCESS) {
+        lcbmt_op_complete(op);
+        lcbmt_op_fail(op, err);
+    }
+}
+
+LCBMT_INTERNAL
+void lcbmt_retry_init(lcbmt_op_t *op, lcbmt_token_t token)
+{
+    const struct lcb_mt_retry_policy *policy;
+
+    policy = token->has_retry ? &token->retry : &op->parent->retry;
+    if (policy->max_attempts < 2) {
+        return;
+    }
+
+    op->retry.max_attempts = policy->max_attempts;
+    op->retry.backoff = policy->initial_backoff;
+    op->retry.max_backoff = policy->max_backoff;
+    if (policy->deadline) {
+        op->retry.deadline = lcbmt_now_usec() + policy->deadline;
+    }
+}
+
+LCBMT_INTERNAL
+int lcbmt_op_retry(lcbmt_op_t *op, lcb_error_t err)
+{
+    lcbmt_ctx_t *mt = op->parent;
+    lcb_uint32_t delay;
+    lcb_error_t terr;
+
+    if (op->retry.attempts + 1 >= op->retry.max_attempts ||
+            op->timed_out || !is_retryable(err)) {
+        return 0;
+    }
+
+    delay = next_delay(op);
+    if (op->retry.deadline &&
+            lcbmt_now_usec() + delay >= op->retry.deadline) {
+        return 0;
+    }
+
+    if (!lcb_timer_create(mt->instance, op, delay, 0, retry_timer, &terr)) {
+        return 0;
+    }
+
+    op->retry.attempts++;
+    op->retry.waiting = 1;
+    mt->retries++;
+    return 1;
+}
+
+static int policy_is_valid(const struct lcb_mt_retry_policy *policy)
+{
+    return policy->max_attempts < 2 ||
+           policy->initial_backoff <= policy->max_backoff;
+}
+
+LIBCOUCHBASE_API
+lcb_error_t lcb_mt_set_retry_policy(lcbmt_t mt,
+                                    const struct lcb_mt_retry_policy *policy)
+{
+    if (!policy_is_valid(policy)) {
+        return LCB_EINVAL;
+    }
+    mt->retry = *policy;
+    return LCB_SUCCESS;
+}
+
+LIBCOUCHBASE_API
+lcb_error_t lcb_mt_token_set_retry_policy(lcbmt_token_t token,
+                                          const struct lcb_mt_retry_policy *policy)
+{
+    if (!policy) {
+        token->has_retry = 0;
+        return LCB_SUCCESS;
+    }
+    if (!policy_is_valid(policy)) {
+        return LCB_EINVAL;
+    }
+    token->retry = *policy;
+    token->has_retry = 1;
+    return LCB_SUCCESS;
+}
@@ -0,0 +1,68 @@
+#include "mt_internal.h"
+
+/**
+ * Load shedding, after CoDel. Each operation records how long it waited
+ * between being created and being dispatched, i.e. its time spent queued
+ * within the client. A single operation waiting too long is no cause for
+ * concern, but a queue which never drains below the target within an
+ * interval is: the context then starts rejecting bulk operations before
+ * they join the queue, and stops as soon as an operation gets through
+ * within the target again.
+ *
+ * Samples are taken with the event lock held. The check made when
+ * scheduling is done without it, and may act on a slightly stale state.
+ */
+
+LCBMT_INTERNAL
+void lcbmt_shed_sample(lcbmt_op_t *op)
+{
+    lcbmt_ctx_t *mt = op->parent;
+    lcb_uint64_t now = lcbmt_now_usec();
+
+    mt->shed_sampled = now;
+
+    if (now - op->created < mt->shed_target) {
+        mt->shed_above = 0;
+        mt->shedding = 0;
+        return;
+    }
+
+    if (!mt->shed_above) {
+        mt->shed_above = now;
+    } else if (now - mt->shed_above >= mt->shed_interval) {
+        mt->shedding = 1;
+    }
+}
+
+LCBMT_INTERNAL
+int lcbmt_shed_reject(lcbmt_token_t token)
+{
+    lcbmt_ctx_t *mt = token->parent;
+    lcb_uint64_t sampled;
+
+    if (!mt->shedding || token->priority == LCB_MT_PRIORITY_INTERACTIVE) {
+        return 0;
+    }
+
+    /** Nothing has been dispatched lately to tell whether it still applies */
+    sampled = mt->shed_sampled;
+    if (lcbmt_now_usec() - sampled >= mt->shed_interval) {
+        return 0;
+    }
+
+    __sync_fetch_and_add(&mt->ops_shed, 1);
+    return 1;
+}
+
+LIBCOUCHBASE_API
+lcb_error_t lcb_mt_enable_load_shedding(lcbmt_t mt,
+                                        lcb_uint32_t target,
+                                        lcb_uint32_t interval)
+{
+    if (mt->shed_target || target == 0 || interval == 0) {
+        return LCB_EINVAL;
+    }
+    mt->shed_target = target;
+    mt->shed_interval = interval;
+    return LCB_SUCCESS;
+}
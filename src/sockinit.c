@@ -10,36 +10,36 @@
  */
 
 
-static int mt_reschedule_read(lcbmt_ctx_t *mt);
+static int mt_reschedule_read(lcbmt_loop_t loop);
 
-int lcbmt_setup_socket(lcbmt_ctx_t *mt)
+int lcbmt_setup_socket(lcbmt_loop_t loop)
 {
     int rv;
     socklen_t slen;
 
-    mt->sock_lsn = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (mt->sock_lsn == -1) {
+    loop->sock_lsn = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (loop->sock_lsn == -1) {
         return -1;
     }
 
-    rv = bind(mt->sock_lsn,
-              (struct sockaddr *)&mt->saddr,
-              sizeof(mt->saddr));
+    rv = bind(loop->sock_lsn,
+              (struct sockaddr *)&loop->saddr,
+              sizeof(loop->saddr));
 
     if (rv != 0) {
         return -1;
     }
 
-    slen = sizeof(mt->sock_lsn);
-    rv = getsockname(mt->sock_lsn,
-                     (struct sockaddr*)&mt->saddr,
+    slen = sizeof(loop->sock_lsn);
+    rv = getsockname(loop->sock_lsn,
+                     (struct sockaddr*)&loop->saddr,
                      &slen);
 
     if (rv != 0) {
         return -1;
     }
 
-    rv = listen(mt->sock_lsn, 5);
+    rv = listen(loop->sock_lsn, 5);
     if (rv != 0) {
         return -1;
     }
@@ -55,71 +55,71 @@ static void connect_callback(lcb_sockdata_t *sock, int status)
     sock->parent->v.v1.stop_event_loop(sock->parent);
 }
 
-static void reset_v1_buf(lcbmt_ctx_t *mt)
+static void reset_v1_buf(lcbmt_loop_t loop)
 {
-    mt->loopsock.iocp.sd->read_buffer.iov[0].iov_base =
-            mt->loopsock.iocp.buf;
-    mt->loopsock.iocp.sd->read_buffer.iov[0].iov_len =
-            sizeof(mt->loopsock.iocp.buf);
+    loop->loopsock.iocp.sd->read_buffer.iov[0].iov_base =
+            loop->loopsock.iocp.buf;
+    loop->loopsock.iocp.sd->read_buffer.iov[0].iov_len =
+            sizeof(loop->loopsock.iocp.buf);
 }
 
-int lcbmt_negotiate_client(lcbmt_ctx_t *mt)
+int lcbmt_negotiate_client(lcbmt_loop_t loop)
 {
     int rv;
-    lcb_io_opt_t io = mt->iops;
-    if (mt->iops->version == 0) {
+    lcb_io_opt_t io = loop->iops;
+    if (loop->iops->version == 0) {
         int optval = 1;
         struct lcb_iops_table_v0_st *v0 = &io->v.v0;
-        mt->loopsock.ev.event = v0->create_event(io);
-        if (!mt->loopsock.ev.event) {
+        loop->loopsock.ev.event = v0->create_event(io);
+        if (!loop->loopsock.ev.event) {
             return -1;
         }
-        mt->loopsock.ev.fd = v0->socket(io, AF_INET, SOCK_STREAM, IPPROTO_TCP);
-        if (mt->loopsock.ev.fd == -1) {
+        loop->loopsock.ev.fd = v0->socket(io, AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (loop->loopsock.ev.fd == -1) {
             return -1;
         }
-        rv = lcbmt_blocking_connect(mt);
-        setsockopt(mt->loopsock.ev.fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+        rv = lcbmt_blocking_connect(loop);
+        setsockopt(loop->loopsock.ev.fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
 
      } else {
          struct lcb_iops_table_v1_st *v1 = &io->v.v1;
-         mt->loopsock.iocp.sd = v1->create_socket(io,
-                                                  AF_INET, SOCK_STREAM,
-                                                  IPPROTO_TCP);
-         if (!mt->loopsock.iocp.sd) {
+         loop->loopsock.iocp.sd = v1->create_socket(io,
+                                                    AF_INET, SOCK_STREAM,
+                                                    IPPROTO_TCP);
+         if (!loop->loopsock.iocp.sd) {
              return -1;
          }
 
-         mt->loopsock.iocp.sd->lcbconn = (struct lcb_connection_st *)&rv;
-         mt->loopsock.iocp.sd->read_buffer.root = malloc(1);
-         mt->loopsock.iocp.sd->read_buffer.ringbuffer = malloc(1);
-         reset_v1_buf(mt);
+         loop->loopsock.iocp.sd->lcbconn = (struct lcb_connection_st *)&rv;
+         loop->loopsock.iocp.sd->read_buffer.root = malloc(1);
+         loop->loopsock.iocp.sd->read_buffer.ringbuffer = malloc(1);
+         reset_v1_buf(loop);
 
-         rv = v1->start_connect(io, mt->loopsock.iocp.sd,
-                                (struct sockaddr *)&mt->saddr,
-                                sizeof(mt->saddr),
+         rv = v1->start_connect(io, loop->loopsock.iocp.sd,
+                                (struct sockaddr *)&loop->saddr,
+                                sizeof(loop->saddr),
                                 connect_callback);
          v1->run_event_loop(io);
     }
     if (rv == 0) {
-        mt_reschedule_read(mt);
+        mt_reschedule_read(loop);
     }
     return rv;
 }
 
-int lcbmt_negotiate_server(lcbmt_ctx_t *mt)
+int lcbmt_negotiate_server(lcbmt_loop_t loop)
 {
     struct sockaddr_storage caddr;
     socklen_t slen = sizeof(caddr);
     int optval = 1;
 
-    mt->sock_accepted = accept(mt->sock_lsn, (struct sockaddr *)&caddr, &slen);
+    loop->sock_accepted = accept(loop->sock_lsn, (struct sockaddr *)&caddr, &slen);
 
-    if (mt->sock_accepted == -1) {
+    if (loop->sock_accepted == -1) {
         return -1;
     }
-    setsockopt(mt->sock_accepted, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
-    return lcbmt_set_server_nonblocking(mt);
+    setsockopt(loop->sock_accepted, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+    return lcbmt_set_server_nonblocking(loop);
 }
 
 
@@ -127,8 +127,8 @@ static void mt_v0_callback(lcb_socket_t sock, short which, void *arg)
 {
     char buf[4096];
     ssize_t rv;
-    lcbmt_ctx_t *mt = arg;
-    while ( (rv = recv(mt->loopsock.ev.fd, buf,
+    lcbmt_loop_t loop = arg;
+    while ( (rv = recv(loop->loopsock.ev.fd, buf,
                        sizeof(buf), 0)) == sizeof(buf)) {
         /* no body */
     }
@@ -136,39 +136,55 @@ static void mt_v0_callback(lcb_socket_t sock, short which, void *arg)
         fprintf(stderr, "Connection closed!\n");
     }
 
-    lcbmt_internal_callback(mt);
-    mt_reschedule_read(mt);
+    lcbmt_internal_callback(loop);
+    mt_reschedule_read(loop);
 }
 
 static void mt_v1_callback(lcb_sockdata_t* sock, lcb_ssize_t nr)
 {
-    lcbmt_ctx_t *mt = (lcbmt_ctx_t *)sock->lcbconn;
-    lcbmt_internal_callback(mt);
-    mt_reschedule_read(mt);
+    lcbmt_loop_t loop = (lcbmt_loop_t)sock->lcbconn;
+    lcbmt_internal_callback(loop);
+    mt_reschedule_read(loop);
 }
 
-static int mt_reschedule_read(lcbmt_ctx_t *mt)
+static int mt_reschedule_read(lcbmt_loop_t loop)
 {
-    if (mt->iops->version == 0) {
-        mt->iops->v.v0.update_event(mt->iops,
-                                    mt->loopsock.ev.fd,
-                                    mt->loopsock.ev.event,
-                                    LCB_READ_EVENT,
-                                    mt,
-                                    mt_v0_callback);
+    if (loop->iops->version == 0) {
+        loop->iops->v.v0.update_event(loop->iops,
+                                      loop->loopsock.ev.fd,
+                                      loop->loopsock.ev.event,
+                                      LCB_READ_EVENT,
+                                      loop,
+                                      mt_v0_callback);
     } else {
-        reset_v1_buf(mt);
-        mt->iops->v.v1.start_read(mt->iops,
-                                  mt->loopsock.iocp.sd,
-                                  mt_v1_callback);
+        reset_v1_buf(loop);
+        loop->iops->v.v1.start_read(loop->iops,
+                                    loop->loopsock.iocp.sd,
+                                    mt_v1_callback);
     }
     return 0;
 }
 
-int lcbmt_notify(lcbmt_ctx_t *mt)
+LCBMT_INTERNAL
+void lcbmt_release_client(lcbmt_loop_t loop)
+{
+    lcb_io_opt_t io = loop->iops;
+
+    /** IOCP style sockets are left to the IO options */
+    if (io->version == 0 && loop->loopsock.ev.event) {
+        io->v.v0.delete_event(io, loop->loopsock.ev.fd,
+                              loop->loopsock.ev.event);
+        io->v.v0.destroy_event(io, loop->loopsock.ev.event);
+        if (loop->loopsock.ev.fd != -1) {
+            io->v.v0.close(io, loop->loopsock.ev.fd);
+        }
+        loop->loopsock.ev.event = NULL;
+    }
+}
+
+int lcbmt_notify(lcbmt_loop_t loop)
 {
     char c = '*';
-    send(mt->sock_accepted, &c, sizeof(c), MSG_DONTWAIT);
-    mt->notify_count++;
+    send(loop->sock_accepted, &c, sizeof(c), MSG_DONTWAIT);
     return 0;
 }
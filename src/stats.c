@@ -0,0 +1,146 @@
+#include "mt_internal.h"
+#include <unistd.h>
+#include <sys/time.h>
+
+/**
+ * Statistics publishing. The counters themselves live in the context and
+ * are modified (almost exclusively) with the event lock held. Whoever holds
+ * the event lock is thus the only writer of the shared page, which lets us
+ * use a simple sequence lock for the readers.
+ *
+ * The page is refreshed whenever the lock is released, which is far more
+ * often than anyone reads it; refreshes are skipped until
+ * LCBMT_STATS_INTERVAL has elapsed since the last one. While nothing is
+ * going on, the IO thread refreshes it every LCBMT_STATS_PERIOD instead,
+ * so that readers can tell an idle client from a stuck one.
+ */
+
+/** Minimum time (in microseconds) between refreshes of the page */
+#define LCBMT_STATS_INTERVAL 1000
+
+LCBMT_INTERNAL
+void lcbmt_hist_record(struct lcb_mt_stats_histogram *hist, lcb_uint64_t usec)
+{
+    unsigned int ix = 0;
+    while (usec && ix < LCBMT_STATS_NBUCKETS - 1) {
+        usec >>= 1;
+        ix++;
+    }
+    hist->buckets[ix]++;
+    hist->total++;
+}
+
+LCBMT_INTERNAL
+void lcbmt_stats_update(lcbmt_ctx_t *mt)
+{
+    struct lcb_mt_stats_page *page = mt->stats_page;
+    struct timeval tv;
+    lcb_uint64_t now;
+
+    if (!page) {
+        return;
+    }
+
+    now = lcbmt_now_usec();
+    if (now - mt->stats_updated < LCBMT_STATS_INTERVAL) {
+        return;
+    }
+    mt->stats_updated = now;
+
+    gettimeofday(&tv, NULL);
+
+    page->seq++;
+    lcbmt_barrier();
+
+    page->timestamp = (lcb_uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+    page->updates++;
+    page->notify_count = mt->notify_count;
+    page->enter_count = mt->loop->enter_count;
+    page->fast_count = mt->fast_count;
+    page->max_queue = mt->loop->max_queue;
+    page->queue_depth = mt->loop->waiters;
+    page->lock_wait = mt->lock_wait;
+    page->handoff = mt->handoff;
+    page->flight_joins = mt->flight_joins;
+    page->responses_copied = mt->responses_copied;
+    page->cache_hits = mt->cache_hits;
+    page->cache_misses = mt->cache_misses;
+    page->negative_hits = mt->negative_hits;
+    page->batch_flushes = mt->batch_flushes;
+    page->batch_ops = mt->batch_ops;
+    page->arithmetic_combined = mt->arithmetic_combined;
+    page->stores_coalesced = mt->stores_coalesced;
+    page->retries = mt->retries;
+    page->timeouts = mt->timeouts;
+    page->lane_holds = mt->lane_holds;
+    page->ops_shed = mt->ops_shed;
+    page->hedges = mt->hedges;
+    page->hedge_wins = mt->hedge_wins;
+
+    lcbmt_barrier();
+    page->seq++;
+}
+
+LCBMT_INTERNAL
+int lcbmt_stats_update_loop(lcbmt_loop_t loop)
+{
+    lcbmt_ctx_t *mt;
+    int published = 0;
+
+    for (mt = loop->contexts; mt; mt = mt->loop_next) {
+        if (mt->stats_page) {
+            lcbmt_stats_update(mt);
+            published = 1;
+        }
+    }
+    return published;
+}
+
+LCBMT_INTERNAL
+void lcbmt_stats_cleanup(lcbmt_ctx_t *mt)
+{
+    if (mt->stats_page) {
+        lcbmt_shm_destroy(mt->stats_name, mt->stats_page,
+                          sizeof(*mt->stats_page));
+        mt->stats_page = NULL;
+    }
+    free(mt->stats_name);
+    mt->stats_name = NULL;
+}
+
+LIBCOUCHBASE_API
+lcb_error_t lcb_mt_stats_publish(lcbmt_t mt, const char *name)
+{
+    struct lcb_mt_stats_page *page;
+    char *name_copy;
+
+    if (mt->stats_page) {
+        return LCB_EINVAL;
+    }
+
+    name_copy = malloc(strlen(name) + 1);
+    if (!name_copy) {
+        return LCB_CLIENT_ENOMEM;
+    }
+    strcpy(name_copy, name);
+
+    page = lcbmt_shm_create(name, sizeof(*page));
+    if (!page) {
+        free(name_copy);
+        return LCB_EINTERNAL;
+    }
+
+    memset(page, 0, sizeof(*page));
+    page->magic = LCBMT_STATS_MAGIC;
+    page->version = LCBMT_STATS_VERSION;
+    page->pid = getpid();
+
+    lcb_mt_lock(mt);
+    mt->stats_name = name_copy;
+    mt->stats_page = page;
+    mt->stats_updated = 0;
+    lcbmt_stats_update(mt);
+    lcb_mt_unlock(mt);
+
+    return LCB_SUCCESS;
+}
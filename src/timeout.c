@@ -0,0 +1,160 @@
+#include "mt_internal.h"
+
+/**
+ * Per-operation timeouts. Operations scheduled with a timeout are linked
+ * into the context's timer wheel, which is advanced by a periodic
+ * libcouchbase timer for as long as it is not empty (the wheel also serves
+ * other per-operation timers, e.g. for hedged GETs). Like the retry timers,
+ * this fires in the thread running the event loop, with the event lock
+ * held.
+ *
+ * Each waiter of an operation has a timer of its own, as the waiters of a
+ * shared operation may have been scheduled at different times and with
+ * different timeouts. A waiter which times out is given LCB_ETIMEDOUT
+ * right away, and skipped once the response arrives.
+ *
+ * Once all of its waiters have timed out, the operation is flagged as
+ * timed out, but libcouchbase still holds it as the cookie of a command.
+ * It is destroyed (ignoring the response) once the response or its retry
+ * timer arrives. Until then, it stays in the combine table, so that the
+ * operations held back behind it are still sent after it. A timed out
+ * operation held back behind another is destroyed instead of being issued.
+ */
+
+#define WAITER_FROM_TNODE(node) \
+    ((lcbmt_waiter_t *)((char *)(node) - offsetof(lcbmt_waiter_t, tnode)))
+
+static void expire(lcbmt_tnode_t *node)
+{
+    lcbmt_waiter_t *w = WAITER_FROM_TNODE(node);
+    lcbmt_op_t *op = w->op;
+    lcbmt_ctx_t *mt = op->parent;
+
+    w->timed_out = 1;
+    mt->timeouts++;
+    lcbmt_op_report_waiter(op, w, LCB_ETIMEDOUT);
+
+    for (w = &op->waiters; w; w = w->next) {
+        if (!w->timed_out) {
+            return;
+        }
+    }
+
+    /** No GET may join the operation any more */
+    op->timed_out = 1;
+    if (op->shared && op->opcode == LCBMT_OP_GET) {
+        lcbmt_keytab_remove(&mt->flights, &op->kent);
+        op->shared = 0;
+    }
+}
+
+static void wheel_tick(lcb_timer_t timer, lcb_t instance, const void *cookie)
+{
+    lcbmt_ctx_t *mt = (lcbmt_ctx_t *)cookie;
+    lcbmt_tnode_t *node = lcbmt_wheel_advance(&mt->wheel, LCBMT_WHEEL_NOW());
+
+    while (node) {
+        lcbmt_tnode_t *next = node->next;
+        node->next = NULL;
+        node->expire(node);
+        node = next;
+    }
+
+    /** The event loop may be busy for a while; don't let the page go stale */
+    lcbmt_stats_update(mt);
+
+    if (!mt->wheel.count) {
+        lcb_timer_destroy(instance, timer);
+        mt->wheel_timer = NULL;
+    }
+}
+
+LCBMT_INTERNAL
+void lcbmt_timeout_init(lcbmt_op_t *op, lcbmt_token_t token)
+{
+    lcb_uint32_t usec = token->op_timeout ?
+                        token->op_timeout : op->parent->op_timeout;
+
+    if (usec) {
+        op->waiters.tnode.expiry = LCBMT_WHEEL_AFTER(usec);
+    }
+}
+
+LCBMT_INTERNAL
+int lcbmt_ctx_timer_add(lcbmt_ctx_t *mt,
+                        lcbmt_tnode_t *node,
+                        lcb_uint64_t expiry)
+{
+    /**
+     * The wheel is empty while the timer is not running; bring it up to
+     * date before adding to it.
+     */
+    if (!mt->wheel_timer) {
+        lcb_error_t err;
+
+        lcbmt_wheel_advance(&mt->wheel, LCBMT_WHEEL_NOW());
+        mt->wheel_timer = lcb_timer_create(mt->instance, mt,
+                                           LCBMT_WHEEL_TICK, 1,
+                                           wheel_tick, &err);
+        if (!mt->wheel_timer) {
+            return -1;
+        }
+    }
+    lcbmt_wheel_add(&mt->wheel, node, expiry);
+    return 0;
+}
+
+LCBMT_INTERNAL
+void lcbmt_ctx_timer_remove(lcbmt_ctx_t *mt, lcbmt_tnode_t *node)
+{
+    lcbmt_wheel_remove(&mt->wheel, node);
+}
+
+LCBMT_INTERNAL
+void lcbmt_ctx_timer_cleanup(lcbmt_ctx_t *mt)
+{
+    if (mt->wheel_timer) {
+        lcb_timer_destroy(mt->instance, mt->wheel_timer);
+        mt->wheel_timer = NULL;
+    }
+    if (mt->batch_timer) {
+        lcb_timer_destroy(mt->instance, mt->batch_timer);
+        mt->batch_timer = NULL;
+    }
+}
+
+/**
+ * Without a timer, the operation is left to the instance's timeout
+ */
+LCBMT_INTERNAL
+void lcbmt_timeout_start(lcbmt_op_t *op)
+{
+    lcbmt_waiter_t *w = &op->waiters;
+
+    if (w->tnode.expiry) {
+        w->tnode.expire = expire;
+        lcbmt_ctx_timer_add(op->parent, &w->tnode, w->tnode.expiry);
+    }
+}
+
+LCBMT_INTERNAL
+void lcbmt_timeout_stop(lcbmt_op_t *op)
+{
+    lcbmt_waiter_t *w;
+
+    for (w = &op->waiters; w; w = w->next) {
+        lcbmt_ctx_timer_remove(op->parent, &w->tnode);
+    }
+}
+
+LIBCOUCHBASE_API
+void lcb_mt_set_op_timeout(lcbmt_t mt, lcb_uint32_t usec)
+{
+    mt->op_timeout = usec;
+}
+
+LIBCOUCHBASE_API
+void lcb_mt_token_set_op_timeout(lcbmt_token_t token, lcb_uint32_t usec)
+{
+    token->op_timeout = usec;
+}
@@ -17,8 +17,24 @@ lcbmt_token_t lcb_mt_token_create(lcbmt_t mt)
 LIBCOUCHBASE_API
 void lcb_mt_token_destroy(lcbmt_token_t tok)
 {
+    /**
+     * The last response may have been dispatched while the IO thread is
+     * yet to return from the handoff
+     */
+    pthread_mutex_lock(&tok->mutex);
+    while (tok->handoff) {
+        pthread_cond_wait(&tok->cond, &tok->mutex);
+    }
+    pthread_mutex_unlock(&tok->mutex);
+
+    while (tok->records) {
+        lcbmt_record_t *next = tok->records->next;
+        lcbmt_record_destroy(tok->records);
+        tok->records = next;
+    }
     pthread_mutex_destroy(&tok->mutex);
     pthread_cond_destroy(&tok->cond);
+    free(tok->callbacks);
     free(tok);
 }
 
@@ -34,61 +50,231 @@ void lcb_mt_token_set_count(lcbmt_token_t tok, unsigned int count)
     tok->remaining = count;
 }
 
+LIBCOUCHBASE_API
+void lcb_mt_token_decr_count(lcbmt_token_t tok, unsigned int count)
+{
+    pthread_mutex_lock(&tok->mutex);
+    tok->remaining -= count;
+    lcbmt_token_signal(tok);
+    pthread_mutex_unlock(&tok->mutex);
+}
+
+LIBCOUCHBASE_API
+void lcb_mt_token_set_flags(lcbmt_token_t tok, int flags)
+{
+    tok->flags = flags;
+}
+
+LIBCOUCHBASE_API
+lcb_error_t lcb_mt_token_set_callbacks(lcbmt_token_t tok,
+                                       const struct lcb_mt_callback_table *tbl)
+{
+    struct lcb_mt_callback_table *copy = NULL;
+
+    if (tbl) {
+        copy = malloc(sizeof(*copy));
+        if (!copy) {
+            return LCB_CLIENT_ENOMEM;
+        }
+        *copy = *tbl;
+    }
+    free(tok->callbacks);
+    tok->callbacks = copy;
+    return LCB_SUCCESS;
+}
+
 typedef void (*generic_callback)(void);
 
-static void dispatch_callback(lcbmt_token_t token)
+LCBMT_INTERNAL
+generic_callback lcbmt_callback_for(const struct lcb_mt_callback_table *tbl,
+                                    lcbmt_resptype_t type)
+{
+    switch (type) {
+    case LCBMT_RESP_STORE:
+        return (generic_callback)tbl->v.v0.store;
+    case LCBMT_RESP_GET:
+        return (generic_callback)tbl->v.v0.get;
+    case LCBMT_RESP_REMOVE:
+        return (generic_callback)tbl->v.v0.remove;
+    case LCBMT_RESP_ARITHMETIC:
+        return (generic_callback)tbl->v.v0.arithmetic;
+    case LCBMT_RESP_TOUCH:
+        return (generic_callback)tbl->v.v0.touch;
+    case LCBMT_RESP_UNLOCK:
+        return (generic_callback)tbl->v.v0.unlock;
+    default:
+        return NULL;
+    }
+}
+
+LCBMT_INTERNAL
+void lcbmt_token_signal(lcbmt_token_t tok)
+{
+    /**
+     * Broadcast, as the IO thread may also be waiting on the condition for
+     * its own response to be consumed.
+     */
+    pthread_cond_broadcast(&tok->cond);
+
+    if (tok->waitset) {
+        lcbmt_waitset_t *ws = tok->waitset;
+        pthread_mutex_lock(&ws->lock);
+        ws->signalled = 1;
+        pthread_cond_signal(&ws->cond);
+        pthread_mutex_unlock(&ws->lock);
+    }
+}
+
+LCBMT_INTERNAL
+void lcbmt_token_push(lcbmt_token_t tok,
+                      const void *cookie,
+                      lcbmt_record_t *rec)
+{
+    lcbmt_ctx_t *mt = tok->parent;
+    int done;
+
+    if (rec) {
+        rec->ucookie = cookie;
+        rec->callback = lcbmt_callback_for(LCBMT_TOKEN_CALLBACKS(tok),
+                                           rec->type);
+        if (tok->parent->exec_submit && !(tok->flags & LCBMT_TOKEN_PULL)) {
+            lcbmt_exec_submit(tok, rec);
+            return;
+        }
+    }
+
+    pthread_mutex_lock(&tok->mutex);
+    if (rec) {
+        rec->next = NULL;
+        if (tok->last_record) {
+            tok->last_record->next = rec;
+        } else {
+            tok->records = rec;
+        }
+        tok->last_record = rec;
+    }
+    tok->remaining--;
+    done = tok->remaining == 0;
+
+    lcbmt_token_signal(tok);
+    pthread_mutex_unlock(&tok->mutex);
+
+    /**
+     * Records are pushed from the event loop too (e.g. for timeouts); a
+     * leader whose token is now done must leave the loop to consume them.
+     * The token may be gone by now.
+     */
+    if (done && mt->leader_follower) {
+        lcbmt_lf_yield(mt, tok);
+    }
+}
+
+LCBMT_INTERNAL
+void lcbmt_token_dispatch(lcbmt_token_t token,
+                          const void *cookie,
+                          lcbmt_resptype_t type,
+                          generic_callback target,
+                          lcb_error_t err,
+                          lcb_storage_t storop,
+                          const void *resp)
 {
-    void (*target)(void) = token->next_callback;
-    const struct lcb_mt_callback_table *tbl = &token->parent->callbacks;
     lcb_t instance = token->parent->instance;
 
-    if (target == (generic_callback)tbl->v.v0.store) {
-        tbl->v.v0.store(instance,
-                        token->ucookie,
-                        token->u_cb_special.storop,
-                        token->err,
-                        (const lcb_store_resp_t *)token->resp);
+    if (!target) {
+        return;
+    }
 
-    } else if (target == (generic_callback)tbl->v.v0.get) {
-        tbl->v.v0.get(instance, token->ucookie, token->err,
-                      (const lcb_get_resp_t *)token->resp);
+    switch (type) {
+    case LCBMT_RESP_STORE:
+        ((lcb_store_callback)target)(instance, cookie, storop, err,
+                                     (const lcb_store_resp_t *)resp);
+        break;
 
-    } else if (target == (generic_callback)tbl->v.v0.remove) {
-        tbl->v.v0.remove(instance, token->ucookie, token->err,
-                         (const lcb_remove_resp_t *)token->resp);
+    case LCBMT_RESP_GET:
+        ((lcb_get_callback)target)(instance, cookie, err,
+                                   (const lcb_get_resp_t *)resp);
+        break;
 
-    } else if (target == (generic_callback)tbl->v.v0.arithmetic) {
-        tbl->v.v0.arithmetic(instance, token->ucookie, token->err,
-                             (const lcb_arithmetic_resp_t*)token->resp);
+    case LCBMT_RESP_REMOVE:
+        ((lcb_remove_callback)target)(instance, cookie, err,
+                                      (const lcb_remove_resp_t *)resp);
+        break;
 
-    } else if (target == (generic_callback)tbl->v.v0.touch) {
-        tbl->v.v0.touch(instance, token->ucookie, token->err,
-                        (const lcb_touch_resp_t*)token->resp);
+    case LCBMT_RESP_ARITHMETIC:
+        ((lcb_arithmetic_callback)target)(instance, cookie, err,
+                                          (const lcb_arithmetic_resp_t *)resp);
+        break;
 
-    } else if (target == (generic_callback)tbl->v.v0.unlock) {
-        tbl->v.v0.unlock(instance, token->ucookie, token->err,
-                         (const lcb_unlock_resp_t*)token->resp);
+    case LCBMT_RESP_TOUCH:
+        ((lcb_touch_callback)target)(instance, cookie, err,
+                                     (const lcb_touch_resp_t *)resp);
+        break;
 
-    } else {
+    case LCBMT_RESP_UNLOCK:
+        ((lcb_unlock_callback)target)(instance, cookie, err,
+                                      (const lcb_unlock_resp_t *)resp);
+        break;
+
+    default:
         abort();
     }
 }
 
-static int get_single_response(lcbmt_token_t token)
+/**
+ * Dispatch one response to the user, either the one the IO thread is
+ * currently handing over, or a queued record. The callback is invoked
+ * without the token mutex held, so that it may schedule further operations
+ * on the token. The IO thread keeps waiting until next_callback is cleared,
+ * so the response remains valid in the meantime.
+ */
+LCBMT_INTERNAL
+int lcbmt_token_get_response(lcbmt_token_t token)
 {
     int ret;
+    lcbmt_record_t *rec = NULL;
 
     pthread_mutex_lock(&token->mutex);
-    while (!token->resp) {
+    while (!token->resp && !token->records) {
+        if (!token->remaining) {
+            pthread_mutex_unlock(&token->mutex);
+            return 0;
+        }
         pthread_cond_wait(&token->cond, &token->mutex);
     }
 
-    dispatch_callback(token);
-    token->resp = NULL;
-    token->next_callback = NULL;
-    ret = token->remaining;
+    if (token->resp) {
+        generic_callback target = token->next_callback;
+        lcbmt_resptype_t type = token->resptype;
+        const void *cookie = token->rcookie;
+        lcb_error_t err = token->err;
+        lcb_storage_t storop = token->u_cb_special.storop;
+        const void *resp = token->resp;
+
+        pthread_mutex_unlock(&token->mutex);
+        lcbmt_token_dispatch(token, cookie, type, target, err, storop, resp);
+        pthread_mutex_lock(&token->mutex);
+
+        token->resp = NULL;
+        token->next_callback = NULL;
+        pthread_cond_broadcast(&token->cond);
+
+    } else {
+        rec = token->records;
+        token->records = rec->next;
+        if (!token->records) {
+            token->last_record = NULL;
+        }
+    }
+    pthread_mutex_unlock(&token->mutex);
+
+    if (rec) {
+        lcbmt_token_dispatch(token, rec->ucookie, rec->type, rec->callback,
+                             rec->err, rec->storop, &rec->resp);
+        lcbmt_record_destroy(rec);
+    }
 
-    pthread_cond_signal(&token->cond);
+    pthread_mutex_lock(&token->mutex);
+    ret = token->remaining || token->records || token->resp;
     pthread_mutex_unlock(&token->mutex);
     return ret;
 }
@@ -96,5 +282,213 @@ static int get_single_response(lcbmt_token_t token)
 LIBCOUCHBASE_API
 void lcb_mt_token_wait(lcbmt_token_t token)
 {
-    while (get_single_response(token));
+    if (token->parent->leader_follower) {
+        lcbmt_lf_wait(token, 0);
+        return;
+    }
+    while (lcbmt_token_get_response(token));
+}
+
+LIBCOUCHBASE_API
+int lcb_mt_token_next(lcbmt_token_t token, struct lcb_mt_response *resp)
+{
+    lcbmt_record_t *rec;
+
+    if (token->parent->leader_follower) {
+        lcbmt_lf_wait(token, 1);
+    }
+
+    pthread_mutex_lock(&token->mutex);
+    while (!token->records) {
+        if (token->resp) {
+            /** Responses which can't be copied go to the callback */
+            pthread_mutex_unlock(&token->mutex);
+            lcbmt_token_get_response(token);
+            pthread_mutex_lock(&token->mutex);
+            continue;
+        }
+        if (!token->remaining) {
+            pthread_mutex_unlock(&token->mutex);
+            return 0;
+        }
+        pthread_cond_wait(&token->cond, &token->mutex);
+    }
+
+    rec = token->records;
+    token->records = rec->next;
+    if (!token->records) {
+        token->last_record = NULL;
+    }
+    pthread_mutex_unlock(&token->mutex);
+
+    lcbmt_record_export(rec, resp);
+    return 1;
+}
+
+LIBCOUCHBASE_API
+void lcb_mt_response_release(struct lcb_mt_response *resp)
+{
+    lcbmt_record_destroy(resp->record);
+    resp->record = NULL;
+}
+
+/**
+ * Whether the token has nothing more to deliver. Tokens in pull mode are
+ * also ready once a response is queued. Must be called with the token
+ * mutex held.
+ */
+static int token_is_ready(lcbmt_token_t token)
+{
+    if (token->resp) {
+        return 0;
+    }
+    if (token->records) {
+        return (token->flags & LCBMT_TOKEN_PULL) != 0;
+    }
+    return token->remaining == 0;
+}
+
+LIBCOUCHBASE_API
+int lcb_mt_token_ready(lcbmt_token_t token)
+{
+    int ret;
+    pthread_mutex_lock(&token->mutex);
+    ret = token_is_ready(token);
+    pthread_mutex_unlock(&token->mutex);
+    return ret;
+}
+
+/**
+ * Deliver whatever is pending on the tokens without blocking, and count those
+ * which are ready.
+ */
+static unsigned int poll_tokens(lcbmt_token_t *tokens,
+                                unsigned int ntokens,
+                                int *ready)
+{
+    unsigned int ii, nready = 0;
+
+    for (ii = 0; ii < ntokens; ii++) {
+        lcbmt_token_t token = tokens[ii];
+        int is_ready, pending;
+
+        while (1) {
+            pthread_mutex_lock(&token->mutex);
+            is_ready = token_is_ready(token);
+            pending = !is_ready && (token->resp || token->records);
+            pthread_mutex_unlock(&token->mutex);
+
+            if (!pending) {
+                break;
+            }
+            lcbmt_token_get_response(token);
+        }
+
+        if (ready) {
+            ready[ii] = is_ready;
+        }
+        nready += is_ready;
+    }
+    return nready;
+}
+
+static void set_waitset(lcbmt_token_t *tokens,
+                        unsigned int ntokens,
+                        lcbmt_waitset_t *ws)
+{
+    unsigned int ii;
+    for (ii = 0; ii < ntokens; ii++) {
+        pthread_mutex_lock(&tokens[ii]->mutex);
+        tokens[ii]->waitset = ws;
+        pthread_mutex_unlock(&tokens[ii]->mutex);
+    }
+}
+
+/**
+ * Wait until at least 'needed' of the tokens are ready. All the tokens
+ * signal a single condition, so the thread sleeps once no matter how many
+ * tokens it waits for.
+ */
+static lcb_error_t wait_tokens(lcbmt_token_t *tokens,
+                               unsigned int ntokens,
+                               unsigned int needed,
+                               lcb_uint32_t timeout,
+                               int *ready)
+{
+    lcbmt_waitset_t ws;
+    lcb_uint64_t deadline = 0;
+    lcb_error_t err = LCB_SUCCESS;
+
+    if (!ntokens) {
+        return LCB_SUCCESS;
+    }
+
+    if (tokens[0]->parent->leader_follower) {
+        return LCB_NOT_SUPPORTED;
+    }
+
+    if (timeout) {
+        deadline = lcbmt_now_usec() + timeout;
+    }
+
+    pthread_mutex_init(&ws.lock, NULL);
+    pthread_cond_init(&ws.cond, NULL);
+    ws.signalled = 0;
+    set_waitset(tokens, ntokens, &ws);
+
+    while (1) {
+        pthread_mutex_lock(&ws.lock);
+        ws.signalled = 0;
+        pthread_mutex_unlock(&ws.lock);
+
+        if (poll_tokens(tokens, ntokens, ready) >= needed) {
+            break;
+        }
+
+        pthread_mutex_lock(&ws.lock);
+        while (!ws.signalled) {
+            lcb_uint64_t now;
+
+            if (!timeout) {
+                pthread_cond_wait(&ws.cond, &ws.lock);
+                continue;
+            }
+
+            now = lcbmt_now_usec();
+            if (now >= deadline) {
+                err = LCB_ETIMEDOUT;
+                break;
+            }
+            lcbmt_cond_timedwait(&ws.cond, &ws.lock, deadline - now);
+        }
+        pthread_mutex_unlock(&ws.lock);
+
+        if (err != LCB_SUCCESS) {
+            poll_tokens(tokens, ntokens, ready);
+            break;
+        }
+    }
+
+    set_waitset(tokens, ntokens, NULL);
+    pthread_mutex_destroy(&ws.lock);
+    pthread_cond_destroy(&ws.cond);
+    return err;
+}
+
+LIBCOUCHBASE_API
+lcb_error_t lcb_mt_token_wait_any(lcbmt_token_t *tokens,
+                                  unsigned int ntokens,
+                                  lcb_uint32_t timeout,
+                                  int *ready)
+{
+    return wait_tokens(tokens, ntokens, 1, timeout, ready);
+}
+
+LIBCOUCHBASE_API
+lcb_error_t lcb_mt_token_wait_all(lcbmt_token_t *tokens,
+                                  unsigned int ntokens,
+                                  lcb_uint32_t timeout,
+                                  int *ready)
+{
+    return wait_tokens(tokens, ntokens, ntokens, timeout, ready);
 }
@@ -4,24 +4,30 @@
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
+#include <sys/mman.h>
 
 LCBMT_INTERNAL
-int lcbmt_init_locks(lcbmt_ctx_t *mt)
+int lcbmt_init_locks(lcbmt_loop_t loop)
 {
     int rv;
     pthread_mutexattr_t mattr;
     pthread_mutexattr_init(&mattr);
     pthread_mutexattr_setprioceiling(&mattr, 99);
 
-    if ((rv = pthread_mutex_init(&mt->wait_lock, NULL))) {
+    if ((rv = pthread_mutex_init(&loop->wait_lock, NULL))) {
         return rv;
     }
 
-    if ((rv == pthread_mutex_init(&mt->event_lock, &mattr))) {
+    if ((rv == pthread_mutex_init(&loop->event_lock, &mattr))) {
         return rv;
     }
 
-    if ((rv == pthread_cond_init(&mt->cond, NULL))) {
+    if ((rv == pthread_cond_init(&loop->cond, NULL))) {
+        return rv;
+    }
+
+    if ((rv = pthread_mutex_init(&loop->attach_lock, NULL))) {
         return rv;
     }
 
@@ -30,17 +36,19 @@ int lcbmt_init_locks(lcbmt_ctx_t *mt)
 }
 
 LCBMT_INTERNAL
-void lcbmt_cleanup_locks(lcbmt_ctx_t *mt)
+void lcbmt_cleanup_locks(lcbmt_loop_t loop)
 {
-    pthread_mutex_destroy(&mt->wait_lock);
-    pthread_mutex_destroy(&mt->event_lock);
+    pthread_mutex_destroy(&loop->wait_lock);
+    pthread_mutex_destroy(&loop->event_lock);
+    pthread_cond_destroy(&loop->cond);
+    pthread_mutex_destroy(&loop->attach_lock);
 }
 
 LCBMT_INTERNAL
-int lcbmt_blocking_connect(lcbmt_ctx_t *mt)
+int lcbmt_blocking_connect(lcbmt_loop_t loop)
 {
     int rv, old_flags, fd;
-    fd = mt->loopsock.ev.fd;
+    fd = loop->loopsock.ev.fd;
     old_flags = fcntl(fd, F_GETFL);
     if (old_flags == -1) {
         return -1;
@@ -49,7 +57,7 @@ int lcbmt_blocking_connect(lcbmt_ctx_t *mt)
     if (rv == -1) {
         return -1;
     }
-    rv = connect(fd, (struct sockaddr *)&mt->saddr, sizeof(mt->saddr));
+    rv = connect(fd, (struct sockaddr *)&loop->saddr, sizeof(loop->saddr));
     if (rv == 0) {
         fcntl(fd, F_SETFL, old_flags);
     }
@@ -57,10 +65,10 @@ int lcbmt_blocking_connect(lcbmt_ctx_t *mt)
 }
 
 LCBMT_INTERNAL
-int lcbmt_set_server_nonblocking(lcbmt_ctx_t *mt)
+int lcbmt_set_server_nonblocking(lcbmt_loop_t loop)
 {
     int rv, fd;
-    fd = mt->sock_accepted;
+    fd = loop->sock_accepted;
     rv = fcntl(fd, F_GETFL);
     if (rv == -1) {
         return rv;
@@ -71,20 +79,20 @@ int lcbmt_set_server_nonblocking(lcbmt_ctx_t *mt)
 
 struct mt_info {
     lcbmt_thrfunc fn;
-    lcbmt_ctx_t *ctx;
+    lcbmt_loop_t loop;
 };
 
 static void *pthr_wrap(void *arg)
 {
     struct mt_info *info = (struct mt_info *)arg;
-    info->fn(info->ctx);
+    info->fn(info->loop);
     free(info);
     return NULL;
 }
 
 
 LCBMT_INTERNAL
-int lcbmt_start_iops_thread(lcbmt_ctx_t *mt, lcbmt_thrfunc cb)
+int lcbmt_start_iops_thread(lcbmt_loop_t loop, lcbmt_thrfunc cb)
 {
     int rv;
     struct mt_info *info;
@@ -96,9 +104,63 @@ int lcbmt_start_iops_thread(lcbmt_ctx_t *mt, lcbmt_thrfunc cb)
     pthread_attr_setschedparam(&tattr, &schedp);
 
     info = malloc(sizeof(*info));
-    info->ctx = mt;
+    info->loop = loop;
     info->fn = cb;
-    rv = pthread_create(&mt->iothread, &tattr, pthr_wrap, info);
+    rv = pthread_create(&loop->iothread, &tattr, pthr_wrap, info);
     assert(!rv);
     return 0;
 }
+
+LCBMT_INTERNAL
+lcb_uint64_t lcbmt_now_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (lcb_uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+LCBMT_INTERNAL
+int lcbmt_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                         lcb_uint64_t usec)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    usec += ts.tv_nsec / 1000;
+    ts.tv_sec += usec / 1000000;
+    ts.tv_nsec = (usec % 1000000) * 1000;
+    return pthread_cond_timedwait(cond, mutex, &ts);
+}
+
+LCBMT_INTERNAL
+void *lcbmt_shm_create(const char *name, lcb_size_t size)
+{
+    int fd;
+    void *addr;
+
+    fd = shm_open(name, O_RDWR|O_CREAT|O_TRUNC, 0644);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    if (ftruncate(fd, size) != 0) {
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+
+    addr = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (addr == MAP_FAILED) {
+        shm_unlink(name);
+        return NULL;
+    }
+    return addr;
+}
+
+LCBMT_INTERNAL
+void lcbmt_shm_destroy(const char *name, void *addr, lcb_size_t size)
+{
+    munmap(addr, size);
+    shm_unlink(name);
+}
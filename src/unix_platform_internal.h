@@ -12,10 +12,15 @@ extern "C" {
 
 #define closesocket close
 
-#define LCBMT_CTX_FIELDS \
+/** Full memory barrier */
+#define lcbmt_barrier() __sync_synchronize()
+
+#define LCBMT_LOOP_FIELDS \
     pthread_t iothread; \
     pthread_mutex_t wait_lock; \
     pthread_mutex_t event_lock; \
+    pthread_mutex_t attach_lock; \
+    pthread_t lock_owner; \
     pthread_cond_t cond;
 
 #define LCBMT_TOKEN_FIELDS \
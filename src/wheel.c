@@ -0,0 +1,141 @@
+#include "mt_internal.h"
+
+/**
+ * Hierarchical timer wheel, used for per-operation timeouts. The first level
+ * has a slot per tick; the second a slot per revolution of the first. Nodes
+ * due within a revolution go straight into the first level, others into the
+ * second, from which they are moved down (cascaded) when the first level
+ * wraps around to their slot. Nodes due beyond the second level are parked
+ * in its last slot, and reinserted from there.
+ *
+ * Adding and removing nodes is O(1), and so is each tick unless nodes are
+ * due. The wheel is not synchronized; the context only uses it with the
+ * event lock held.
+ */
+
+static void list_init(lcbmt_tnode_t *head)
+{
+    head->next = head;
+    head->prev = head;
+}
+
+static void list_append(lcbmt_tnode_t *head, lcbmt_tnode_t *node)
+{
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+static void list_unlink(lcbmt_tnode_t *node)
+{
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->next = NULL;
+    node->prev = NULL;
+}
+
+LCBMT_INTERNAL
+void lcbmt_wheel_init(lcbmt_wheel_t *wheel, lcb_uint64_t now)
+{
+    unsigned int ii;
+
+    for (ii = 0; ii < LCBMT_WHEEL_L0; ii++) {
+        list_init(&wheel->l0[ii]);
+    }
+    for (ii = 0; ii < LCBMT_WHEEL_L1; ii++) {
+        list_init(&wheel->l1[ii]);
+    }
+    wheel->now = now;
+    wheel->count = 0;
+}
+
+static void insert(lcbmt_wheel_t *wheel, lcbmt_tnode_t *node)
+{
+    lcb_uint64_t expiry = node->expiry;
+    lcb_uint64_t delta;
+
+    if (expiry < wheel->now) {
+        expiry = wheel->now;
+    }
+    delta = expiry - wheel->now;
+
+    if (delta < LCBMT_WHEEL_L0) {
+        list_append(&wheel->l0[expiry % LCBMT_WHEEL_L0], node);
+
+    } else if (delta < (lcb_uint64_t)LCBMT_WHEEL_L0 * LCBMT_WHEEL_L1) {
+        list_append(&wheel->l1[(expiry / LCBMT_WHEEL_L0) % LCBMT_WHEEL_L1],
+                    node);
+
+    } else {
+        lcb_uint64_t last = wheel->now / LCBMT_WHEEL_L0 + LCBMT_WHEEL_L1 - 1;
+        list_append(&wheel->l1[last % LCBMT_WHEEL_L1], node);
+    }
+}
+
+LCBMT_INTERNAL
+void lcbmt_wheel_add(lcbmt_wheel_t *wheel,
+                     lcbmt_tnode_t *node,
+                     lcb_uint64_t expiry)
+{
+    node->expiry = expiry;
+    insert(wheel, node);
+    wheel->count++;
+}
+
+LCBMT_INTERNAL
+void lcbmt_wheel_remove(lcbmt_wheel_t *wheel, lcbmt_tnode_t *node)
+{
+    if (node->next) {
+        list_unlink(node);
+        wheel->count--;
+    }
+}
+
+LCBMT_INTERNAL
+void lcbmt_wheel_replace(lcbmt_tnode_t *node, lcbmt_tnode_t *copy)
+{
+    if (node->next) {
+        copy->next->prev = copy;
+        copy->prev->next = copy;
+        node->next = NULL;
+        node->prev = NULL;
+    }
+}
+
+LCBMT_INTERNAL
+lcbmt_tnode_t *lcbmt_wheel_advance(lcbmt_wheel_t *wheel, lcb_uint64_t now)
+{
+    lcbmt_tnode_t *expired = NULL;
+
+    while (wheel->now < now && wheel->count) {
+        lcbmt_tnode_t *head;
+
+        wheel->now++;
+
+        /** Move the nodes of the second level slot we've reached down */
+        if (wheel->now % LCBMT_WHEEL_L0 == 0) {
+            head = &wheel->l1[(wheel->now / LCBMT_WHEEL_L0) % LCBMT_WHEEL_L1];
+            while (head->next != head) {
+                lcbmt_tnode_t *node = head->next;
+                list_unlink(node);
+                insert(wheel, node);
+            }
+        }
+
+        head = &wheel->l0[wheel->now % LCBMT_WHEEL_L0];
+        while (head->next != head) {
+            lcbmt_tnode_t *node = head->next;
+            list_unlink(node);
+            wheel->count--;
+            node->next = expired;
+            expired = node;
+        }
+    }
+
+    /** Nothing is due in between; catch up at once */
+    if (wheel->now < now) {
+        wheel->now = now;
+    }
+    return expired;
+}